@@ -0,0 +1,250 @@
+/*
+** bench/bench.c - throughput benchmark for mruby-marshal-c
+**
+** Dumps and loads a set of representative payloads through String and
+** stdio sinks/sources and reports MB/s, objects/s and allocations per
+** operation. See Makefile and build_config.rb for how to build it.
+*/
+
+#include <mruby.h>
+#include <mruby/compile.h>
+#include <mruby/error.h>
+#include <mruby/marshal.h>
+#include <mruby/object.h>
+#include <mruby/string.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_MIN_SECONDS 0.5
+
+static const char bench_prelude[] =
+    "BenchRow = Struct.new(:id, :name, :score)\n"
+    "class BenchUser\n"
+    "  def initialize(i) @id = i; @name = \"user#{i}\"; @tags = [:a, :b] end\n"
+    "end\n"
+    "class BenchCustom\n"
+    "  def initialize(i) @i = i end\n"
+    "  def marshal_dump; [@i, 'custom'] end\n"
+    "  def marshal_load(a) @i = a[0] end\n"
+    "end\n"
+    "def bench_objects(obj, seen = {})\n"
+    "  case obj\n"
+    "  when Integer, Symbol, NilClass, TrueClass, FalseClass then return 1\n"
+    "  end\n"
+    "  return 1 if seen.key?(obj.object_id)\n"
+    "  seen[obj.object_id] = true\n"
+    "  case obj\n"
+    "  when Array then obj.inject(1) { |n, e| n + bench_objects(e, seen) }\n"
+    "  when Hash\n"
+    "    obj.inject(1) { |n, (k, v)| n + bench_objects(k, seen) + bench_objects(v, seen) }\n"
+    "  when Struct then obj.to_a.inject(1) { |n, e| n + bench_objects(e, seen) }\n"
+    "  when String, Float then 1\n"
+    "  else\n"
+    "    obj.instance_variables.inject(1) do |n, iv|\n"
+    "      n + bench_objects(obj.instance_variable_get(iv), seen)\n"
+    "    end\n"
+    "  end\n"
+    "end\n";
+
+struct bench_shape {
+  const char *name;
+  const char *build; /* Ruby expression returning the payload */
+};
+
+static const struct bench_shape bench_shapes[] = {
+    {"fixnum_array", "Array.new(1_000_000) { |i| i * 7919 - 500_000 }"},
+    {"float_array", "Array.new(200_000) { |i| i * 0.25 }"},
+    {"binary_string", "\"\\xff\" * (8 * 1024 * 1024)"},
+    {"symbol_hash", "h = {}; 100_000.times { |i| h[:\"key#{i}\"] = i }; h"},
+    {"deep_nesting",
+     "Array.new(200) { x = []; 200.times { |i| x = [x, i] }; x }"},
+    {"link_graph",
+     "s = Array.new(1000) { |i| \"s#{i}\" }; Array.new(200_000) { |i| s[i % "
+     "1000] }"},
+    {"struct_array",
+     "Array.new(100_000) { |i| BenchRow.new(i, \"n#{i}\", i * 0.5) }"},
+    {"object_array", "Array.new(100_000) { |i| BenchUser.new(i) }"},
+    {"marshal_dump_array", "Array.new(100_000) { |i| BenchCustom.new(i) }"},
+};
+
+static size_t bench_allocs;
+
+static void *bench_allocf(mrb_state *mrb, void *p, size_t size, void *ud) {
+  if (size == 0) {
+    free(p);
+    return NULL;
+  }
+  bench_allocs++;
+  return realloc(p, size);
+}
+
+static int bench_writer_string(mrb_state *mrb, const void *src, int size,
+                               mrb_value dest, mrb_uint position) {
+  mrb_str_cat(mrb, dest, (const char *)src, (size_t)size);
+  return size;
+}
+
+static int bench_writer_file(mrb_state *mrb, const void *src, int size,
+                             mrb_value dest, mrb_uint position) {
+  return (int)fwrite(src, 1, (size_t)size, (FILE *)mrb_cptr(dest));
+}
+
+static int bench_reader_file(mrb_state *mrb, mrb_value src, void *dest,
+                             int size, mrb_uint position) {
+  return (int)fread(dest, 1, (size_t)size, (FILE *)mrb_cptr(src));
+}
+
+struct bench_ctx {
+  mrb_value payload;
+  mrb_value dumped;
+  FILE *fp;
+};
+
+typedef void (*bench_func)(mrb_state *, struct bench_ctx *);
+
+static void bench_dump_string(mrb_state *mrb, struct bench_ctx *ctx) {
+  mrb_value str = mrb_str_new(mrb, NULL, 0);
+  mrb_marshal_dump(mrb, ctx->payload, bench_writer_string, str, -1);
+}
+
+static void bench_dump_file(mrb_state *mrb, struct bench_ctx *ctx) {
+  rewind(ctx->fp);
+  mrb_marshal_dump(mrb, ctx->payload, bench_writer_file,
+                   mrb_cptr_value(mrb, ctx->fp), -1);
+  fflush(ctx->fp);
+}
+
+static void bench_load_string(mrb_state *mrb, struct bench_ctx *ctx) {
+  mrb_marshal_load(mrb, NULL, ctx->dumped);
+}
+
+static void bench_load_file(mrb_state *mrb, struct bench_ctx *ctx) {
+  rewind(ctx->fp);
+  mrb_marshal_load(mrb, bench_reader_file, mrb_cptr_value(mrb, ctx->fp));
+}
+
+static void bench_deep_copy(mrb_state *mrb, struct bench_ctx *ctx) {
+  mrb_marshal_deep_copy(mrb, ctx->payload, -1);
+}
+
+static const struct {
+  const char *name;
+  bench_func func;
+} bench_ops[] = {
+    {"dump/string", bench_dump_string},
+    {"dump/file", bench_dump_file},
+    {"load/string", bench_load_string},
+    {"load/file", bench_load_file},
+    {"deep_copy", bench_deep_copy},
+};
+
+struct bench_run {
+  struct bench_ctx *ctx;
+  bench_func func;
+  long iterations;
+  double seconds;
+  size_t allocs;
+};
+
+static double bench_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static mrb_value bench_run_body(mrb_state *mrb, void *ud) {
+  struct bench_run *run = (struct bench_run *)ud;
+  double start = bench_now();
+  size_t allocs = bench_allocs;
+
+  do {
+    int ai = mrb_gc_arena_save(mrb);
+    run->func(mrb, run->ctx);
+    mrb_gc_arena_restore(mrb, ai);
+    run->iterations++;
+    run->seconds = bench_now() - start;
+  } while (run->seconds < BENCH_MIN_SECONDS);
+  run->allocs = bench_allocs - allocs;
+  return mrb_nil_value();
+}
+
+static mrb_value bench_eval(mrb_state *mrb, const char *code) {
+  mrb_value v = mrb_load_string(mrb, code);
+  if (mrb->exc) {
+    mrb_print_error(mrb);
+    exit(EXIT_FAILURE);
+  }
+  return v;
+}
+
+int main(int argc, char **argv) {
+  mrb_state *mrb = mrb_open_allocf(bench_allocf, NULL);
+  size_t i, j;
+
+  if (!mrb) {
+    fputs("mrb_open failed\n", stderr);
+    return EXIT_FAILURE;
+  }
+  bench_eval(mrb, bench_prelude);
+
+  printf("%-20s %-12s %10s %10s %14s %14s\n", "shape", "op", "bytes",
+         "MB/s", "objects/s", "allocs/op");
+  for (i = 0; i < sizeof(bench_shapes) / sizeof(bench_shapes[0]); i++) {
+    const struct bench_shape *shape = &bench_shapes[i];
+    struct bench_ctx ctx;
+    mrb_int objects;
+    mrb_int bytes;
+    int ai = mrb_gc_arena_save(mrb);
+
+    if (argc > 1 && strcmp(argv[1], shape->name) != 0)
+      continue;
+
+    ctx.payload = bench_eval(mrb, shape->build);
+    mrb_gc_register(mrb, ctx.payload);
+    objects = mrb_integer(mrb_funcall_id(mrb, mrb_top_self(mrb),
+                                         mrb_intern_lit(mrb, "bench_objects"),
+                                         1, ctx.payload));
+    ctx.dumped = mrb_str_new(mrb, NULL, 0);
+    mrb_marshal_dump(mrb, ctx.payload, bench_writer_string, ctx.dumped, -1);
+    mrb_gc_register(mrb, ctx.dumped);
+    bytes = RSTRING_LEN(ctx.dumped);
+    ctx.fp = tmpfile();
+    if (!ctx.fp) {
+      perror("tmpfile");
+      return EXIT_FAILURE;
+    }
+    fwrite(RSTRING_PTR(ctx.dumped), 1, (size_t)bytes, ctx.fp);
+    fflush(ctx.fp);
+
+    for (j = 0; j < sizeof(bench_ops) / sizeof(bench_ops[0]); j++) {
+      struct bench_run run = {&ctx, bench_ops[j].func, 0, 0.0, 0};
+      mrb_bool error = FALSE;
+      mrb_value exc = mrb_protect_error(mrb, bench_run_body, &run, &error);
+
+      if (error) {
+        fprintf(stderr, "%s %s failed\n", shape->name, bench_ops[j].name);
+        mrb->exc = mrb_obj_ptr(exc);
+        mrb_print_error(mrb);
+        mrb->exc = NULL;
+        continue;
+      }
+      printf("%-20s %-12s %10ld %10.1f %14.0f %14.1f\n", shape->name,
+             bench_ops[j].name, (long)bytes,
+             bytes * run.iterations / run.seconds / 1e6,
+             objects * run.iterations / run.seconds,
+             (double)run.allocs / run.iterations);
+    }
+
+    fclose(ctx.fp);
+    mrb_gc_unregister(mrb, ctx.dumped);
+    mrb_gc_unregister(mrb, ctx.payload);
+    mrb_gc_arena_restore(mrb, ai);
+    mrb_full_gc(mrb);
+  }
+
+  mrb_close(mrb);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,15 @@
+# mruby build configuration for the benchmark harness in this directory.
+#
+#   cd /path/to/mruby
+#   rake MRUBY_CONFIG=/path/to/mruby-marshal-c/bench/build_config.rb
+#   make -C /path/to/mruby-marshal-c/bench MRUBY_ROOT=/path/to/mruby run
+
+MRuby::Build.new do |conf|
+  conf.toolchain
+  conf.gembox 'default'
+  conf.gem core: 'mruby-struct'
+  conf.gem core: 'mruby-bin-config'
+  conf.gem File.expand_path('..', __dir__)
+
+  conf.cc.flags << '-O2'
+end
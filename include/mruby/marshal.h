@@ -1,41 +1,188 @@
-/*
-** mruby/marshal.h - Marshal class
-*/
-
-#ifndef MRUBY_MARSHAL_H
-#define MRUBY_MARSHAL_H
-
-#include "mruby/common.h"
-
-MRB_BEGIN_DECL
-
-/**
- * Function pointer type for mruby-marshal-c writer.
- *
- * @param mrb mrb_state
- * @param src source data
- * @param size size of data to write
- * @param dest the target to write, maybe an IO or a String, etc.
- * @param position the write position of dest
- * @return bytes written
- */
-typedef int (*mrb_marshal_writer_t)(mrb_state *mrb, const void *src, int size, mrb_value dest, mrb_uint position);
-
-/**
- * Function pointer type for mruby-marshal-c reader.
- *
- * @param mrb mrb_state
- * @param src the source to read, maybe an IO or a String, etc.
- * @param dest the target to write
- * @param size size of data to read
- * @param position the read position of src
- * @return bytes read
- */
-typedef int (*mrb_marshal_reader_t)(mrb_state *mrb, mrb_value src, void *dest, int size, mrb_uint position);
-
-MRB_API void mrb_marshal_dump(mrb_state *mrb, mrb_value obj, mrb_marshal_writer_t writer, mrb_value target, int limit);
-MRB_API mrb_value mrb_marshal_load(mrb_state *mrb, mrb_marshal_reader_t reader, mrb_value source);
-
-MRB_END_DECL
-
-#endif /* MRUBY_MARSHAL_H */
+/*
+** mruby/marshal.h - Marshal class
+*/
+
+#ifndef MRUBY_MARSHAL_H
+#define MRUBY_MARSHAL_H
+
+#include "mruby/common.h"
+
+MRB_BEGIN_DECL
+
+/**
+ * Function pointer type for mruby-marshal-c writer.
+ *
+ * @param mrb mrb_state
+ * @param src source data
+ * @param size size of data to write
+ * @param dest the target to write, maybe an IO or a String, etc.
+ * @param position the write position of dest
+ * @return bytes written
+ */
+typedef int (*mrb_marshal_writer_t)(mrb_state *mrb, const void *src, int size, mrb_value dest, mrb_uint position);
+
+/**
+ * Function pointer type for mruby-marshal-c reader.
+ *
+ * @param mrb mrb_state
+ * @param src the source to read, maybe an IO or a String, etc.
+ * @param dest the target to write
+ * @param size size of data to read
+ * @param position the read position of src
+ * @return bytes read
+ */
+typedef int (*mrb_marshal_reader_t)(mrb_state *mrb, mrb_value src, void *dest, int size, mrb_uint position);
+
+/**
+ * Per-call counters filled by dump and load when requested through the
+ * options. The structure is cleared at the start of each call.
+ */
+typedef struct mrb_marshal_stats {
+  /* bytes written or read */
+  mrb_uint bytes;
+  /* writer or reader callback invocations */
+  mrb_uint io_calls;
+  /* user callbacks: marshal_dump, _dump, _dump_data, marshal_load, _load, etc. */
+  mrb_uint user_calls;
+  /* `@` object links */
+  mrb_uint links;
+  /* `;` symbol links */
+  mrb_uint symlinks;
+  /* size of the object link table at the end of the call */
+  mrb_uint peak_links;
+  /* wall time in seconds */
+  double seconds;
+  /* number of values per type tag, e.g. types['['] for arrays */
+  mrb_uint types[256];
+} mrb_marshal_stats;
+
+/* Write an `E` ivar (CRuby encoding) for ASCII and UTF-8 strings and symbols. */
+#define MRB_MARSHAL_DUMP_ENCODING 1
+/* Compress the output with the built-in LZ codec; loads detect it. */
+#define MRB_MARSHAL_DUMP_COMPRESS_LZ 2
+/* Wrap the output in CRC32C-checked chunks; loads verify it before parsing. */
+#define MRB_MARSHAL_DUMP_CHECKSUM 4
+/* Write hash entries in an order independent of insertion order. */
+#define MRB_MARSHAL_DUMP_CANONICAL 8
+/*
+ * Write a plain String equal to one already written as a link to it, so
+ * equal strings load as a single object. One used as a hash key is frozen
+ * by the load, wherever else it appears.
+ */
+#define MRB_MARSHAL_DUMP_DEDUP_STRINGS 16
+/*
+ * Write the class and ivar names of plain objects once per layout, and
+ * then only the ivar values of each object of that layout. The stream
+ * starts with a frame loads detect; CRuby cannot read it.
+ */
+#define MRB_MARSHAL_DUMP_SHAPES 32
+
+/**
+ * Options for mrb_marshal_dump2().
+ */
+typedef struct mrb_marshal_dump_options {
+  /* MRB_MARSHAL_DUMP_* flags */
+  uint32_t flags;
+  /* counters to fill, or NULL */
+  mrb_marshal_stats *stats;
+} mrb_marshal_dump_options;
+
+/*
+ * Decode large arrays and hashes only as their elements are accessed; they
+ * load as Marshal::LazyArray and Marshal::LazyHash proxies. Applies to
+ * String sources and compressed streams; other IO sources load eagerly.
+ */
+#define MRB_MARSHAL_LOAD_LAZY 1
+/*
+ * Defer the GC for the duration of the load. Loaded objects are registered
+ * as GC roots as they are created, and a full collection runs whenever
+ * gc_cap objects were allocated since the last one.
+ */
+#define MRB_MARSHAL_LOAD_QUIET_GC 2
+/*
+ * Load plain Strings frozen, with equal ones as a single object. Other
+ * objects are left unfrozen.
+ */
+#define MRB_MARSHAL_LOAD_FREEZE 4
+
+/**
+ * Options for mrb_marshal_load2().
+ */
+typedef struct mrb_marshal_load_options {
+  /* MRB_MARSHAL_LOAD_* flags */
+  uint32_t flags;
+  /* counters to fill, or NULL */
+  mrb_marshal_stats *stats;
+  /*
+   * Limits for untrusted input, 0 for none; exceeding one raises
+   * ArgumentError before the allocation. max_alloc is a budget for the
+   * whole load, charged with string bytes and the slots of arrays, hashes
+   * and instance variables.
+   */
+  mrb_int max_alloc;
+  /* bytes of a single string, symbol or regexp source */
+  mrb_int max_string;
+  /* elements of a single array, hash or struct, ivars of an object */
+  mrb_int max_collection;
+  /* with MRB_MARSHAL_LOAD_QUIET_GC, 0 for the default of 1M objects */
+  mrb_int gc_cap;
+} mrb_marshal_load_options;
+
+struct mrb_data_type;
+
+/**
+ * Writes the bytes of a registered data object to dest if they fit in capa
+ * bytes, and returns their length either way; if they did not fit it is
+ * called once more with a buffer of that length. A negative return raises.
+ */
+typedef mrb_int (*mrb_marshal_data_dump_t)(mrb_state *mrb, mrb_value obj, void *dest, mrb_int capa);
+/**
+ * Returns the DATA_PTR of an object restored from len bytes at src. src is
+ * only valid for the duration of the call.
+ */
+typedef void *(*mrb_marshal_data_load_t)(mrb_state *mrb, const void *src, mrb_int len);
+
+MRB_API void mrb_marshal_dump(mrb_state *mrb, mrb_value obj, mrb_marshal_writer_t writer, mrb_value target, int limit);
+MRB_API void mrb_marshal_dump2(mrb_state *mrb, mrb_value obj, mrb_marshal_writer_t writer, mrb_value target, int limit, const mrb_marshal_dump_options *opts);
+/**
+ * Dumps obj to a file descriptor. The output is handed in 64KiB chunks to a
+ * worker thread that compresses (with MRB_MARSHAL_DUMP_COMPRESS_LZ) and
+ * writes them, overlapping the traversal with compression and I/O.
+ *
+ * @param fd file descriptor open for writing
+ */
+MRB_API void mrb_marshal_dump_fd(mrb_state *mrb, mrb_value obj, int fd, int limit, const mrb_marshal_dump_options *opts);
+/**
+ * Returns the 64-bit XXH64 hash of what dump would write for obj, without
+ * building the output. Framing flags are ignored; with
+ * MRB_MARSHAL_DUMP_CANONICAL equal hashes hash equal regardless of order.
+ */
+MRB_API uint64_t mrb_marshal_digest(mrb_state *mrb, mrb_value obj, int limit, const mrb_marshal_dump_options *opts);
+/**
+ * Loads an object from source.
+ *
+ * @param mrb mrb_state
+ * @param reader reader callback, or NULL to read a String source in place
+ * @param source the source to read, passed to reader
+ * @return the loaded object
+ */
+MRB_API mrb_value mrb_marshal_load(mrb_state *mrb, mrb_marshal_reader_t reader, mrb_value source);
+MRB_API mrb_value mrb_marshal_load2(mrb_state *mrb, mrb_marshal_reader_t reader, mrb_value source, const mrb_marshal_load_options *opts);
+/**
+ * Registers C callbacks that dump and load instances of klass and its
+ * subclasses in place of _dump_data and _load_data. Objects are dumped by
+ * their data type and restored with it. The bytes are written as the String
+ * a _dump_data would return, so a _load_data taking them can still read the
+ * output where the callbacks are not registered.
+ */
+MRB_API void mrb_marshal_register_data(mrb_state *mrb, struct RClass *klass, const struct mrb_data_type *type, mrb_marshal_data_dump_t dump, mrb_marshal_data_load_t load);
+/**
+ * Returns a deep copy of obj with the result of
+ * Marshal.load(Marshal.dump(obj)), copying object to object without
+ * building the serialized bytes.
+ */
+MRB_API mrb_value mrb_marshal_deep_copy(mrb_state *mrb, mrb_value obj, int limit);
+
+MRB_END_DECL
+
+#endif /* MRUBY_MARSHAL_H */
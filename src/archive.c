@@ -0,0 +1,448 @@
+/* a 64-bit off_t, so that archives can pass 2GB on 32-bit hosts */
+#ifndef _FILE_OFFSET_BITS
+#define _FILE_OFFSET_BITS 64
+#endif
+
+#include <mruby.h>
+#include <mruby/value.h>
+#include <mruby/marshal.h>
+#include <mruby/array.h>
+#include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/error.h>
+#include <mruby/hash.h>
+#include <mruby/string.h>
+#include <mruby/variable.h>
+#include <mruby/presym.h>
+
+#include "common.h"
+#include <errno.h>
+#include <string.h>
+
+/*
+ * Marshal::Archive - many independently marshalled records in one file with
+ * a trailing index, so a single record can be read without loading the rest.
+ *
+ *   "MAR\001"
+ *   record 0, record 1, ...          each a complete Marshal.dump
+ *   index                            Marshal.dump([offsets, keys])
+ *   <index offset u64 LE><index length u64 LE>"MAR\001"
+ *
+ * offsets is a flat Array of offset/length pairs, keys a Hash from record
+ * key to record number.
+ */
+
+#define ARCHIVE_MAGIC "MAR\001"
+#define ARCHIVE_MAGIC_LEN 4
+#define ARCHIVE_TRAILER_LEN (16 + ARCHIVE_MAGIC_LEN)
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+#define MARSHAL_HAVE_ARCHIVE 1
+#endif
+
+#ifdef MARSHAL_HAVE_ARCHIVE
+struct _archive
+{
+  int fd;
+  uint32_t flags;
+  mrb_int index_offset;
+};
+
+static void
+_archive_free(mrb_state *mrb, void *p)
+{
+  struct _archive *a = (struct _archive *)p;
+  if (a->fd >= 0)
+  {
+    close(a->fd);
+  }
+  mrb_free(mrb, a);
+}
+
+static const struct mrb_data_type _archive_type = { "Marshal::Archive", _archive_free };
+static const struct mrb_data_type _archive_writer_type = { "Marshal::Archive::Writer", _archive_free };
+
+static struct _archive *
+_archive_get(mrb_state *mrb, mrb_value self, const struct mrb_data_type *type)
+{
+  struct _archive *a = (struct _archive *)mrb_data_get_ptr(mrb, self, type);
+  if (!a || a->fd < 0)
+  {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "closed archive");
+  }
+  return a;
+}
+
+static void
+_archive_put64(uint8_t *p, uint64_t x)
+{
+  int i;
+  for (i = 0; i < 8; i++)
+  {
+    p[i] = (uint8_t)(x >> (i * 8));
+  }
+}
+
+static uint64_t
+_archive_get64(const uint8_t *p)
+{
+  uint64_t x = 0;
+  int i;
+  for (i = 7; i >= 0; i--)
+  {
+    x = (x << 8) | p[i];
+  }
+  return x;
+}
+
+static void
+_archive_write_all(mrb_state *mrb, int fd, const void *buf, size_t len)
+{
+  const char *p = (const char *)buf;
+  while (len > 0)
+  {
+    ssize_t n = write(fd, p, len);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+        continue;
+      mrb_sys_fail(mrb, "Marshal::Archive");
+    }
+    p += n;
+    len -= n;
+  }
+}
+
+static void
+_archive_pread_all(mrb_state *mrb, int fd, void *buf, size_t len, off_t off)
+{
+  char *p = (char *)buf;
+  while (len > 0)
+  {
+    ssize_t n = pread(fd, p, len, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      mrb_sys_fail(mrb, "Marshal::Archive");
+    if (n == 0)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+    p += n;
+    off += n;
+    len -= n;
+  }
+}
+
+static int
+_archive_writer_fd(mrb_state *mrb, const void *src, int size, mrb_value dest, mrb_uint position)
+{
+  _archive_write_all(mrb, (int)mrb_fixnum(dest), src, (size_t)size);
+  return size;
+}
+
+/* Offsets are kept as mrb_int, which may be narrower than off_t. */
+static void
+_archive_check_offset(mrb_state *mrb, uint64_t offset)
+{
+  if (offset > (uint64_t)MRB_INT_MAX)
+  {
+    mrb_raise(mrb, E_RANGE_ERROR, "archive too large for this platform");
+  }
+}
+
+struct _archive_dump_arg
+{
+  struct _archive *a;
+  mrb_value obj;
+  off_t end;
+};
+
+static mrb_value
+_archive_dump_body(mrb_state *mrb, void *ud)
+{
+  struct _archive_dump_arg *d = (struct _archive_dump_arg *)ud;
+  mrb_marshal_dump_options opts = { 0 };
+  opts.flags = d->a->flags;
+  mrb_marshal_dump2(mrb, d->obj, _archive_writer_fd, mrb_fixnum_value(d->a->fd), -1, &opts);
+  d->end = lseek(d->a->fd, 0, SEEK_CUR);
+  if (d->end < 0)
+  {
+    mrb_sys_fail(mrb, "Marshal::Archive");
+  }
+  _archive_check_offset(mrb, (uint64_t)d->end);
+  return mrb_nil_value();
+}
+
+/*
+ * Dumps obj at the current end of the file; returns its offset and length.
+ * A dump that fails partway is cut off again, so the next record starts
+ * where this one would have.
+ */
+static void
+_archive_dump(mrb_state *mrb, struct _archive *a, mrb_value obj, mrb_int *offset, mrb_int *len)
+{
+  struct _archive_dump_arg d;
+  mrb_value exc;
+  mrb_bool error;
+  off_t start = lseek(a->fd, 0, SEEK_CUR);
+  if (start < 0)
+  {
+    mrb_sys_fail(mrb, "Marshal::Archive");
+  }
+  d.a = a;
+  d.obj = obj;
+  d.end = start;
+  exc = mrb_protect_error(mrb, _archive_dump_body, &d, &error);
+  if (error)
+  {
+    if (ftruncate(a->fd, start) != 0 || lseek(a->fd, start, SEEK_SET) < 0)
+    {
+      mrb_sys_fail(mrb, "Marshal::Archive");
+    }
+    mrb_exc_raise(mrb, exc);
+  }
+  *offset = (mrb_int)start;
+  *len = (mrb_int)(d.end - start);
+}
+
+static mrb_value
+_archive_read(mrb_state *mrb, struct _archive *a, mrb_int offset, mrb_int len)
+{
+  mrb_value buf;
+  if ((uint64_t)len > (uint64_t)SIZE_MAX)
+  {
+    mrb_raise(mrb, E_RANGE_ERROR, "archive record too large for this platform");
+  }
+  buf = mrb_str_new(mrb, NULL, len);
+  _archive_pread_all(mrb, a->fd, RSTRING_PTR(buf), (size_t)len, (off_t)offset);
+  return mrb_marshal_load(mrb, NULL, buf);
+}
+
+static mrb_value
+mrb_mruby_marshal_archive_writer_init(mrb_state *mrb, mrb_value self)
+{
+  static const mrb_sym kw_names[] = { MRB_SYM(compress), MRB_SYM(checksum) };
+  mrb_value kw_values[sizeof(kw_names) / sizeof(kw_names[0])];
+  mrb_kwargs kwargs = { sizeof(kw_names) / sizeof(kw_names[0]), 0, kw_names, kw_values, NULL };
+  struct _archive *a;
+  const char *path;
+  mrb_get_args(mrb, "z:", &path, &kwargs);
+
+  a = (struct _archive *)mrb_calloc(mrb, 1, sizeof(struct _archive));
+  a->fd = -1;
+  mrb_data_init(self, a, &_archive_writer_type);
+  if (!mrb_undef_p(kw_values[0]) && !mrb_nil_p(kw_values[0]))
+  {
+    if (!mrb_symbol_p(kw_values[0]) || mrb_symbol(kw_values[0]) != MRB_SYM(lz))
+    {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown compression %v", kw_values[0]);
+    }
+    a->flags |= MRB_MARSHAL_DUMP_COMPRESS_LZ;
+  }
+  if (!mrb_undef_p(kw_values[1]) && mrb_test(kw_values[1]))
+  {
+    a->flags |= MRB_MARSHAL_DUMP_CHECKSUM;
+  }
+  a->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (a->fd < 0)
+  {
+    mrb_sys_fail(mrb, path);
+  }
+  _archive_write_all(mrb, a->fd, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN);
+  mrb_iv_set(mrb, self, MRB_IVSYM(offsets), mrb_ary_new(mrb));
+  mrb_iv_set(mrb, self, MRB_IVSYM(keys), mrb_hash_new(mrb));
+  return self;
+}
+
+static mrb_value
+mrb_mruby_marshal_archive_writer_add(mrb_state *mrb, mrb_value self)
+{
+  struct _archive *a = _archive_get(mrb, self, &_archive_writer_type);
+  mrb_value obj, key = mrb_nil_value();
+  mrb_value offsets = mrb_iv_get(mrb, self, MRB_IVSYM(offsets));
+  mrb_int offset, len, index;
+  mrb_get_args(mrb, "o|o", &obj, &key);
+  /* Integers stay record numbers for Archive#[] */
+  if (!mrb_nil_p(key) && !mrb_string_p(key) && !mrb_symbol_p(key))
+  {
+    mrb_raisef(mrb, E_TYPE_ERROR, "archive key must be a String or Symbol, not %C", mrb_obj_class(mrb, key));
+  }
+
+  _archive_dump(mrb, a, obj, &offset, &len);
+  index = RARRAY_LEN(offsets) / 2;
+  mrb_ary_push(mrb, offsets, mrb_int_value(mrb, offset));
+  mrb_ary_push(mrb, offsets, mrb_int_value(mrb, len));
+  if (!mrb_nil_p(key))
+  {
+    mrb_hash_set(mrb, mrb_iv_get(mrb, self, MRB_IVSYM(keys)), key, mrb_int_value(mrb, index));
+  }
+  return mrb_int_value(mrb, index);
+}
+
+static mrb_value
+mrb_mruby_marshal_archive_writer_aset(mrb_state *mrb, mrb_value self)
+{
+  mrb_value key, obj;
+  mrb_get_args(mrb, "oo", &key, &obj);
+  mrb_funcall_id(mrb, self, MRB_SYM(add), 2, obj, key);
+  return obj;
+}
+
+static mrb_value
+mrb_mruby_marshal_archive_writer_close(mrb_state *mrb, mrb_value self)
+{
+  struct _archive *a = _archive_get(mrb, self, &_archive_writer_type);
+  uint8_t trailer[ARCHIVE_TRAILER_LEN];
+  mrb_value index = mrb_assoc_new(mrb, mrb_iv_get(mrb, self, MRB_IVSYM(offsets)),
+                                  mrb_iv_get(mrb, self, MRB_IVSYM(keys)));
+  mrb_int offset, len;
+  int fd;
+
+  _archive_dump(mrb, a, index, &offset, &len);
+  _archive_put64(trailer, (uint64_t)offset);
+  _archive_put64(trailer + 8, (uint64_t)len);
+  memcpy(trailer + 16, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN);
+  _archive_write_all(mrb, a->fd, trailer, sizeof(trailer));
+  fd = a->fd;
+  a->fd = -1;
+  if (close(fd) != 0)
+  {
+    mrb_sys_fail(mrb, "Marshal::Archive");
+  }
+  return mrb_nil_value();
+}
+
+static mrb_value
+mrb_mruby_marshal_archive_init(mrb_state *mrb, mrb_value self)
+{
+  struct _archive *a;
+  const char *path;
+  uint8_t trailer[ARCHIVE_TRAILER_LEN];
+  char magic[ARCHIVE_MAGIC_LEN];
+  mrb_value index;
+  off_t size;
+  uint64_t offset, len;
+  mrb_get_args(mrb, "z", &path);
+
+  a = (struct _archive *)mrb_calloc(mrb, 1, sizeof(struct _archive));
+  a->fd = -1;
+  mrb_data_init(self, a, &_archive_type);
+  a->fd = open(path, O_RDONLY);
+  if (a->fd < 0)
+  {
+    mrb_sys_fail(mrb, path);
+  }
+  size = lseek(a->fd, 0, SEEK_END);
+  if (size < ARCHIVE_MAGIC_LEN + ARCHIVE_TRAILER_LEN)
+  {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+  }
+  _archive_pread_all(mrb, a->fd, magic, sizeof(magic), 0);
+  _archive_pread_all(mrb, a->fd, trailer, sizeof(trailer), size - ARCHIVE_TRAILER_LEN);
+  if (memcmp(magic, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN) != 0 ||
+      memcmp(trailer + 16, ARCHIVE_MAGIC, ARCHIVE_MAGIC_LEN) != 0)
+  {
+    mrb_raise(mrb, E_TYPE_ERROR, "not a marshal archive");
+  }
+  offset = _archive_get64(trailer);
+  len = _archive_get64(trailer + 8);
+  if (offset < ARCHIVE_MAGIC_LEN || len > (uint64_t)size || offset > (uint64_t)size - ARCHIVE_TRAILER_LEN - len)
+  {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (archive index)");
+  }
+  _archive_check_offset(mrb, offset + len);
+  a->index_offset = (mrb_int)offset;
+  index = _archive_read(mrb, a, (mrb_int)offset, (mrb_int)len);
+  if (!mrb_array_p(index) || RARRAY_LEN(index) != 2 ||
+      !mrb_array_p(RARRAY_PTR(index)[0]) || !mrb_hash_p(RARRAY_PTR(index)[1]))
+  {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (archive index)");
+  }
+  mrb_iv_set(mrb, self, MRB_IVSYM(offsets), RARRAY_PTR(index)[0]);
+  mrb_iv_set(mrb, self, MRB_IVSYM(keys), RARRAY_PTR(index)[1]);
+  return self;
+}
+
+static mrb_value
+mrb_mruby_marshal_archive_aref(mrb_state *mrb, mrb_value self)
+{
+  struct _archive *a = _archive_get(mrb, self, &_archive_type);
+  mrb_value offsets = mrb_iv_get(mrb, self, MRB_IVSYM(offsets));
+  mrb_value key, index;
+  mrb_int i, offset, len;
+  mrb_get_args(mrb, "o", &key);
+
+  index = mrb_integer_p(key) ? key : mrb_hash_get(mrb, mrb_iv_get(mrb, self, MRB_IVSYM(keys)), key);
+  if (!mrb_integer_p(index))
+  {
+    return mrb_nil_value();
+  }
+  i = mrb_integer(index);
+  if (i < 0 || i >= RARRAY_LEN(offsets) / 2)
+  {
+    return mrb_nil_value();
+  }
+  offset = mrb_as_int(mrb, RARRAY_PTR(offsets)[i * 2]);
+  len = mrb_as_int(mrb, RARRAY_PTR(offsets)[i * 2 + 1]);
+  if (offset < ARCHIVE_MAGIC_LEN || len < 0 || offset > a->index_offset - len)
+  {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (archive index)");
+  }
+  return _archive_read(mrb, a, offset, len);
+}
+
+static mrb_value
+mrb_mruby_marshal_archive_size(mrb_state *mrb, mrb_value self)
+{
+  return mrb_int_value(mrb, RARRAY_LEN(mrb_iv_get(mrb, self, MRB_IVSYM(offsets))) / 2);
+}
+
+static mrb_value
+mrb_mruby_marshal_archive_keys(mrb_state *mrb, mrb_value self)
+{
+  return mrb_hash_keys(mrb, mrb_iv_get(mrb, self, MRB_IVSYM(keys)));
+}
+
+static mrb_value
+mrb_mruby_marshal_archive_key_p(mrb_state *mrb, mrb_value self)
+{
+  mrb_value key;
+  mrb_get_args(mrb, "o", &key);
+  return mrb_bool_value(mrb_hash_key_p(mrb, mrb_iv_get(mrb, self, MRB_IVSYM(keys)), key));
+}
+
+static mrb_value
+mrb_mruby_marshal_archive_close(mrb_state *mrb, mrb_value self)
+{
+  struct _archive *a = _archive_get(mrb, self, &_archive_type);
+  close(a->fd);
+  a->fd = -1;
+  return mrb_nil_value();
+}
+#endif
+
+void
+mrb_marshal_archive_init(mrb_state *mrb, struct RClass *marshal)
+{
+#ifdef MARSHAL_HAVE_ARCHIVE
+  struct RClass *archive, *writer;
+
+  archive = mrb_define_class_under_id(mrb, marshal, MRB_SYM(Archive), mrb->object_class);
+  MRB_SET_INSTANCE_TT(archive, MRB_TT_DATA);
+  mrb_define_method_id(mrb, archive, MRB_SYM(initialize), mrb_mruby_marshal_archive_init, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, archive, MRB_OPSYM(aref), mrb_mruby_marshal_archive_aref, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, archive, MRB_SYM(size), mrb_mruby_marshal_archive_size, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, archive, MRB_SYM(keys), mrb_mruby_marshal_archive_keys, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, archive, MRB_SYM_Q(key), mrb_mruby_marshal_archive_key_p, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, archive, MRB_SYM(close), mrb_mruby_marshal_archive_close, MRB_ARGS_NONE());
+
+  writer = mrb_define_class_under_id(mrb, archive, MRB_SYM(Writer), mrb->object_class);
+  MRB_SET_INSTANCE_TT(writer, MRB_TT_DATA);
+  mrb_define_method_id(mrb, writer, MRB_SYM(initialize), mrb_mruby_marshal_archive_writer_init, MRB_ARGS_REQ(1) | MRB_ARGS_KEY(2, 0));
+  mrb_define_method_id(mrb, writer, MRB_SYM(add), mrb_mruby_marshal_archive_writer_add, MRB_ARGS_ARG(1, 1));
+  mrb_define_method_id(mrb, writer, MRB_OPSYM(aset), mrb_mruby_marshal_archive_writer_aset, MRB_ARGS_REQ(2));
+  mrb_define_method_id(mrb, writer, MRB_SYM(close), mrb_mruby_marshal_archive_writer_close, MRB_ARGS_NONE());
+#endif
+}
@@ -1,49 +1,187 @@
-#define MARSHAL_MAJOR 4
-#define MARSHAL_MINOR 8
-
-#define TYPE_NIL '0'
-#define TYPE_TRUE 'T'
-#define TYPE_FALSE 'F'
-#define TYPE_FIXNUM 'i'
-
-#define TYPE_EXTENDED 'e'
-#define TYPE_UCLASS 'C'
-#define TYPE_OBJECT 'o'
-#define TYPE_DATA 'd'
-#define TYPE_USERDEF 'u'
-#define TYPE_USRMARSHAL 'U'
-#define TYPE_FLOAT 'f'
-#define TYPE_BIGNUM 'l'
-#define TYPE_STRING '"'
-#define TYPE_REGEXP '/'
-#define TYPE_ARRAY '['
-#define TYPE_HASH '{'
-#define TYPE_HASH_DEF '}'
-#define TYPE_STRUCT 'S'
-#define TYPE_MODULE_OLD 'M'
-#define TYPE_CLASS 'c'
-#define TYPE_MODULE 'm'
-
-#define TYPE_SYMBOL ':'
-#define TYPE_SYMLINK ';'
-
-#define TYPE_IVAR 'I'
-#define TYPE_LINK '@'
-
-#define s_dump MRB_SYM(_dump)
-#define s_load MRB_SYM(_load)
-#define s_mdump MRB_SYM(marshal_dump)
-#define s_mload MRB_SYM(marshal_load)
-#define s_dump_data MRB_SYM(_dump_data)
-#define s_load_data MRB_SYM(_load_data)
-#define s_alloc MRB_SYM(_alloc)
-#define s_call MRB_SYM(call)
-#define s_getbyte MRB_SYM(getbyte)
-#define s_read MRB_SYM(read)
-#define s_write MRB_SYM(write)
-#define s_binmode MRB_SYM(binmode)
-
-#define RSHIFT(x, y) ((x) >> (int)y)
-#define FLOAT_DIG 17
-#define DECIMAL_MANT (53 - 16) /* from IEEE754 double precision */
-#define SIZEOF_LONG 4
+#define MARSHAL_MAJOR 4
+#define MARSHAL_MINOR 8
+
+#define TYPE_NIL '0'
+#define TYPE_TRUE 'T'
+#define TYPE_FALSE 'F'
+#define TYPE_FIXNUM 'i'
+
+#define TYPE_EXTENDED 'e'
+#define TYPE_UCLASS 'C'
+#define TYPE_OBJECT 'o'
+#define TYPE_DATA 'd'
+#define TYPE_USERDEF 'u'
+#define TYPE_USRMARSHAL 'U'
+#define TYPE_FLOAT 'f'
+#define TYPE_BIGNUM 'l'
+#define TYPE_STRING '"'
+#define TYPE_REGEXP '/'
+#define TYPE_ARRAY '['
+#define TYPE_HASH '{'
+#define TYPE_HASH_DEF '}'
+#define TYPE_STRUCT 'S'
+#define TYPE_MODULE_OLD 'M'
+#define TYPE_CLASS 'c'
+#define TYPE_MODULE 'm'
+
+#define TYPE_SYMBOL ':'
+#define TYPE_SYMLINK ';'
+
+#define TYPE_IVAR 'I'
+#define TYPE_LINK '@'
+
+/* only in a shaped stream: an object of a new shape, as <class symbol>
+   <ivar count> <ivar symbols> <ivar values>, and one of shape k, as
+   <k> <ivar values> */
+#define TYPE_SHAPE_DEF 'O'
+#define TYPE_SHAPE 'P'
+
+#define s_dump MRB_SYM(_dump)
+#define s_load MRB_SYM(_load)
+#define s_mdump MRB_SYM(marshal_dump)
+#define s_mload MRB_SYM(marshal_load)
+#define s_dump_data MRB_SYM(_dump_data)
+#define s_load_data MRB_SYM(_load_data)
+#define s_alloc MRB_SYM(_alloc)
+#define s_call MRB_SYM(call)
+#define s_getbyte MRB_SYM(getbyte)
+#define s_read MRB_SYM(read)
+#define s_write MRB_SYM(write)
+#define s_binmode MRB_SYM(binmode)
+#define s_encoding_short MRB_SYM(E)
+
+#define ENCODING_ASCII 0
+#define ENCODING_UTF_8 1
+
+#define RSHIFT(x, y) ((x) >> (int)y)
+#define FLOAT_DIG 17
+#define DECIMAL_MANT (53 - 16) /* from IEEE754 double precision */
+#define SIZEOF_LONG 4
+
+#define DUMP_BUFFER_SIZE 4096
+
+/* monotonic wall clock in seconds, for mrb_marshal_stats */
+double mrb_marshal_clock(void);
+
+/* compressed framing: magic, then blocks of <raw len><stored len><data>,
+   both lengths 32-bit little endian, a stored length of 0 meaning the
+   block is not compressed, and a raw length of 0 ending the stream */
+#define MARSHAL_LZ_MAGIC "MLZ\001"
+#define MARSHAL_LZ_MAGIC_LEN 4
+#define MARSHAL_LZ_BLOCK_SIZE 65536
+/* most bytes one compressed byte decodes to, a length extension byte */
+#define MARSHAL_LZ_MAX_RATIO 255
+
+size_t mrb_marshal_lz_compress(const uint8_t *src, size_t len, uint8_t *dst,
+                               size_t cap);
+int mrb_marshal_lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                              size_t raw_len);
+
+/* checksummed framing, outside of any compression: magic, then chunks of
+   <len><crc>, both 32-bit little endian, crc being the CRC32C of all
+   chunk data up to and including this chunk; a len of 0 ends the stream */
+#define MARSHAL_CK_MAGIC "MCK\001"
+#define MARSHAL_CK_MAGIC_LEN 4
+
+/* shaped stream, inside any compression: magic before the version, after
+   which plain objects may be written as TYPE_SHAPE_DEF and TYPE_SHAPE */
+#define MARSHAL_SH_MAGIC "MSH\001"
+#define MARSHAL_SH_MAGIC_LEN 4
+
+void mrb_marshal_crc32c_init(void);
+uint32_t mrb_marshal_crc32c(uint32_t crc, const void *buf, size_t len);
+
+/* write pipeline behind mrb_marshal_dump_fd(), see pipe.c; flags are
+   MRB_MARSHAL_DUMP_COMPRESS_LZ and MRB_MARSHAL_DUMP_CHECKSUM */
+struct mrb_marshal_pipe;
+
+struct mrb_marshal_pipe *mrb_marshal_pipe_open(mrb_state *mrb, int fd,
+                                               uint32_t flags);
+int mrb_marshal_pipe_write(struct mrb_marshal_pipe *p, const void *src,
+                           size_t n);
+int mrb_marshal_pipe_close(mrb_state *mrb, struct mrb_marshal_pipe *p,
+                           mrb_bool finish);
+
+/* streaming XXH64 state, see digest.c */
+struct mrb_marshal_hash {
+  uint64_t v[4];
+  uint64_t seed;
+  uint64_t total;
+  uint8_t buf[32];
+  size_t len;
+};
+
+void mrb_marshal_hash_init(struct mrb_marshal_hash *h, uint64_t seed);
+void mrb_marshal_hash_update(struct mrb_marshal_hash *h, const void *src,
+                             size_t n);
+uint64_t mrb_marshal_hash_final(const struct mrb_marshal_hash *h);
+
+/* allocates an uninitialized instance of class cv, see load.c */
+mrb_value mrb_marshal_instance_alloc(mrb_state *mrb, mrb_value cv);
+
+/* defines Marshal::Archive, see archive.c */
+void mrb_marshal_archive_init(mrb_state *mrb, struct RClass *marshal);
+
+/* Marshal::LazyArray and Marshal::LazyHash, see lazy.c; elem indexes the
+   element positions found by the skip scan in load.c */
+struct load_arg;
+
+mrb_value mrb_marshal_lazy_new(mrb_state *mrb, mrb_value state,
+                               struct load_arg *arg, mrb_int elem,
+                               mrb_int len, mrb_bool hash);
+mrb_value mrb_marshal_lazy_decode(mrb_state *mrb, struct load_arg *arg,
+                                  mrb_int elem);
+/* the whole Array or Hash behind a lazy proxy, decoded once and kept on the
+   proxy; any other value is returned as it is */
+mrb_value mrb_marshal_lazy_plain(mrb_state *mrb, mrb_value obj);
+void mrb_marshal_lazy_init(mrb_state *mrb, struct RClass *marshal);
+
+/* C serializers of mrb_marshal_register_data(), see data.c; lookups take
+   the registry fetched once per call, which is NULL if nothing was
+   registered */
+struct mrb_marshal_data_entry {
+  struct RClass *klass;
+  const struct mrb_data_type *type;
+  mrb_marshal_data_dump_t dump;
+  mrb_marshal_data_load_t load;
+};
+
+struct mrb_marshal_data_registry {
+  struct mrb_marshal_data_entry *entries;
+  mrb_int len, capa;
+};
+
+struct mrb_marshal_data_registry *mrb_marshal_data_registry(mrb_state *mrb);
+const struct mrb_marshal_data_entry *
+mrb_marshal_data_by_type(const struct mrb_marshal_data_registry *reg,
+                         const struct mrb_data_type *type);
+const struct mrb_marshal_data_entry *
+mrb_marshal_data_by_class(const struct mrb_marshal_data_registry *reg,
+                          struct RClass *klass);
+/* runs the dump callback of e into tmp, or into a new String if the bytes
+   do not fit in capa, and returns them */
+const char *mrb_marshal_data_bytes(mrb_state *mrb,
+                                   const struct mrb_marshal_data_entry *e,
+                                   mrb_value obj, char *tmp, mrb_int capa,
+                                   mrb_int *lenp);
+
+/* Regexp, Time, Rational, Complex and Set, resolved once per call; NULL
+   where not defined, see core.c */
+struct mrb_marshal_core {
+  struct RClass *regexp, *time, *rational, *complex, *set;
+};
+
+void mrb_marshal_core_init(mrb_state *mrb, struct mrb_marshal_core *core);
+void mrb_marshal_time_dump(mrb_state *mrb, mrb_value time, uint8_t buf[8],
+                           mrb_bool *utcp, mrb_int *offsetp);
+mrb_value mrb_marshal_time_load(mrb_state *mrb,
+                                const struct mrb_marshal_core *core,
+                                const uint8_t *buf);
+/* numerator and denominator, or real and imaginary */
+void mrb_marshal_core_parts(mrb_state *mrb,
+                            const struct mrb_marshal_core *core,
+                            mrb_value obj, mrb_value *a, mrb_value *b);
+mrb_value mrb_marshal_core_new(mrb_state *mrb,
+                               const struct mrb_marshal_core *core,
+                               struct RClass *klass, mrb_value a,
+                               mrb_value b);
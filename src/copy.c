@@ -0,0 +1,374 @@
+#include <mruby.h>
+#include <mruby/marshal.h>
+#include <mruby/value.h>
+
+#include <mruby/array.h>
+#include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/hash.h>
+#include <mruby/object.h>
+#include <mruby/range.h>
+#include <mruby/re.h>
+#include <mruby/string.h>
+#include <mruby/variable.h>
+
+#include <mruby/presym.h>
+
+#include "common.h"
+
+#include <mruby/khash.h>
+
+/*
+ * Deep copy with the semantics of Marshal.load(Marshal.dump(obj)), going
+ * object to object through an identity map instead of through bytes. The
+ * type dispatch mirrors w_object in dump.c; shared and cyclic references
+ * are copied once, and marshal_dump/marshal_load, _dump/_load and
+ * _dump_data/_load_data are called as a dump followed by a load would.
+ */
+
+KHASH_DECLARE(copy_table, mrb_value, mrb_value, 1);
+
+#define kh_copy_hash_func(mrb, v) mrb_obj_id(v)
+#define kh_copy_equal(mrb, a, b) mrb_obj_eq(mrb, a, b)
+KHASH_DEFINE(copy_table, mrb_value, mrb_value, 1, kh_copy_hash_func,
+             kh_copy_equal);
+
+struct copy_arg {
+  kh_copy_table_t *data;
+  /* the objects of data and their copies, kept alive for the GC: sources
+     include temporaries such as marshal_dump results */
+  mrb_value keep;
+  struct mrb_marshal_data_registry *natives;
+  struct mrb_marshal_core core;
+};
+
+struct copy_call_arg {
+  struct copy_arg *arg;
+  mrb_value dest;
+  int limit;
+};
+
+static mrb_value c_object(mrb_state *, mrb_value, struct copy_arg *, int);
+
+static void c_entry(mrb_state *mrb, mrb_value obj, mrb_value copy,
+                    struct copy_arg *arg) {
+  khint_t i = kh_put(copy_table, mrb, arg->data, obj);
+  kh_value(copy_table, arg->data, i) = copy;
+  mrb_ary_push(mrb, arg->keep, obj);
+  mrb_ary_push(mrb, arg->keep, copy);
+}
+
+/* Carries over the class of Array and Hash subclasses. */
+static void c_uclass(mrb_state *mrb, mrb_value obj, mrb_value copy) {
+  mrb_basic_ptr(copy)->c = mrb_obj_class(mrb, obj);
+}
+
+static int c_ivar_each(mrb_state *mrb, mrb_sym id, mrb_value value,
+                       void *ud) {
+  struct copy_call_arg *c_arg = (struct copy_call_arg *)ud;
+  mrb_iv_set(mrb, c_arg->dest, id,
+             c_object(mrb, value, c_arg->arg, c_arg->limit));
+  return 0; // continue
+}
+
+static void c_ivar(mrb_state *mrb, mrb_value obj, mrb_value copy,
+                   struct copy_arg *arg, int limit) {
+  struct copy_call_arg c_arg;
+
+  switch (mrb_type(obj)) {
+  case MRB_TT_CLASS:
+  case MRB_TT_MODULE:
+  case MRB_TT_SCLASS:
+    return;
+  default:
+    break;
+  }
+  c_arg.arg = arg;
+  c_arg.dest = copy;
+  c_arg.limit = limit;
+  mrb_iv_foreach(mrb, obj, c_ivar_each, &c_arg);
+}
+
+static int c_hash_each(mrb_state *mrb, mrb_value key, mrb_value value,
+                       void *ud) {
+  struct copy_call_arg *c_arg = (struct copy_call_arg *)ud;
+  int ai = mrb_gc_arena_save(mrb);
+  mrb_value k = c_object(mrb, key, c_arg->arg, c_arg->limit);
+  mrb_value v = c_object(mrb, value, c_arg->arg, c_arg->limit);
+  /* as r_hash_aset: freeze String keys in place instead of copying them */
+  if (mrb_string_p(k) && !mrb_frozen_p(mrb_str_ptr(k))) {
+    MRB_SET_FROZEN_FLAG(mrb_str_ptr(k));
+  }
+  mrb_hash_set(mrb, c_arg->dest, k, v);
+  mrb_gc_arena_restore(mrb, ai);
+  return 0; // continue
+}
+
+/* Copies a data object registered with mrb_marshal_register_data(). */
+static mrb_value c_data_native(mrb_state *mrb, mrb_value obj,
+                               const struct mrb_marshal_data_entry *e,
+                               struct copy_arg *arg) {
+  char tmp[DUMP_BUFFER_SIZE];
+  mrb_int len;
+  const char *p = mrb_marshal_data_bytes(mrb, e, obj, tmp, sizeof(tmp), &len);
+  mrb_value v =
+      mrb_marshal_instance_alloc(mrb, mrb_obj_value(mrb_obj_class(mrb, obj)));
+
+  c_entry(mrb, obj, v, arg);
+  DATA_PTR(v) = e->load(mrb, p, len);
+  DATA_TYPE(v) = e->type;
+  return v;
+}
+
+/* Copies Range, Time, Rational, Complex and Set as w_core() writes them. */
+static mrb_bool c_core(mrb_state *mrb, mrb_value obj, struct RClass *klass,
+                       struct copy_arg *arg, int limit, mrb_value *vp) {
+  struct mrb_marshal_core *core = &arg->core;
+  mrb_value v;
+
+  if (mrb_range_p(obj)) {
+    struct RRange *r = mrb_range_ptr(mrb, obj);
+    mrb_bool excl = RANGE_EXCL(r);
+    mrb_value beg = c_object(mrb, RANGE_BEG(r), arg, limit);
+
+    v = mrb_range_new(mrb, beg, c_object(mrb, RANGE_END(r), arg, limit), excl);
+    mrb_basic_ptr(v)->c = klass;
+    c_entry(mrb, obj, v, arg);
+  } else if (klass == core->time) {
+    uint8_t buf[8];
+    mrb_bool utc;
+    mrb_int offset;
+
+    mrb_marshal_time_dump(mrb, obj, buf, &utc, &offset);
+    v = mrb_marshal_time_load(mrb, core, buf);
+    c_entry(mrb, obj, v, arg);
+  } else if (klass == core->set) {
+    mrb_value elems = mrb_ensure_array_type(
+        mrb, mrb_funcall_id(mrb, obj, MRB_SYM(to_a), 0));
+    mrb_value copies = mrb_ary_new_capa(mrb, RARRAY_LEN(elems));
+    mrb_int i;
+
+    v = mrb_obj_new(mrb, klass, 0, NULL);
+    c_entry(mrb, obj, v, arg);
+    for (i = 0; i < RARRAY_LEN(elems); i++) {
+      mrb_value e = c_object(mrb, RARRAY_PTR(elems)[i], arg, limit);
+      mrb_ary_push(mrb, copies, e);
+    }
+    mrb_funcall_id(mrb, v, MRB_SYM(merge), 1, copies);
+  } else if (klass == core->rational || klass == core->complex) {
+    mrb_value a, b;
+
+    mrb_marshal_core_parts(mrb, core, obj, &a, &b);
+    a = c_object(mrb, a, arg, limit);
+    b = c_object(mrb, b, arg, limit);
+    v = mrb_marshal_core_new(mrb, core, klass, a, b);
+    c_entry(mrb, obj, v, arg);
+  } else {
+    return FALSE;
+  }
+  *vp = v;
+  return TRUE;
+}
+
+static mrb_value c_object(mrb_state *mrb, mrb_value obj, struct copy_arg *arg,
+                          int limit) {
+  struct RClass *klass;
+  mrb_value v = mrb_nil_value();
+  mrb_bool ivars = TRUE;
+
+  if (limit == 0) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "exceed depth limit");
+  }
+  limit--;
+
+  if (mrb_immediate_p(obj) || mrb_float_p(obj) || mrb_symbol_p(obj)) {
+    return obj;
+  }
+  /* a lazily loaded container copies to the Array or Hash it stands for */
+  if (mrb_type(obj) == MRB_TT_DATA)
+    obj = mrb_marshal_lazy_plain(mrb, obj);
+  {
+    khint_t i = kh_get(copy_table, mrb, arg->data, obj);
+    if (i != kh_end(arg->data))
+      return kh_value(copy_table, arg->data, i);
+  }
+
+  klass = mrb_obj_class(mrb, obj);
+  if (mrb_respond_to(mrb, obj, s_mdump)) {
+    mrb_value data = mrb_funcall_id(mrb, obj, s_mdump, 0);
+
+    v = mrb_marshal_instance_alloc(mrb, mrb_obj_value(klass));
+    if (!mrb_respond_to(mrb, v, s_mload)) {
+      mrb_raisef(mrb, E_TYPE_ERROR,
+                 "instance of %s needs to have method `marshal_load'",
+                 mrb_class_name(mrb, klass));
+    }
+    c_entry(mrb, obj, v, arg);
+    mrb_funcall_id(mrb, v, s_mload, 1, c_object(mrb, data, arg, limit));
+    if (mrb_type(obj) != MRB_TT_OBJECT)
+      c_ivar(mrb, obj, v, arg, limit);
+    return v;
+  }
+  if (mrb_respond_to(mrb, obj, s_dump)) {
+    mrb_value data = mrb_funcall_id(mrb, obj, s_dump, 1, mrb_fixnum_value(limit));
+
+    if (!mrb_string_p(data)) {
+      mrb_raise(mrb, E_TYPE_ERROR, "_dump() must return string");
+    }
+    if (!mrb_respond_to(mrb, mrb_obj_value(klass), s_load)) {
+      mrb_raisef(mrb, E_TYPE_ERROR, "class %s needs to have method `_load'",
+                 mrb_class_name(mrb, klass));
+    }
+    v = mrb_funcall_id(mrb, mrb_obj_value(klass), s_load, 1,
+                       mrb_str_dup(mrb, data));
+    c_entry(mrb, obj, v, arg);
+    return v;
+  }
+
+  if (arg->core.regexp && klass == arg->core.regexp) {
+    mrb_value src = mrb_funcall_id(mrb, obj, MRB_SYM(source), 0);
+    mrb_value opts = mrb_funcall_id(mrb, obj, MRB_SYM(options), 0);
+    v = mrb_funcall_id(mrb, mrb_obj_value(arg->core.regexp), MRB_SYM(compile),
+                       2, mrb_str_dup(mrb, src), opts);
+    c_entry(mrb, obj, v, arg);
+    c_ivar(mrb, obj, v, arg, limit);
+    return v;
+  }
+
+  if (c_core(mrb, obj, klass, arg, limit, &v))
+    return v;
+
+  switch (mrb_type(obj)) {
+  case MRB_TT_CLASS:
+  case MRB_TT_MODULE:
+    return obj;
+
+  case MRB_TT_STRING:
+    v = mrb_str_dup(mrb, obj);
+    c_entry(mrb, obj, v, arg);
+    break;
+
+  case MRB_TT_ARRAY: {
+    mrb_int i, len = RARRAY_LEN(obj);
+    int ai;
+
+    v = mrb_ary_new_capa(mrb, len);
+    c_uclass(mrb, obj, v);
+    c_entry(mrb, obj, v, arg);
+    ai = mrb_gc_arena_save(mrb);
+    for (i = 0; i < RARRAY_LEN(obj); i++) {
+      mrb_ary_push(mrb, v, c_object(mrb, RARRAY_PTR(obj)[i], arg, limit));
+      if (len != RARRAY_LEN(obj)) {
+        mrb_raise(mrb, E_RUNTIME_ERROR, "array modified during copy");
+      }
+      mrb_gc_arena_restore(mrb, ai);
+    }
+  } break;
+
+  case MRB_TT_HASH: {
+    struct copy_call_arg c_arg;
+
+    if (MRB_RHASH_PROCDEFAULT_P(obj)) {
+      mrb_raise(mrb, E_TYPE_ERROR, "can't dump hash with default proc");
+    }
+    if (MRB_RHASH_DEFAULT_P(obj)) {
+      mrb_raise(mrb, E_TYPE_ERROR, "can't dump hash with default");
+    }
+    v = mrb_hash_new_capa(mrb, mrb_hash_size(mrb, obj));
+    c_uclass(mrb, obj, v);
+    c_entry(mrb, obj, v, arg);
+    c_arg.arg = arg;
+    c_arg.dest = v;
+    c_arg.limit = limit;
+    mrb_hash_foreach(mrb, mrb_hash_ptr(obj), c_hash_each, &c_arg);
+  } break;
+
+  case MRB_TT_STRUCT: {
+    mrb_int i, len = RARRAY_LEN(obj);
+    int ai;
+
+    /* slots are written directly, as a load does */
+    v = mrb_marshal_instance_alloc(mrb, mrb_obj_value(klass));
+    c_entry(mrb, obj, v, arg);
+    mrb_ary_resize(mrb, v, len);
+    ai = mrb_gc_arena_save(mrb);
+    for (i = 0; i < len && i < RARRAY_LEN(obj); i++) {
+      mrb_ary_set(mrb, v, i, c_object(mrb, RARRAY_PTR(obj)[i], arg, limit));
+      mrb_gc_arena_restore(mrb, ai);
+    }
+  } break;
+
+  case MRB_TT_OBJECT:
+    v = mrb_marshal_instance_alloc(mrb, mrb_obj_value(klass));
+    c_entry(mrb, obj, v, arg);
+    break;
+
+  case MRB_TT_DATA: {
+    const struct mrb_marshal_data_entry *e =
+        mrb_marshal_data_by_type(arg->natives, DATA_TYPE(obj));
+    mrb_value data;
+
+    if (e) {
+      v = c_data_native(mrb, obj, e, arg);
+      break;
+    }
+    if (!mrb_respond_to(mrb, obj, s_dump_data)) {
+      mrb_raisef(mrb, E_TYPE_ERROR, "no _dump_data is defined for class %s",
+                 mrb_obj_classname(mrb, obj));
+    }
+    data = mrb_funcall_id(mrb, obj, s_dump_data, 0);
+    if (mrb_respond_to(mrb, mrb_obj_value(klass), s_alloc)) {
+      v = mrb_funcall_id(mrb, mrb_obj_value(klass), s_alloc, 0);
+    } else {
+      v = mrb_marshal_instance_alloc(mrb, mrb_obj_value(klass));
+    }
+    if (!mrb_respond_to(mrb, v, s_load_data)) {
+      mrb_raisef(mrb, E_TYPE_ERROR,
+                 "class %s needs to have instance method `_load_data'",
+                 mrb_class_name(mrb, klass));
+    }
+    c_entry(mrb, obj, v, arg);
+    mrb_funcall_id(mrb, v, s_load_data, 1, c_object(mrb, data, arg, limit));
+    ivars = FALSE;
+  } break;
+
+  default:
+    mrb_raisef(mrb, E_TYPE_ERROR, "can't dump %s", mrb_obj_classname(mrb, obj));
+    break;
+  }
+
+  if (ivars)
+    c_ivar(mrb, obj, v, arg, limit);
+  return v;
+}
+
+static void clear_copy_arg(mrb_state *mrb, struct copy_arg *arg) {
+  if (arg->data)
+    kh_destroy(copy_table, mrb, arg->data);
+  arg->data = NULL;
+}
+
+static void free_copy_arg(mrb_state *mrb, void *ud) {
+  clear_copy_arg(mrb, (struct copy_arg *)ud);
+  mrb_free(mrb, ud);
+}
+
+static mrb_data_type _mrb_copy_arg = {"Marshal::CopyARG", free_copy_arg};
+
+mrb_value mrb_marshal_deep_copy(mrb_state *mrb, mrb_value obj, int limit) {
+  struct copy_arg *arg;
+  struct RData *wrapper;
+  mrb_value v;
+  Data_Make_Struct(mrb, mrb->object_class, struct copy_arg, &_mrb_copy_arg, arg,
+                   wrapper);
+  arg->data = kh_init(copy_table, mrb);
+  arg->keep = mrb_ary_new(mrb);
+  mrb_iv_set(mrb, mrb_obj_value(wrapper), MRB_IVSYM(keep), arg->keep);
+  arg->natives = mrb_marshal_data_registry(mrb);
+  mrb_marshal_core_init(mrb, &arg->core);
+
+  v = c_object(mrb, obj, arg, limit);
+
+  clear_copy_arg(mrb, arg);
+  return v;
+}
@@ -0,0 +1,167 @@
+#include <mruby.h>
+#include <mruby/marshal.h>
+
+#include <mruby/array.h>
+#include <mruby/class.h>
+#include <mruby/re.h>
+#include <mruby/variable.h>
+
+#include <mruby/presym.h>
+
+#include "common.h"
+
+/*
+ * Regexp, Time, Rational, Complex and Set, which come from optional gems
+ * whose internals are private. dump.c and load.c write and read them in the
+ * form CRuby uses; this file holds what needs their public methods and the
+ * conversion of Time's `_dump` bytes.
+ */
+
+static struct RClass *core_class(mrb_state *mrb, mrb_sym name) {
+  mrb_value object = mrb_obj_value(mrb->object_class);
+  mrb_value v;
+
+  if (!mrb_const_defined(mrb, object, name))
+    return NULL;
+  v = mrb_const_get(mrb, object, name);
+  return mrb_class_p(v) ? mrb_class_ptr(v) : NULL;
+}
+
+void mrb_marshal_core_init(mrb_state *mrb, struct mrb_marshal_core *core) {
+  core->regexp = core_class(mrb, mrb_intern_cstr(mrb, REGEXP_CLASS));
+  core->time = core_class(mrb, MRB_SYM(Time));
+  core->rational = core_class(mrb, MRB_SYM(Rational));
+  core->complex = core_class(mrb, MRB_SYM(Complex));
+  core->set = core_class(mrb, MRB_SYM(Set));
+}
+
+/* days since 1970-01-01 of a proleptic Gregorian date, month 1..12 */
+static int64_t days_from_civil(int64_t y, int m, int d) {
+  int64_t era, yoe, doy;
+
+  y -= m <= 2;
+  era = (y >= 0 ? y : y - 399) / 400;
+  yoe = y - era * 400;
+  doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+  return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+static void civil_from_days(int64_t z, int64_t *yp, int *mp, int *dp) {
+  int64_t era, doe, yoe, doy, mp0;
+
+  z += 719468;
+  era = (z >= 0 ? z : z - 146096) / 146097;
+  doe = z - era * 146097;
+  yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  mp0 = (5 * doy + 2) / 153;
+  *dp = (int)(doy - (153 * mp0 + 2) / 5 + 1);
+  *mp = (int)(mp0 < 10 ? mp0 + 3 : mp0 - 9);
+  *yp = yoe + era * 400 + (*mp <= 2);
+}
+
+static void put32(uint8_t *p, uint32_t x) {
+  p[0] = (uint8_t)x;
+  p[1] = (uint8_t)(x >> 8);
+  p[2] = (uint8_t)(x >> 16);
+  p[3] = (uint8_t)(x >> 24);
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+/*
+ * The 8 bytes of CRuby's Time#_dump: the UTC date and time packed into two
+ * 32-bit words, with the top bit set and a bit for UTC times.
+ */
+void mrb_marshal_time_dump(mrb_state *mrb, mrb_value time, uint8_t buf[8],
+                           mrb_bool *utcp, mrb_int *offsetp) {
+  mrb_int sec = mrb_as_int(mrb, mrb_funcall_id(mrb, time, MRB_SYM(to_i), 0));
+  mrb_int usec = mrb_as_int(mrb, mrb_funcall_id(mrb, time, MRB_SYM(usec), 0));
+  int64_t days = sec / 86400, rem = sec % 86400, year;
+  int mon, mday;
+
+  if (rem < 0) {
+    rem += 86400;
+    days--;
+  }
+  civil_from_days(days, &year, &mon, &mday);
+  if (year < 1900 || year - 1900 > 0xffff)
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "year too %s to marshal: %i UTC",
+               year < 1900 ? "small" : "big", (mrb_int)year);
+  *utcp = mrb_test(mrb_funcall_id(mrb, time, MRB_SYM_Q(utc), 0));
+  *offsetp = *utcp ? 0
+                   : mrb_as_int(mrb, mrb_funcall_id(mrb, time,
+                                                    MRB_SYM(utc_offset), 0));
+  put32(buf, UINT32_C(1) << 31 | (uint32_t)*utcp << 30 |
+                 (uint32_t)(year - 1900) << 14 | (uint32_t)(mon - 1) << 10 |
+                 (uint32_t)mday << 5 | (uint32_t)(rem / 3600));
+  put32(buf + 4, (uint32_t)(rem / 60 % 60) << 26 |
+                     (uint32_t)(rem % 60) << 20 | (uint32_t)usec);
+}
+
+/*
+ * Restores a Time from the bytes of mrb_marshal_time_dump() or of CRuby. A
+ * time that was not in UTC comes back in local time, mruby having no fixed
+ * offsets.
+ */
+mrb_value mrb_marshal_time_load(mrb_state *mrb,
+                                const struct mrb_marshal_core *core,
+                                const uint8_t *buf) {
+  uint32_t p = get32(buf), s = get32(buf + 4);
+  mrb_bool utc = FALSE;
+  int64_t sec;
+  mrb_int usec;
+  mrb_value v;
+
+  if (!core->time)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "undefined class/module Time");
+  if (!(p & UINT32_C(1) << 31)) {
+    /* the old format: seconds and microseconds */
+    sec = p;
+    usec = s;
+  } else {
+    int64_t year = ((p >> 14) & 0xffff) + 1900;
+    int mon = (p >> 10) & 0xf, mday = (p >> 5) & 0x1f, hour = p & 0x1f;
+    int min = (s >> 26) & 0x3f, secs = (s >> 20) & 0x3f;
+
+    if (mon > 11 || mday < 1 || hour > 23 || min > 59 || secs > 60)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (Time)");
+    utc = (p >> 30) & 1;
+    usec = s & 0xfffff;
+    sec = days_from_civil(year, mon + 1, mday) * 86400 + hour * 3600 +
+          min * 60 + secs;
+  }
+  if (usec >= 1000000)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (Time)");
+  v = mrb_funcall_id(mrb, mrb_obj_value(core->time), MRB_SYM(at), 2,
+                     mrb_int_value(mrb, (mrb_int)sec), mrb_fixnum_value(usec));
+  if (utc)
+    v = mrb_funcall_id(mrb, v, MRB_SYM(utc), 0);
+  return v;
+}
+
+/* The two values of a Rational or Complex, as its CRuby marshal_dump. */
+void mrb_marshal_core_parts(mrb_state *mrb,
+                            const struct mrb_marshal_core *core,
+                            mrb_value obj, mrb_value *a, mrb_value *b) {
+  if (mrb_obj_class(mrb, obj) == core->rational) {
+    *a = mrb_funcall_id(mrb, obj, MRB_SYM(numerator), 0);
+    *b = mrb_funcall_id(mrb, obj, MRB_SYM(denominator), 0);
+  } else {
+    *a = mrb_funcall_id(mrb, obj, MRB_SYM(real), 0);
+    *b = mrb_funcall_id(mrb, obj, MRB_SYM(imaginary), 0);
+  }
+}
+
+mrb_value mrb_marshal_core_new(mrb_state *mrb,
+                               const struct mrb_marshal_core *core,
+                               struct RClass *klass, mrb_value a,
+                               mrb_value b) {
+  mrb_sym name =
+      klass == core->rational ? MRB_SYM(Rational) : MRB_SYM(Complex);
+
+  return mrb_funcall_id(mrb, mrb_top_self(mrb), name, 2, a, b);
+}
@@ -0,0 +1,96 @@
+#include <mruby.h>
+#include <mruby/marshal.h>
+
+#include "common.h"
+
+/*
+ * CRC32C (Castagnoli, reflected polynomial 0x82F63B78) for checksummed
+ * marshal frames. Uses the SSE4.2 crc32 instruction on x86-64 Linux when the
+ * CPU has it, slicing-by-8 tables otherwise.
+ */
+
+#define CRC32C_POLY 0x82F63B78u
+
+static uint32_t crc32c_table[8][256];
+static int crc32c_hw;
+
+#if defined(__linux__) && defined(__x86_64__) &&                               \
+    (defined(__GNUC__) || defined(__clang__))
+#define CRC32C_SSE42 1
+#include <nmmintrin.h>
+#include <string.h>
+
+__attribute__((target("sse4.2"))) static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len) {
+  uint64_t c = crc;
+
+  while (len > 0 && ((uintptr_t)p & 7)) {
+    c = _mm_crc32_u8((uint32_t)c, *p++);
+    len--;
+  }
+  while (len >= 8) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    c = _mm_crc32_u64(c, v);
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    c = _mm_crc32_u8((uint32_t)c, *p++);
+    len--;
+  }
+  return (uint32_t)c;
+}
+#endif
+
+void mrb_marshal_crc32c_init(void) {
+  uint32_t i, j, c;
+
+  if (crc32c_table[0][1])
+    return;
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (j = 0; j < 8; j++)
+      c = (c >> 1) ^ (CRC32C_POLY & (0u - (c & 1)));
+    crc32c_table[0][i] = c;
+  }
+  for (i = 0; i < 256; i++) {
+    c = crc32c_table[0][i];
+    for (j = 1; j < 8; j++) {
+      c = crc32c_table[0][c & 0xff] ^ (c >> 8);
+      crc32c_table[j][i] = c;
+    }
+  }
+#ifdef CRC32C_SSE42
+  crc32c_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len) {
+  while (len >= 8) {
+    uint32_t lo = crc ^ ((uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                         (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24);
+    crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+          crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+          crc32c_table[3][p[4]] ^ crc32c_table[2][p[5]] ^
+          crc32c_table[1][p[6]] ^ crc32c_table[0][p[7]];
+    p += 8;
+    len -= 8;
+  }
+  while (len > 0) {
+    crc = crc32c_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  return crc;
+}
+
+uint32_t mrb_marshal_crc32c(uint32_t crc, const void *buf, size_t len) {
+  const uint8_t *p = (const uint8_t *)buf;
+
+  crc = ~crc;
+#ifdef CRC32C_SSE42
+  if (crc32c_hw)
+    return ~crc32c_sse42(crc, p, len);
+#endif
+  return ~crc32c_sw(crc, p, len);
+}
@@ -0,0 +1,131 @@
+#include <mruby.h>
+#include <mruby/marshal.h>
+
+#include <mruby/array.h>
+#include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/string.h>
+#include <mruby/variable.h>
+
+#include <mruby/presym.h>
+
+#include "common.h"
+
+/*
+ * C serializers for MRB_TT_DATA classes, see mrb_marshal_register_data().
+ * The table is kept by a Marshal::DataRegistry object stored in Marshal,
+ * with the registered classes in an array on it so that they stay alive.
+ */
+
+static void free_data_registry(mrb_state *mrb, void *ud) {
+  struct mrb_marshal_data_registry *reg =
+      (struct mrb_marshal_data_registry *)ud;
+
+  mrb_free(mrb, reg->entries);
+  mrb_free(mrb, reg);
+}
+
+static mrb_data_type _mrb_data_registry = {"Marshal::DataRegistry",
+                                           free_data_registry};
+
+struct mrb_marshal_data_registry *mrb_marshal_data_registry(mrb_state *mrb) {
+  struct RClass *marshal = mrb_module_get_id(mrb, MRB_SYM(Marshal));
+  mrb_value v = mrb_iv_get(mrb, mrb_obj_value(marshal), MRB_SYM(__data__));
+
+  if (mrb_nil_p(v))
+    return NULL;
+  return (struct mrb_marshal_data_registry *)DATA_PTR(v);
+}
+
+void mrb_marshal_register_data(mrb_state *mrb, struct RClass *klass,
+                               const struct mrb_data_type *type,
+                               mrb_marshal_data_dump_t dump,
+                               mrb_marshal_data_load_t load) {
+  struct RClass *marshal = mrb_module_get_id(mrb, MRB_SYM(Marshal));
+  struct mrb_marshal_data_registry *reg = mrb_marshal_data_registry(mrb);
+  struct mrb_marshal_data_entry *e;
+  mrb_int i;
+
+  if (MRB_INSTANCE_TT(klass) != MRB_TT_DATA)
+    mrb_raisef(mrb, E_TYPE_ERROR, "%C is not a data class", klass);
+  if (!reg) {
+    struct RData *wrapper;
+
+    Data_Make_Struct(mrb, mrb->object_class, struct mrb_marshal_data_registry,
+                     &_mrb_data_registry, reg, wrapper);
+    mrb_iv_set(mrb, mrb_obj_value(wrapper), MRB_SYM(classes), mrb_ary_new(mrb));
+    mrb_iv_set(mrb, mrb_obj_value(marshal), MRB_SYM(__data__),
+               mrb_obj_value(wrapper));
+  }
+  for (i = 0; i < reg->len; i++) {
+    if (reg->entries[i].klass == klass)
+      break;
+  }
+  if (i == reg->len) {
+    mrb_value wrapper =
+        mrb_iv_get(mrb, mrb_obj_value(marshal), MRB_SYM(__data__));
+
+    if (reg->len == reg->capa) {
+      reg->capa = reg->capa ? reg->capa * 2 : 8;
+      reg->entries = (struct mrb_marshal_data_entry *)mrb_realloc(
+          mrb, reg->entries, sizeof(struct mrb_marshal_data_entry) * reg->capa);
+    }
+    reg->len++;
+    mrb_ary_push(mrb, mrb_iv_get(mrb, wrapper, MRB_SYM(classes)),
+                 mrb_obj_value(klass));
+  }
+  e = &reg->entries[i];
+  e->klass = klass;
+  e->type = type;
+  e->dump = dump;
+  e->load = load;
+}
+
+const struct mrb_marshal_data_entry *
+mrb_marshal_data_by_type(const struct mrb_marshal_data_registry *reg,
+                         const struct mrb_data_type *type) {
+  mrb_int i;
+
+  if (!reg || !type)
+    return NULL;
+  for (i = 0; i < reg->len; i++) {
+    if (reg->entries[i].type == type)
+      return &reg->entries[i];
+  }
+  return NULL;
+}
+
+const struct mrb_marshal_data_entry *
+mrb_marshal_data_by_class(const struct mrb_marshal_data_registry *reg,
+                          struct RClass *klass) {
+  mrb_int i;
+
+  if (!reg)
+    return NULL;
+  for (; klass; klass = klass->super) {
+    for (i = 0; i < reg->len; i++) {
+      if (reg->entries[i].klass == klass)
+        return &reg->entries[i];
+    }
+  }
+  return NULL;
+}
+
+const char *mrb_marshal_data_bytes(mrb_state *mrb,
+                                   const struct mrb_marshal_data_entry *e,
+                                   mrb_value obj, char *tmp, mrb_int capa,
+                                   mrb_int *lenp) {
+  mrb_int len = e->dump(mrb, obj, tmp, capa);
+  mrb_value buf;
+
+  if (len < 0)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "data dump function failed");
+  *lenp = len;
+  if (len <= capa)
+    return tmp;
+  /* too large for tmp: a second call into a String, kept by the arena */
+  buf = mrb_str_new(mrb, NULL, len);
+  if (e->dump(mrb, obj, RSTRING_PTR(buf), len) != len)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "data dump function changed its length");
+  return RSTRING_PTR(buf);
+}
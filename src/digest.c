@@ -0,0 +1,127 @@
+#include <mruby.h>
+#include <mruby/marshal.h>
+
+#include "common.h"
+#include <string.h>
+
+/*
+ * Streaming XXH64, the hashing sink behind Marshal.digest. Output of the
+ * dump traversal is fed in as it is produced, so the serialization is never
+ * materialized.
+ */
+
+#define P1 UINT64_C(0x9E3779B185EBCA87)
+#define P2 UINT64_C(0xC2B2AE3D27D4EB4F)
+#define P3 UINT64_C(0x165667B19E3779F9)
+#define P4 UINT64_C(0x85EBCA77C2B2AE63)
+#define P5 UINT64_C(0x27D4EB2F165667C5)
+
+static uint64_t rotl(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t read64(const uint8_t *p) {
+  return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 |
+         (uint64_t)p[3] << 24 | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+         (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static uint32_t read32(const uint8_t *p) {
+  return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+         (uint32_t)p[3] << 24;
+}
+
+static uint64_t round64(uint64_t acc, uint64_t input) {
+  acc += input * P2;
+  acc = rotl(acc, 31);
+  return acc * P1;
+}
+
+static uint64_t merge64(uint64_t acc, uint64_t val) {
+  acc ^= round64(0, val);
+  return acc * P1 + P4;
+}
+
+static const uint8_t *stripes(uint64_t v[4], const uint8_t *p, size_t n) {
+  const uint8_t *end = p + n;
+
+  while (end - p >= 32) {
+    v[0] = round64(v[0], read64(p));
+    v[1] = round64(v[1], read64(p + 8));
+    v[2] = round64(v[2], read64(p + 16));
+    v[3] = round64(v[3], read64(p + 24));
+    p += 32;
+  }
+  return p;
+}
+
+void mrb_marshal_hash_init(struct mrb_marshal_hash *h, uint64_t seed) {
+  memset(h, 0, sizeof(*h));
+  h->v[0] = seed + P1 + P2;
+  h->v[1] = seed + P2;
+  h->v[2] = seed;
+  h->v[3] = seed - P1;
+  h->seed = seed;
+}
+
+void mrb_marshal_hash_update(struct mrb_marshal_hash *h, const void *src,
+                             size_t n) {
+  const uint8_t *p = (const uint8_t *)src;
+
+  h->total += n;
+  if (h->len + n < 32) {
+    memcpy(h->buf + h->len, p, n);
+    h->len += n;
+    return;
+  }
+  if (h->len) {
+    size_t fill = 32 - h->len;
+    memcpy(h->buf + h->len, p, fill);
+    stripes(h->v, h->buf, 32);
+    p += fill;
+    n -= fill;
+    h->len = 0;
+  }
+  src = p;
+  p = stripes(h->v, p, n);
+  n -= p - (const uint8_t *)src;
+  memcpy(h->buf, p, n);
+  h->len = n;
+}
+
+uint64_t mrb_marshal_hash_final(const struct mrb_marshal_hash *h) {
+  const uint8_t *p = h->buf, *end = h->buf + h->len;
+  uint64_t acc;
+
+  if (h->total >= 32) {
+    acc = rotl(h->v[0], 1) + rotl(h->v[1], 7) + rotl(h->v[2], 12) +
+          rotl(h->v[3], 18);
+    acc = merge64(acc, h->v[0]);
+    acc = merge64(acc, h->v[1]);
+    acc = merge64(acc, h->v[2]);
+    acc = merge64(acc, h->v[3]);
+  } else {
+    acc = h->seed + P5;
+  }
+  acc += h->total;
+
+  while (end - p >= 8) {
+    acc ^= round64(0, read64(p));
+    acc = rotl(acc, 27) * P1 + P4;
+    p += 8;
+  }
+  if (end - p >= 4) {
+    acc ^= (uint64_t)read32(p) * P1;
+    acc = rotl(acc, 23) * P2 + P3;
+    p += 4;
+  }
+  while (p < end) {
+    acc ^= *p++ * P5;
+    acc = rotl(acc, 11) * P1;
+  }
+
+  acc ^= acc >> 33;
+  acc *= P2;
+  acc ^= acc >> 29;
+  acc *= P3;
+  acc ^= acc >> 32;
+  return acc;
+}
@@ -4,8 +4,11 @@
 
 #include <mruby/array.h>
 #include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/error.h>
 #include <mruby/hash.h>
 #include <mruby/object.h>
+#include <mruby/range.h>
 #include <mruby/re.h>
 #include <mruby/string.h>
 #include <mruby/variable.h>
@@ -13,6 +16,8 @@
 #include <mruby/presym.h>
 
 #include "common.h"
+#include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include <mruby/khash.h>
@@ -26,21 +31,71 @@ KHASH_DEFINE(symbol_dump_table, mrb_sym, mrb_int, 1, kh_int_hash_func,
 KHASH_DEFINE(object_dump_table, mrb_value, mrb_int, 1, kh_mrb_value_hash_func,
              mrb_equal);
 
+KHASH_DECLARE(string_dump_table, mrb_value, mrb_int, 1);
+
+#define kh_string_hash_func(mrb, v) mrb_str_hash(mrb, v)
+KHASH_DEFINE(string_dump_table, mrb_value, mrb_int, 1, kh_string_hash_func,
+             mrb_str_equal);
+
+KHASH_DECLARE(shape_dump_table, uint64_t, mrb_int, 1);
+KHASH_DEFINE(shape_dump_table, uint64_t, mrb_int, 1, kh_int64_hash_func,
+             kh_int_hash_equal);
+
+/* a class and ivar layout of MRB_MARSHAL_DUMP_SHAPES, see w_shaped() */
+struct dump_shape {
+  struct RClass *klass;
+  mrb_int off, n; /* ivar names in dump_arg.shape_syms */
+};
+
 struct dump_arg {
   mrb_value dest;
   mrb_uint position;
   mrb_marshal_writer_t writer;
 
+  char buf[DUMP_BUFFER_SIZE];
+  int buf_len;
+
+  uint32_t flags;
+  mrb_marshal_stats *stats;
+
+  /* block being collected for compression, and its compressed form */
+  uint8_t *lz_buf, *lz_out;
+  size_t lz_len;
+
+  /* running CRC32C with MRB_MARSHAL_DUMP_CHECKSUM */
+  uint32_t crc;
+
+  /* set when dumping to a file descriptor through the write pipeline */
+  struct mrb_marshal_pipe *pipe;
+  /* set when hashing the output for mrb_marshal_digest() */
+  struct mrb_marshal_hash *hash;
+
   kh_symbol_dump_table_t *symbols;
   kh_object_dump_table_t *data;
-
-  struct RClass *regexp_class;
+  /* strings by content with MRB_MARSHAL_DUMP_DEDUP_STRINGS, else NULL,
+     and an Array keeping them alive, as some are temporaries */
+  kh_string_dump_table_t *strings;
+  mrb_value string_keep;
+  /* shapes by a hash of their layout with MRB_MARSHAL_DUMP_SHAPES, else
+     NULL */
+  kh_shape_dump_table_t *shape_table;
+  struct dump_shape *shapes;
+  mrb_int nshapes, shapes_capa;
+  mrb_sym *shape_syms;
+  mrb_int nsyms, syms_capa;
+  /* link indices taken by payloads that are not objects, see w_data_native()
+     and w_core() */
+  mrb_int payloads;
+
+  struct mrb_marshal_core core;
+  struct mrb_marshal_data_registry *natives;
 };
 
 struct dump_call_arg {
   // mrb_value obj;
   struct dump_arg *arg;
   int limit;
+  long num_ivar;
 };
 
 static void check_dump_arg(mrb_state *mrb, struct dump_arg *arg, mrb_sym sym) {
@@ -48,19 +103,138 @@ static void check_dump_arg(mrb_state *mrb, struct dump_arg *arg, mrb_sym sym) {
     mrb_raisef(mrb, E_RUNTIME_ERROR, "Marshal.dump reentered at %s",
                mrb_sym_name(mrb, sym));
   }
+  if (arg->stats)
+    arg->stats->user_calls++;
 }
 
 static void w_long(mrb_state *, long, struct dump_arg *);
 
-static void w_nbyte(mrb_state *mrb, const char *s, long n,
+/* Registers obj under the next link index. */
+static void w_entry(mrb_state *mrb, mrb_value obj, struct dump_arg *arg) {
+  mrb_int idx = kh_size(arg->data) + arg->payloads;
+  khint_t k = kh_put(object_dump_table, mrb, arg->data, obj);
+  kh_value(object_dump_table, arg->data, k) = idx;
+}
+
+static void w_write(mrb_state *mrb, const void *s, long n,
                     struct dump_arg *arg) {
+  if (arg->hash) {
+    mrb_marshal_hash_update(arg->hash, s, n);
+    arg->position += n;
+    return;
+  }
+  if (arg->stats)
+    arg->stats->io_calls++;
   arg->position += arg->writer(mrb, s, n, arg->dest, arg->position);
 }
 
+static void w_put32(uint8_t *p, uint32_t x) {
+  p[0] = (uint8_t)x;
+  p[1] = (uint8_t)(x >> 8);
+  p[2] = (uint8_t)(x >> 16);
+  p[3] = (uint8_t)(x >> 24);
+}
+
+static void w_emit(mrb_state *mrb, const void *s, long n,
+                   struct dump_arg *arg) {
+  uint8_t header[8];
+
+  if (!(arg->flags & MRB_MARSHAL_DUMP_CHECKSUM)) {
+    w_write(mrb, s, n, arg);
+    return;
+  }
+  if (n == 0)
+    return;
+  arg->crc = mrb_marshal_crc32c(arg->crc, s, n);
+  w_put32(header, (uint32_t)n);
+  w_put32(header + 4, arg->crc);
+  w_write(mrb, header, sizeof(header), arg);
+  w_write(mrb, s, n, arg);
+}
+
+static void w_lz_block(mrb_state *mrb, struct dump_arg *arg) {
+  uint8_t header[8];
+  size_t len = arg->lz_len;
+  size_t clen = mrb_marshal_lz_compress(arg->lz_buf, len, arg->lz_out, len);
+
+  arg->lz_len = 0;
+  if (clen == 0 || clen >= len)
+    clen = 0;
+  w_put32(header, (uint32_t)len);
+  w_put32(header + 4, (uint32_t)clen);
+  w_emit(mrb, header, sizeof(header), arg);
+  if (clen)
+    w_emit(mrb, arg->lz_out, clen, arg);
+  else
+    w_emit(mrb, arg->lz_buf, len, arg);
+}
+
+static void w_lz_finish(mrb_state *mrb, struct dump_arg *arg) {
+  static const uint8_t eos[8] = {0};
+
+  if (arg->lz_len > 0)
+    w_lz_block(mrb, arg);
+  w_emit(mrb, eos, sizeof(eos), arg);
+}
+
+static void w_out(mrb_state *mrb, const char *s, long n, struct dump_arg *arg) {
+  if (arg->pipe) {
+    int err = mrb_marshal_pipe_write(arg->pipe, s, n);
+    if (err) {
+      errno = err;
+      mrb_sys_fail(mrb, "Marshal.dump");
+    }
+    arg->position += n;
+    return;
+  }
+  if (!arg->lz_buf) {
+    w_emit(mrb, s, n, arg);
+    return;
+  }
+  while (n > 0) {
+    size_t chunk = MARSHAL_LZ_BLOCK_SIZE - arg->lz_len;
+    if (chunk > (size_t)n)
+      chunk = n;
+    memcpy(arg->lz_buf + arg->lz_len, s, chunk);
+    arg->lz_len += chunk;
+    s += chunk;
+    n -= chunk;
+    if (arg->lz_len == MARSHAL_LZ_BLOCK_SIZE)
+      w_lz_block(mrb, arg);
+  }
+}
+
+static void w_flush(mrb_state *mrb, struct dump_arg *arg) {
+  if (arg->buf_len > 0) {
+    int len = arg->buf_len;
+    arg->buf_len = 0;
+    w_out(mrb, arg->buf, len, arg);
+  }
+}
+
+static void w_nbyte(mrb_state *mrb, const char *s, long n,
+                    struct dump_arg *arg) {
+  if (arg->buf_len + n > (long)sizeof(arg->buf)) {
+    w_flush(mrb, arg);
+    if (n >= (long)sizeof(arg->buf)) {
+      w_out(mrb, s, n, arg);
+      return;
+    }
+  }
+  memcpy(arg->buf + arg->buf_len, s, n);
+  arg->buf_len += n;
+}
+
 static void w_byte(mrb_state *mrb, char c, struct dump_arg *arg) {
   w_nbyte(mrb, &c, 1, arg);
 }
 
+static void w_type(mrb_state *mrb, char type, struct dump_arg *arg) {
+  if (arg->stats)
+    arg->stats->types[(uint8_t)type]++;
+  w_byte(mrb, type, arg);
+}
+
 static void w_bytes(mrb_state *mrb, const char *s, long n,
                     struct dump_arg *arg) {
   w_long(mrb, n, arg);
@@ -74,30 +248,25 @@ static void w_short(mrb_state *mrb, int x, struct dump_arg *arg) {
   w_byte(mrb, (char)((x >> 8) & 0xff), arg);
 }
 
-static void w_long(mrb_state *mrb, long x, struct dump_arg *arg) {
-  char buf[sizeof(long) + 1];
-  int i, len = 0;
+#define W_LONG_MAXLEN ((int)sizeof(long) + 1)
 
-#if SIZEOF_LONG > 4
-  if (!(RSHIFT(x, 31) == 0 || RSHIFT(x, 31) == -1)) {
-    /* big long does not fit in 4 bytes */
-    rb_raise(rb_eTypeError, "long too big to dump");
-  }
-#endif
+/* Encodes x into buf, which must hold W_LONG_MAXLEN bytes. */
+static int w_long_buf(char *buf, long x) {
+  int i;
 
   if (x == 0) {
-    w_byte(mrb, 0, arg);
-    return;
+    buf[0] = 0;
+    return 1;
   }
   if (0 < x && x < 123) {
-    w_byte(mrb, (char)(x + 5), arg);
-    return;
+    buf[0] = (char)(x + 5);
+    return 1;
   }
   if (-124 < x && x < 0) {
-    w_byte(mrb, (char)((x - 5) & 0xff), arg);
-    return;
+    buf[0] = (char)((x - 5) & 0xff);
+    return 1;
   }
-  for (i = 1; i < (int)sizeof(long) + 1; i++) {
+  for (i = 1; i < W_LONG_MAXLEN; i++) {
     buf[i] = (char)(x & 0xff);
     x = RSHIFT(x, 8);
     if (x == 0) {
@@ -109,10 +278,20 @@ static void w_long(mrb_state *mrb, long x, struct dump_arg *arg) {
       break;
     }
   }
-  len = i;
-  for (i = 0; i <= len; i++) {
-    w_byte(mrb, buf[i], arg);
+  return i + 1;
+}
+
+static void w_long(mrb_state *mrb, long x, struct dump_arg *arg) {
+  char buf[W_LONG_MAXLEN];
+
+#if SIZEOF_LONG > 4
+  if (!(RSHIFT(x, 31) == 0 || RSHIFT(x, 31) == -1)) {
+    /* big long does not fit in 4 bytes */
+    rb_raise(rb_eTypeError, "long too big to dump");
   }
+#endif
+
+  w_nbyte(mrb, buf, w_long_buf(buf, x), arg);
 }
 
 static void w_float(mrb_state *mrb, double d, struct dump_arg *arg) {
@@ -153,12 +332,64 @@ static void w_float(mrb_state *mrb, double d, struct dump_arg *arg) {
   }
 }
 
+/*
+ * Scans 8 bytes at a time for a byte with the high bit set, then validates
+ * the rest as UTF-8 (no overlong forms, surrogates or code points past
+ * U+10FFFF). Returns the encoding index to record, or -1 for binary data.
+ */
+static int w_encoding_index(const char *ptr, mrb_int len) {
+  const uint8_t *p = (const uint8_t *)ptr, *e = p + len;
+
+  while (e - p >= 8) {
+    uint64_t w;
+    memcpy(&w, p, sizeof(w));
+    if (w & UINT64_C(0x8080808080808080))
+      break;
+    p += 8;
+  }
+  while (p < e && *p < 0x80)
+    p++;
+  if (p == e)
+    return ENCODING_ASCII;
+
+  while (p < e) {
+    uint8_t c = *p;
+    int n;
+
+    if (c < 0x80) {
+      p++;
+      continue;
+    }
+    if (c < 0xc2)
+      return -1;
+    n = c < 0xe0 ? 1 : c < 0xf0 ? 2 : c < 0xf5 ? 3 : -1;
+    if (n < 0 || e - p <= n)
+      return -1;
+    if ((c == 0xe0 && p[1] < 0xa0) || (c == 0xed && p[1] >= 0xa0) ||
+        (c == 0xf0 && p[1] < 0x90) || (c == 0xf4 && p[1] >= 0x90))
+      return -1;
+    for (p++; n > 0; n--, p++) {
+      if ((*p & 0xc0) != 0x80)
+        return -1;
+    }
+  }
+  return ENCODING_UTF_8;
+}
+
+static int w_str_encoding(struct dump_arg *arg, mrb_value str) {
+  if (!(arg->flags & MRB_MARSHAL_DUMP_ENCODING))
+    return -1;
+  return w_encoding_index(RSTRING_PTR(str), RSTRING_LEN(str));
+}
+
+static void w_encoding(mrb_state *mrb, int encidx, struct dump_arg *arg);
+
 static void w_symbol(mrb_state *mrb, mrb_sym id, struct dump_arg *arg) {
   {
     khint_t i = kh_get(symbol_dump_table, mrb, arg->symbols, id);
     if (i != kh_end(arg->symbols) &&
         kh_exist(symbol_dump_table, arg->symbols, i)) {
-      w_byte(mrb, TYPE_SYMLINK, arg);
+      w_type(mrb, TYPE_SYMLINK, arg);
       w_long(mrb, kh_value(symbol_dump_table, arg->symbols, i), arg);
       return;
     }
@@ -167,8 +398,12 @@ static void w_symbol(mrb_state *mrb, mrb_sym id, struct dump_arg *arg) {
   int ai = mrb_gc_arena_save(mrb);
 
   mrb_value sym = mrb_sym_str(mrb, id);
+  /* like CRuby, only non-ASCII symbols carry an encoding */
+  int encidx = w_str_encoding(arg, sym);
 
-  w_byte(mrb, TYPE_SYMBOL, arg);
+  if (encidx == ENCODING_UTF_8)
+    w_type(mrb, TYPE_IVAR, arg);
+  w_type(mrb, TYPE_SYMBOL, arg);
   w_bytes(mrb, RSTRING_PTR(sym), RSTRING_LEN(sym), arg);
 
   mrb_gc_arena_restore(mrb, ai);
@@ -176,6 +411,18 @@ static void w_symbol(mrb_state *mrb, mrb_sym id, struct dump_arg *arg) {
   khint_t cur_size = kh_size(arg->symbols);
   khint_t new_idx = kh_put(symbol_dump_table, mrb, arg->symbols, id);
   kh_value(symbol_dump_table, arg->symbols, new_idx) = cur_size;
+
+  if (encidx == ENCODING_UTF_8) {
+    w_long(mrb, 1, arg);
+    w_encoding(mrb, encidx, arg);
+  }
+}
+
+static void w_encoding(mrb_state *mrb, int encidx, struct dump_arg *arg) {
+  if (encidx < 0)
+    return;
+  w_symbol(mrb, s_encoding_short, arg);
+  w_type(mrb, encidx == ENCODING_UTF_8 ? TYPE_TRUE : TYPE_FALSE, arg);
 }
 
 static void w_unique(mrb_state *mrb, mrb_value s, struct dump_arg *arg) {
@@ -194,6 +441,85 @@ static int hash_each(mrb_state *mrb, mrb_value key, mrb_value value, void *ud) {
   return 0; // continue
 }
 
+struct w_hash_entry {
+  uint64_t digest;
+  mrb_int index;
+};
+
+static int w_hash_entry_cmp(const void *a, const void *b) {
+  const struct w_hash_entry *x = (const struct w_hash_entry *)a;
+  const struct w_hash_entry *y = (const struct w_hash_entry *)b;
+  if (x->digest != y->digest)
+    return x->digest < y->digest ? -1 : 1;
+  return x->index < y->index ? -1 : x->index > y->index;
+}
+
+/*
+ * The sort digest of a hash key. Strings, symbols, integers, nil, true and
+ * false are hashed from their bytes under a type tag; anything else goes
+ * through a full mrb_marshal_digest.
+ */
+static uint64_t w_key_digest(mrb_state *mrb, mrb_value key,
+                             struct dump_call_arg *c_arg) {
+  struct mrb_marshal_hash h;
+  mrb_marshal_dump_options opts = {0};
+  uint8_t tag;
+  const char *p = NULL;
+  mrb_int n = 0;
+  uint8_t b[8];
+
+  if (mrb_string_p(key) && mrb_obj_class(mrb, key) == mrb->string_class) {
+    tag = '"';
+    p = RSTRING_PTR(key);
+    n = RSTRING_LEN(key);
+  } else if (mrb_symbol_p(key)) {
+    tag = ':';
+    p = mrb_sym_name_len(mrb, mrb_symbol(key), &n);
+  } else if (mrb_integer_p(key)) {
+    int64_t x = (int64_t)mrb_integer(key);
+    int k;
+    for (k = 0; k < 8; k++)
+      b[k] = (uint8_t)((uint64_t)x >> (k * 8));
+    tag = 'i';
+    p = (const char *)b;
+    n = sizeof(b);
+  } else if (mrb_nil_p(key)) {
+    tag = '0';
+  } else if (mrb_true_p(key)) {
+    tag = 'T';
+  } else if (mrb_false_p(key)) {
+    tag = 'F';
+  } else {
+    opts.flags = c_arg->arg->flags;
+    return mrb_marshal_digest(mrb, key, c_arg->limit, &opts);
+  }
+  mrb_marshal_hash_init(&h, 0);
+  mrb_marshal_hash_update(&h, &tag, 1);
+  if (n > 0)
+    mrb_marshal_hash_update(&h, p, (size_t)n);
+  return mrb_marshal_hash_final(&h);
+}
+
+/* MRB_MARSHAL_DUMP_CANONICAL: entries ordered by the digest of their key */
+static void w_hash_canonical(mrb_state *mrb, mrb_value hash,
+                             struct dump_call_arg *c_arg) {
+  mrb_value keys = mrb_hash_keys(mrb, hash);
+  mrb_int i, len = RARRAY_LEN(keys);
+  mrb_value buf = mrb_str_new(mrb, NULL, len * sizeof(struct w_hash_entry));
+  struct w_hash_entry *e = (struct w_hash_entry *)RSTRING_PTR(buf);
+
+  for (i = 0; i < len; i++) {
+    e[i].digest = w_key_digest(mrb, RARRAY_PTR(keys)[i], c_arg);
+    e[i].index = i;
+  }
+  qsort(e, len, sizeof(*e), w_hash_entry_cmp);
+  for (i = 0; i < len; i++) {
+    mrb_value key = RARRAY_PTR(keys)[e[i].index];
+    w_object(mrb, key, c_arg->arg, c_arg->limit);
+    w_object(mrb, mrb_hash_get(mrb, hash, key), c_arg->arg, c_arg->limit);
+  }
+}
+
 static void w_class(mrb_state *mrb, char type, mrb_value obj,
                     struct dump_arg *arg, int check) {
   mrb_value path;
@@ -203,7 +529,7 @@ static void w_class(mrb_state *mrb, char type, mrb_value obj,
 
   klass = mrb_obj_class(mrb, obj);
   // TODO: w_extended(mrb, klass, arg, check);
-  w_byte(mrb, type, arg);
+  w_type(mrb, type, arg);
   path = mrb_class_path(mrb, klass);
   w_unique(mrb, path, arg);
 
@@ -218,7 +544,7 @@ static void w_uclass(mrb_state *mrb, mrb_value obj, struct RClass *super,
 
   // TODO: w_extended(mrb, klass, arg, TRUE);
   if (klass != super) {
-    w_byte(mrb, TYPE_UCLASS, arg);
+    w_type(mrb, TYPE_UCLASS, arg);
     w_unique(mrb, mrb_class_path(mrb, klass), arg);
   }
 
@@ -229,71 +555,366 @@ static int w_obj_each(mrb_state *mrb, mrb_sym id, mrb_value value, void *ud) {
   int ai = mrb_gc_arena_save(mrb);
   struct dump_call_arg *arg = (struct dump_call_arg *)ud;
   // if (id == mrb_id_encoding()) return;
-  if (id == mrb_intern_lit(mrb, "E")) {
+  if (id == s_encoding_short) {
     mrb_gc_arena_restore(mrb, ai);
     return 0; // continue
   }
+  if (arg->num_ivar-- <= 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "instance variable added during dump");
+  }
   w_symbol(mrb, id, arg->arg);
   w_object(mrb, value, arg->arg, arg->limit);
   mrb_gc_arena_restore(mrb, ai);
   return 0; // continue
 }
 
-typedef struct iv_tbl {
-  int size, alloc;
-  mrb_value *ptr;
-} iv_tbl;
+static int w_obj_count_each(mrb_state *mrb, mrb_sym id, mrb_value value,
+                            void *ud) {
+  if (id != s_encoding_short)
+    (*(long *)ud)++;
+  return 0; // continue
+}
 
-#define IV_DELETED (1UL << 31)
-#define IV_KEY_P(k) (((k) & ~((uint32_t)IV_DELETED)) != 0)
+static long w_ivar_count(mrb_state *mrb, mrb_value obj) {
+  long num = 0;
+  mrb_iv_foreach(mrb, obj, w_obj_count_each, &num);
+  return num;
+}
 
-/* Iterates over the instance variable table. */
-static void iv_foreach(mrb_state *mrb, iv_tbl *t, mrb_iv_foreach_func *func,
-                       void *p) {
-  int i;
+/*
+ * Number of instance variables to write in an `I` wrapper. Objects, classes
+ * and modules are excluded as their ivars (if any) are part of their body.
+ */
+static long has_ivars(mrb_state *mrb, mrb_value obj) {
+  switch (mrb_type(obj)) {
+  case MRB_TT_OBJECT:
+  case MRB_TT_CLASS:
+  case MRB_TT_MODULE:
+  case MRB_TT_SCLASS:
+    return 0;
+  default:
+    return w_ivar_count(mrb, obj);
+  }
+}
 
-  if (t == NULL)
-    return;
-  if (t->alloc == 0)
-    return;
-  if (t->size == 0)
-    return;
+/*
+ * MRB_MARSHAL_DUMP_DEDUP_STRINGS: a plain String equal to one written
+ * before becomes a link to it. Returns TRUE if the link was written, else
+ * records obj under the link index w_entry() gives it next.
+ */
+static mrb_bool w_string_link(mrb_state *mrb, mrb_value obj,
+                              struct dump_arg *arg) {
+  khint_t k;
+
+  if (!mrb_string_p(obj) || mrb_obj_class(mrb, obj) != mrb->string_class ||
+      has_ivars(mrb, obj))
+    return FALSE;
+  k = kh_get(string_dump_table, mrb, arg->strings, obj);
+  if (k != kh_end(arg->strings)) {
+    w_type(mrb, TYPE_LINK, arg);
+    w_long(mrb, (long)kh_value(string_dump_table, arg->strings, k), arg);
+    return TRUE;
+  }
+  mrb_ary_push(mrb, arg->string_keep, obj);
+  k = kh_put(string_dump_table, mrb, arg->strings, obj);
+  kh_value(string_dump_table, arg->strings, k) =
+      kh_size(arg->data) + arg->payloads;
+  return FALSE;
+}
 
-  mrb_sym *keys = (mrb_sym *)&t->ptr[t->alloc];
-  mrb_value *vals = t->ptr;
-  for (i = 0; i < t->alloc; i++) {
-    if (IV_KEY_P(keys[i])) {
-      if ((*func)(mrb, keys[i], vals[i], p) != 0) {
-        return;
-      }
+struct shape_collect {
+  struct dump_arg *arg;
+  mrb_int n, capa;
+};
+
+static int w_shape_each(mrb_state *mrb, mrb_sym id, mrb_value value,
+                        void *ud) {
+  struct shape_collect *col = (struct shape_collect *)ud;
+
+  if (id == s_encoding_short)
+    return 0;
+  if (col->n == col->capa)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "instance variable added during dump");
+  col->arg->shape_syms[col->arg->nsyms + col->n++] = id;
+  return 0;
+}
+
+/*
+ * MRB_MARSHAL_DUMP_SHAPES: writes a plain object as its shape, the class
+ * and ivar names, followed by the ivar values. A shape seen before is
+ * written as its index. The names of obj are collected past the end of
+ * shape_syms and are kept there if they make a new shape.
+ */
+static void w_shaped(mrb_state *mrb, mrb_value obj,
+                     struct dump_call_arg *c_arg) {
+  struct dump_arg *arg = c_arg->arg;
+  struct RClass *klass = mrb_obj_class(mrb, obj);
+  struct shape_collect col;
+  struct mrb_marshal_hash h;
+  mrb_int i, k = -1, num = w_ivar_count(mrb, obj);
+  mrb_sym *syms;
+  uint64_t key;
+  khint_t x;
+
+  if (arg->nsyms + num > arg->syms_capa) {
+    mrb_int capa = arg->syms_capa ? arg->syms_capa * 2 : 64;
+
+    if (capa < arg->nsyms + num)
+      capa = arg->nsyms + num;
+    arg->shape_syms = (mrb_sym *)mrb_realloc(mrb, arg->shape_syms,
+                                             sizeof(mrb_sym) * capa);
+    arg->syms_capa = capa;
+  }
+  col.arg = arg;
+  col.n = 0;
+  col.capa = num;
+  mrb_iv_foreach(mrb, obj, w_shape_each, &col);
+  if (col.n != num)
+    mrb_raise(mrb, E_RUNTIME_ERROR, "instance variable removed during dump");
+  syms = arg->shape_syms + arg->nsyms;
+
+  mrb_marshal_hash_init(&h, 0);
+  mrb_marshal_hash_update(&h, &klass, sizeof(klass));
+  mrb_marshal_hash_update(&h, syms, sizeof(mrb_sym) * num);
+  key = mrb_marshal_hash_final(&h);
+  x = kh_get(shape_dump_table, mrb, arg->shape_table, key);
+  if (x != kh_end(arg->shape_table)) {
+    mrb_int j = kh_value(shape_dump_table, arg->shape_table, x);
+    const struct dump_shape *s = &arg->shapes[j];
+
+    if (s->klass == klass && s->n == num &&
+        memcmp(arg->shape_syms + s->off, syms, sizeof(mrb_sym) * num) == 0)
+      k = j;
+  }
+  if (k >= 0) {
+    w_type(mrb, TYPE_SHAPE, arg);
+    w_long(mrb, (long)k, arg);
+  } else {
+    if (arg->nshapes == arg->shapes_capa) {
+      arg->shapes_capa = arg->shapes_capa ? arg->shapes_capa * 2 : 16;
+      arg->shapes = (struct dump_shape *)mrb_realloc(
+          mrb, arg->shapes, sizeof(struct dump_shape) * arg->shapes_capa);
+    }
+    k = arg->nshapes++;
+    arg->shapes[k].klass = klass;
+    arg->shapes[k].off = arg->nsyms;
+    arg->shapes[k].n = num;
+    arg->nsyms += num;
+    /* on a hash collision the shape is written out but not looked up */
+    if (x == kh_end(arg->shape_table)) {
+      x = kh_put(shape_dump_table, mrb, arg->shape_table, key);
+      kh_value(shape_dump_table, arg->shape_table, x) = k;
     }
+    w_class(mrb, TYPE_SHAPE_DEF, obj, arg, TRUE);
+    w_long(mrb, (long)num, arg);
+    for (i = 0; i < num; i++)
+      w_symbol(mrb, arg->shape_syms[arg->shapes[k].off + i], arg);
+  }
+  /* by index, as nested objects may grow shape_syms */
+  for (i = 0; i < num; i++) {
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_sym id = arg->shape_syms[arg->shapes[k].off + i];
+
+    if (!mrb_iv_defined(mrb, obj, id))
+      mrb_raise(mrb, E_RUNTIME_ERROR, "instance variable removed during dump");
+    w_object(mrb, mrb_iv_get(mrb, obj, id), arg, c_arg->limit);
+    mrb_gc_arena_restore(mrb, ai);
   }
-  return;
 }
 
-#undef IV_DELETED
-#undef IV_KEY_P
+static void w_ivar_each(mrb_state *mrb, mrb_value obj, long num,
+                        struct dump_call_arg *arg) {
+  arg->num_ivar = num;
+  if (num > 0)
+    mrb_iv_foreach(mrb, obj, w_obj_each, arg);
+  if (arg->num_ivar > 0) {
+    mrb_raise(mrb, E_RUNTIME_ERROR, "instance variable removed during dump");
+  }
+}
 
-static void w_ivar(mrb_state *mrb, mrb_value obj, struct iv_tbl *tbl,
+static void w_ivar(mrb_state *mrb, mrb_value obj, long num, int encidx,
                    struct dump_call_arg *arg) {
-  // long num = tbl ? tbl->size : 0;
-  // w_encoding(obj, num, arg);
-  iv_foreach(mrb, tbl, w_obj_each, arg);
+  w_long(mrb, encidx >= 0 ? num + 1 : num, arg->arg);
+  w_encoding(mrb, encidx, arg->arg);
+  w_ivar_each(mrb, obj, num, arg);
 }
 
 static void w_objivar(mrb_state *mrb, mrb_value obj,
                       struct dump_call_arg *arg) {
-  mrb_iv_foreach(mrb, obj, w_obj_each, arg);
+  long num = w_ivar_count(mrb, obj);
+
+  w_long(mrb, num, arg->arg);
+  w_ivar_each(mrb, obj, num, arg);
+}
+
+/*
+ * Arrays holding only fixnums, or only floats without user dump hooks, are
+ * written by a tight loop instead of a w_object() call per element. The
+ * output is byte for byte what the generic path produces.
+ */
+static mrb_bool w_numeric_array(mrb_state *mrb, mrb_value ary,
+                                struct dump_arg *arg, int limit) {
+  long i, len = RARRAY_LEN(ary);
+  enum mrb_vtype tt;
+
+  if (limit == 0 || len == 0)
+    return FALSE;
+  tt = mrb_type(RARRAY_PTR(ary)[0]);
+  if (tt != MRB_TT_INTEGER && tt != MRB_TT_FLOAT)
+    return FALSE;
+  for (i = 1; i < len; i++) {
+    if (mrb_type(RARRAY_PTR(ary)[i]) != tt)
+      return FALSE;
+  }
+  if (tt == MRB_TT_FLOAT &&
+      (mrb_obj_respond_to(mrb, mrb->float_class, s_mdump) ||
+       mrb_obj_respond_to(mrb, mrb->float_class, s_dump)))
+    return FALSE;
+
+  for (i = 0; i < len; i++) {
+    mrb_value e;
+
+    if (len != RARRAY_LEN(ary)) {
+      mrb_raise(mrb, E_RUNTIME_ERROR, "array modified during dump");
+    }
+    e = RARRAY_PTR(ary)[i];
+    if (mrb_fixnum_p(e)) {
+      char *p;
+
+      if (arg->buf_len + 1 + W_LONG_MAXLEN > (int)sizeof(arg->buf))
+        w_flush(mrb, arg);
+      p = arg->buf + arg->buf_len;
+      p[0] = TYPE_FIXNUM;
+      if (arg->stats)
+        arg->stats->types[TYPE_FIXNUM]++;
+      arg->buf_len += 1 + w_long_buf(p + 1, mrb_fixnum(e));
+    } else if (mrb_float_p(e)) {
+      khint_t k = kh_get(object_dump_table, mrb, arg->data, e);
+
+      if (k != kh_end(arg->data) && kh_exist(object_dump_table, arg->data, k)) {
+        w_type(mrb, TYPE_LINK, arg);
+        w_long(mrb, (long)kh_value(object_dump_table, arg->data, k), arg);
+        continue;
+      }
+      w_entry(mrb, e, arg);
+      w_type(mrb, TYPE_FLOAT, arg);
+      w_float(mrb, mrb_float(e), arg);
+    } else {
+      w_object(mrb, e, arg, limit);
+    }
+  }
+  return TRUE;
+}
+
+/*
+ * Writes the bytes of a data object registered with
+ * mrb_marshal_register_data() as a String payload. The payload takes a link
+ * index like the String of a _dump_data would, without being an object.
+ */
+static void w_data_native(mrb_state *mrb, mrb_value obj,
+                          const struct mrb_marshal_data_entry *e,
+                          struct dump_arg *arg) {
+  char tmp[DUMP_BUFFER_SIZE];
+  mrb_int len;
+  const char *p = mrb_marshal_data_bytes(mrb, e, obj, tmp, sizeof(tmp), &len);
+
+  if (arg->stats)
+    arg->stats->user_calls++;
+  arg->payloads++;
+  w_type(mrb, TYPE_STRING, arg);
+  w_bytes(mrb, p, len, arg);
+}
+
+/*
+ * Writes Range, Time, Rational, Complex and Set in the forms CRuby writes,
+ * instead of failing or going through their ivars: Range as an object with
+ * excl, begin and end, Time as its `_dump` bytes with an offset ivar when
+ * not in UTC, Rational and Complex as the [a, b] of their marshal_dump, and
+ * Set as an object whose @hash maps the elements to true. The array and
+ * hash are written without being built. Returns FALSE for other objects.
+ */
+static mrb_bool w_core(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
+                       int limit) {
+  struct mrb_marshal_core *core = &arg->core;
+  struct RClass *klass;
+
+  if (mrb_range_p(obj)) {
+    struct RRange *r = mrb_range_ptr(mrb, obj);
+
+    w_entry(mrb, obj, arg);
+    w_class(mrb, TYPE_OBJECT, obj, arg, TRUE);
+    w_long(mrb, 3, arg);
+    w_symbol(mrb, MRB_SYM(excl), arg);
+    w_object(mrb, mrb_bool_value(RANGE_EXCL(r)), arg, limit);
+    w_symbol(mrb, MRB_SYM(begin), arg);
+    w_object(mrb, RANGE_BEG(r), arg, limit);
+    w_symbol(mrb, MRB_SYM(end), arg);
+    w_object(mrb, RANGE_END(r), arg, limit);
+    return TRUE;
+  }
+  if (mrb_immediate_p(obj))
+    return FALSE;
+  klass = mrb_obj_class(mrb, obj);
+  if (!klass || (klass != core->time && klass != core->rational &&
+                 klass != core->complex && klass != core->set))
+    return FALSE;
+
+  if (klass == core->time) {
+    uint8_t buf[8];
+    mrb_bool utc;
+    mrb_int offset;
+
+    mrb_marshal_time_dump(mrb, obj, buf, &utc, &offset);
+    if (!utc)
+      w_type(mrb, TYPE_IVAR, arg);
+    w_class(mrb, TYPE_USERDEF, obj, arg, FALSE);
+    w_bytes(mrb, (const char *)buf, sizeof(buf), arg);
+    if (!utc) {
+      w_long(mrb, 1, arg);
+      w_symbol(mrb, MRB_SYM(offset), arg);
+      w_object(mrb, mrb_int_value(mrb, offset), arg, limit);
+    }
+    w_entry(mrb, obj, arg);
+  } else if (klass == core->set) {
+    mrb_value elems = mrb_ensure_array_type(
+        mrb, mrb_funcall_id(mrb, obj, MRB_SYM(to_a), 0));
+    long i, len = RARRAY_LEN(elems);
+
+    w_entry(mrb, obj, arg);
+    w_class(mrb, TYPE_OBJECT, obj, arg, TRUE);
+    w_long(mrb, 1, arg);
+    w_symbol(mrb, MRB_IVSYM(hash), arg);
+    arg->payloads++;
+    w_type(mrb, TYPE_HASH_DEF, arg);
+    w_long(mrb, len, arg);
+    for (i = 0; i < len && i < RARRAY_LEN(elems); i++) {
+      w_object(mrb, RARRAY_PTR(elems)[i], arg, limit);
+      w_type(mrb, TYPE_TRUE, arg);
+    }
+    w_type(mrb, TYPE_FALSE, arg);
+  } else {
+    mrb_value a, b;
+
+    mrb_marshal_core_parts(mrb, core, obj, &a, &b);
+    w_entry(mrb, obj, arg);
+    w_class(mrb, TYPE_USRMARSHAL, obj, arg, FALSE);
+    arg->payloads++;
+    w_type(mrb, TYPE_ARRAY, arg);
+    w_long(mrb, 2, arg);
+    w_object(mrb, a, arg, limit);
+    w_object(mrb, b, arg, limit);
+  }
+  if (arg->stats)
+    arg->stats->user_calls++;
+  return TRUE;
 }
 
 static void w_object(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
                      int limit) {
   struct dump_call_arg c_arg;
-  struct iv_tbl *ivtbl = NULL;
 
-  int hasiv = 0;
-#define has_ivars(obj, ivtbl)                                                  \
-  FALSE // (mrb_object_p(obj) && (ivtbl = mrb_obj_ptr(obj)->iv))
+  long hasiv = 0;
+  int encidx = -1;
 
   if (limit == 0) {
     mrb_raise(mrb, E_ARGUMENT_ERROR, "exceed depth limit");
@@ -301,12 +922,17 @@ static void w_object(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
 
   limit--;
   c_arg.limit = limit;
+  c_arg.num_ivar = 0;
   c_arg.arg = arg;
 
+  /* lazily loaded containers are written as the Array or Hash they stand for */
+  if (mrb_type(obj) == MRB_TT_DATA)
+    obj = mrb_marshal_lazy_plain(mrb, obj);
+
   {
     khint_t i = kh_get(object_dump_table, mrb, arg->data, obj);
     if (i != kh_end(arg->data) && kh_exist(object_dump_table, arg->data, i)) {
-      w_byte(mrb, TYPE_LINK, arg);
+      w_type(mrb, TYPE_LINK, arg);
       w_long(mrb, (long)kh_value(object_dump_table, arg->data, i), arg);
       return;
     }
@@ -315,18 +941,18 @@ static void w_object(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
   int ai = mrb_gc_arena_save(mrb);
 
   if (mrb_nil_p(obj)) {
-    w_byte(mrb, TYPE_NIL, arg);
+    w_type(mrb, TYPE_NIL, arg);
   } else if (mrb_true_p(obj)) {
-    w_byte(mrb, TYPE_TRUE, arg);
+    w_type(mrb, TYPE_TRUE, arg);
   } else if (mrb_false_p(obj)) {
-    w_byte(mrb, TYPE_FALSE, arg);
+    w_type(mrb, TYPE_FALSE, arg);
   } else if (mrb_fixnum_p(obj)) {
 #if SIZEOF_LONG <= 4
-    w_byte(mrb, TYPE_FIXNUM, arg);
+    w_type(mrb, TYPE_FIXNUM, arg);
     w_long(mrb, mrb_fixnum(obj), arg);
 #else
     if (RSHIFT((long)obj, 31) == 0 || RSHIFT((long)obj, 31) == -1) {
-      w_byte(mrb, TYPE_FIXNUM, arg);
+      w_type(mrb, TYPE_FIXNUM, arg);
       w_long(mrb, FIX2LONG(obj), arg);
     } else {
       w_object(mrb, rb_int2big(FIX2LONG(obj)), arg, limit);
@@ -340,66 +966,80 @@ static void w_object(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
     if (mrb_respond_to(mrb, obj, s_mdump)) {
       mrb_value v;
 
-      khint_t cur_size = kh_size(arg->data);
-      khint_t new_idx = kh_put(object_dump_table, mrb, arg->data, obj);
-      kh_value(object_dump_table, arg->data, new_idx) = cur_size;
+      w_entry(mrb, obj, arg);
 
       v = mrb_funcall_id(mrb, obj, s_mdump, 0);
       check_dump_arg(mrb, arg, s_mdump);
-      hasiv = has_ivars(obj, ivtbl);
+      hasiv = has_ivars(mrb, obj);
       if (hasiv)
-        w_byte(mrb, TYPE_IVAR, arg);
+        w_type(mrb, TYPE_IVAR, arg);
       w_class(mrb, TYPE_USRMARSHAL, obj, arg, FALSE);
       w_object(mrb, v, arg, limit);
       if (hasiv)
-        w_ivar(mrb, obj, ivtbl, &c_arg);
+        w_ivar(mrb, obj, hasiv, -1, &c_arg);
       return;
     }
     if (mrb_respond_to(mrb, obj, s_dump)) {
       mrb_value v;
-      struct iv_tbl *ivtbl2 = 0;
-      int hasiv2;
+      long hasiv2;
+      int encidx2;
 
       v = mrb_funcall_id(mrb, obj, s_dump, 1, mrb_fixnum_value(limit));
       check_dump_arg(mrb, arg, s_dump);
       if (!mrb_string_p(v)) {
         mrb_raise(mrb, E_TYPE_ERROR, "_dump() must return string");
       }
-      hasiv = has_ivars(obj, ivtbl);
+      hasiv = has_ivars(mrb, obj);
       if (hasiv)
-        w_byte(mrb, TYPE_IVAR, arg);
-      if ((hasiv2 = has_ivars(v, ivtbl2)) != 0 && !hasiv) {
-        w_byte(mrb, TYPE_IVAR, arg);
+        w_type(mrb, TYPE_IVAR, arg);
+      hasiv2 = has_ivars(mrb, v);
+      encidx2 = w_str_encoding(arg, v);
+      if ((hasiv2 || encidx2 >= 0) && !hasiv) {
+        w_type(mrb, TYPE_IVAR, arg);
       }
       w_class(mrb, TYPE_USERDEF, obj, arg, FALSE);
       w_bytes(mrb, RSTRING_PTR(v), RSTRING_LEN(v), arg);
-      if (hasiv2) {
-        w_ivar(mrb, v, ivtbl2, &c_arg);
+      if (hasiv2 || encidx2 >= 0) {
+        w_ivar(mrb, v, hasiv2, encidx2, &c_arg);
       } else if (hasiv) {
-        w_ivar(mrb, obj, ivtbl, &c_arg);
+        w_ivar(mrb, obj, hasiv, -1, &c_arg);
       }
-      khint_t cur_size = kh_size(arg->data);
-      khint_t new_idx = kh_put(object_dump_table, mrb, arg->data, obj);
-      kh_value(object_dump_table, arg->data, new_idx) = cur_size;
+      w_entry(mrb, obj, arg);
+      return;
+    }
+    if (w_core(mrb, obj, arg, limit)) {
+      mrb_gc_arena_restore(mrb, ai);
+      return;
+    }
+    if (arg->strings && w_string_link(mrb, obj, arg)) {
+      mrb_gc_arena_restore(mrb, ai);
       return;
     }
 
-    khint_t cur_size = kh_size(arg->data);
-    khint_t new_idx = kh_put(object_dump_table, mrb, arg->data, obj);
-    kh_value(object_dump_table, arg->data, new_idx) = cur_size;
+    w_entry(mrb, obj, arg);
+
+    mrb_value src = mrb_nil_value();
+    mrb_bool regexp_p =
+        arg->core.regexp && mrb_obj_class(mrb, obj) == arg->core.regexp;
+
+    if (regexp_p) {
+      src = mrb_funcall_id(mrb, obj, MRB_SYM(source), 0);
+      mrb_ensure_string_type(mrb, src);
+      encidx = w_str_encoding(arg, src);
+    } else if (mrb_string_p(obj)) {
+      encidx = w_str_encoding(arg, obj);
+    }
 
-    hasiv = has_ivars(obj, ivtbl);
-    if (hasiv)
-      w_byte(mrb, TYPE_IVAR, arg);
+    hasiv = has_ivars(mrb, obj);
+    if (hasiv || encidx >= 0)
+      w_type(mrb, TYPE_IVAR, arg);
 
-    if (arg->regexp_class && mrb_obj_class(mrb, obj) == arg->regexp_class) {
-      w_uclass(mrb, obj, arg->regexp_class, arg);
-      w_byte(mrb, TYPE_REGEXP, arg);
+    if (regexp_p) {
+      w_uclass(mrb, obj, arg->core.regexp, arg);
+      w_type(mrb, TYPE_REGEXP, arg);
       {
-        mrb_value src = mrb_funcall_id(mrb, obj, MRB_SYM(source), 0);
         int opts =
             mrb_as_int(mrb, mrb_funcall_id(mrb, obj, MRB_SYM(options), 0));
-        mrb_ensure_string_type(mrb, src);
         w_bytes(mrb, RSTRING_PTR(src), RSTRING_LEN(src), arg);
         w_byte(mrb, (char)opts, arg);
       }
@@ -411,7 +1051,7 @@ static void w_object(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
         // {
         //   rb_raise(rb_eTypeError, "singleton class can't be dumped");
         // }
-        w_byte(mrb, TYPE_CLASS, arg);
+        w_type(mrb, TYPE_CLASS, arg);
         {
           mrb_value path =
               mrb_class_path(mrb, (struct RClass *)mrb_obj_ptr(obj));
@@ -420,7 +1060,7 @@ static void w_object(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
         break;
 
       case MRB_TT_MODULE:
-        w_byte(mrb, TYPE_MODULE, arg);
+        w_type(mrb, TYPE_MODULE, arg);
         {
           mrb_value path =
               mrb_class_path(mrb, (struct RClass *)mrb_obj_ptr(obj));
@@ -429,13 +1069,13 @@ static void w_object(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
         break;
 
       case MRB_TT_FLOAT:
-        w_byte(mrb, TYPE_FLOAT, arg);
+        w_type(mrb, TYPE_FLOAT, arg);
         w_float(mrb, mrb_float(obj), arg);
         break;
 
       case MRB_TT_STRING:
         w_uclass(mrb, obj, mrb->string_class, arg);
-        w_byte(mrb, TYPE_STRING, arg);
+        w_type(mrb, TYPE_STRING, arg);
         w_bytes(mrb, RSTRING_PTR(obj), RSTRING_LEN(obj), arg);
         break;
 
@@ -451,11 +1091,13 @@ static void w_object(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
 
       case MRB_TT_ARRAY:
         w_uclass(mrb, obj, mrb->array_class, arg);
-        w_byte(mrb, TYPE_ARRAY, arg);
+        w_type(mrb, TYPE_ARRAY, arg);
         {
           long i, len = RARRAY_LEN(obj);
 
           w_long(mrb, len, arg);
+          if (w_numeric_array(mrb, obj, arg, limit))
+            break;
           for (i = 0; i < RARRAY_LEN(obj); i++) {
             w_object(mrb, RARRAY_PTR(obj)[i], arg, limit);
             if (len != RARRAY_LEN(obj)) {
@@ -468,14 +1110,17 @@ static void w_object(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
       case MRB_TT_HASH:
         w_uclass(mrb, obj, mrb->hash_class, arg);
         if (!MRB_RHASH_DEFAULT_P(obj)) {
-          w_byte(mrb, TYPE_HASH, arg);
+          w_type(mrb, TYPE_HASH, arg);
         } else if (MRB_RHASH_PROCDEFAULT_P(obj)) {
           mrb_raise(mrb, E_TYPE_ERROR, "can't dump hash with default proc");
         } else {
-          w_byte(mrb, TYPE_HASH_DEF, arg);
+          w_type(mrb, TYPE_HASH_DEF, arg);
         }
         w_long(mrb, mrb_hash_size(mrb, obj), arg);
-        mrb_hash_foreach(mrb, mrb_hash_ptr(obj), hash_each, &c_arg);
+        if (arg->flags & MRB_MARSHAL_DUMP_CANONICAL)
+          w_hash_canonical(mrb, obj, &c_arg);
+        else
+          mrb_hash_foreach(mrb, mrb_hash_ptr(obj), hash_each, &c_arg);
         if (MRB_RHASH_DEFAULT_P(obj)) {
           mrb_raise(mrb, E_TYPE_ERROR, "can't dump hash with default");
           // w_object(mrb, RHASH_IFNONE(obj), arg, limit);
@@ -503,13 +1148,24 @@ static void w_object(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
         break;
 
       case MRB_TT_OBJECT:
+        if (arg->shape_table) {
+          w_shaped(mrb, obj, &c_arg);
+          break;
+        }
         w_class(mrb, TYPE_OBJECT, obj, arg, TRUE);
         w_objivar(mrb, obj, &c_arg);
         break;
 
       case MRB_TT_DATA: {
+        const struct mrb_marshal_data_entry *e =
+            mrb_marshal_data_by_type(arg->natives, DATA_TYPE(obj));
         mrb_value v;
 
+        if (e) {
+          w_class(mrb, TYPE_DATA, obj, arg, TRUE);
+          w_data_native(mrb, obj, e, arg);
+          break;
+        }
         if (!mrb_respond_to(mrb, obj, s_dump_data)) {
           mrb_raisef(mrb, E_TYPE_ERROR, "no _dump_data is defined for class %s",
                      mrb_obj_classname(mrb, obj));
@@ -526,8 +1182,8 @@ static void w_object(mrb_state *mrb, mrb_value obj, struct dump_arg *arg,
         break;
       }
   }
-  if (hasiv) {
-    w_ivar(mrb, obj, ivtbl, &c_arg);
+  if (hasiv || encidx >= 0) {
+    w_ivar(mrb, obj, hasiv, encidx, &c_arg);
   }
 
   mrb_gc_arena_restore(mrb, ai);
@@ -538,12 +1194,26 @@ static void clear_dump_arg(mrb_state *mrb, struct dump_arg *arg) {
     kh_destroy(symbol_dump_table, mrb, arg->symbols);
   if (arg->data)
     kh_destroy(object_dump_table, mrb, arg->data);
+  if (arg->strings)
+    kh_destroy(string_dump_table, mrb, arg->strings);
+  if (arg->shape_table)
+    kh_destroy(shape_dump_table, mrb, arg->shape_table);
+  mrb_free(mrb, arg->shapes);
+  mrb_free(mrb, arg->shape_syms);
+  mrb_free(mrb, arg->lz_buf);
+  mrb_free(mrb, arg->lz_out);
+  if (arg->pipe)
+    mrb_marshal_pipe_close(mrb, arg->pipe, FALSE);
+  arg->pipe = NULL;
   arg->symbols = NULL;
   arg->data = NULL;
+  arg->strings = NULL;
+  arg->shape_table = NULL;
+  arg->shapes = NULL;
+  arg->shape_syms = NULL;
+  arg->lz_buf = arg->lz_out = NULL;
 }
 
-#include <mruby/data.h>
-
 static void free_dump_arg(mrb_state *mrb, void *ud) {
   clear_dump_arg(mrb, (struct dump_arg *)ud);
   mrb_free(mrb, ud);
@@ -554,23 +1224,137 @@ static mrb_data_type _mrb_dump_arg = {"Marshal::DumpARG", free_dump_arg};
 void mrb_marshal_dump(mrb_state *mrb, mrb_value obj,
                       mrb_marshal_writer_t writer, mrb_value target,
                       int limit) {
+  mrb_marshal_dump2(mrb, obj, writer, target, limit, NULL);
+}
+
+struct dump_top {
+  struct dump_arg *arg;
+  mrb_value obj;
+  int limit;
+};
+
+static mrb_value w_dump_top(mrb_state *mrb, void *ud) {
+  struct dump_top *top = (struct dump_top *)ud;
+  struct dump_arg *arg = top->arg;
+
+  if (arg->shape_table)
+    w_nbyte(mrb, MARSHAL_SH_MAGIC, MARSHAL_SH_MAGIC_LEN, arg);
+  w_byte(mrb, MARSHAL_MAJOR, arg);
+  w_byte(mrb, MARSHAL_MINOR, arg);
+  w_object(mrb, top->obj, arg, top->limit);
+  w_flush(mrb, arg);
+  if (arg->lz_buf)
+    w_lz_finish(mrb, arg);
+  if (!arg->pipe && (arg->flags & MRB_MARSHAL_DUMP_CHECKSUM)) {
+    uint8_t eos[8];
+    w_put32(eos, 0);
+    w_put32(eos + 4, arg->crc);
+    w_write(mrb, eos, sizeof(eos), arg);
+  }
+  if (arg->pipe) {
+    int err = mrb_marshal_pipe_close(mrb, arg->pipe, TRUE);
+    arg->pipe = NULL;
+    if (err) {
+      errno = err;
+      mrb_sys_fail(mrb, "Marshal.dump");
+    }
+  }
+
+  if (arg->stats) {
+    mrb_marshal_stats *stats = arg->stats;
+    stats->seconds = mrb_marshal_clock() - stats->seconds;
+    stats->bytes = arg->position;
+    stats->links = stats->types[TYPE_LINK];
+    stats->symlinks = stats->types[TYPE_SYMLINK];
+    stats->peak_links = kh_size(arg->data) + arg->payloads;
+  }
+  return mrb_nil_value();
+}
+
+static void dump_call(mrb_state *mrb, mrb_value obj,
+                      mrb_marshal_writer_t writer, mrb_value target, int fd,
+                      struct mrb_marshal_hash *hash, int limit,
+                      const mrb_marshal_dump_options *opts) {
   struct dump_arg *arg;
   struct RData *wrapper;
+  struct dump_top top;
+  mrb_value exc;
+  mrb_bool error;
   Data_Make_Struct(mrb, mrb->object_class, struct dump_arg, &_mrb_dump_arg, arg,
                    wrapper);
   arg->dest = target;
   arg->position = 0;
   arg->writer = writer;
+  arg->flags = opts ? opts->flags : 0;
+  arg->stats = opts ? opts->stats : NULL;
+  arg->hash = hash;
+  if (hash)
+    arg->flags &= MRB_MARSHAL_DUMP_ENCODING | MRB_MARSHAL_DUMP_CANONICAL;
+  if (arg->stats) {
+    memset(arg->stats, 0, sizeof(*arg->stats));
+    arg->stats->seconds = mrb_marshal_clock();
+  }
   arg->symbols = kh_init(symbol_dump_table, mrb);
   arg->data = kh_init(object_dump_table, mrb);
-  arg->regexp_class = mrb_const_defined(mrb, mrb_obj_value(mrb->object_class),
-                                        mrb_intern_cstr(mrb, REGEXP_CLASS))
-                          ? mrb_class_get(mrb, REGEXP_CLASS)
-                          : NULL;
-
-  w_byte(mrb, MARSHAL_MAJOR, arg);
-  w_byte(mrb, MARSHAL_MINOR, arg);
-  w_object(mrb, obj, arg, limit);
+  arg->strings = (arg->flags & MRB_MARSHAL_DUMP_DEDUP_STRINGS)
+                     ? kh_init(string_dump_table, mrb)
+                     : NULL;
+  arg->string_keep = mrb_nil_value();
+  if (arg->strings) {
+    arg->string_keep = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, mrb_obj_value(wrapper), MRB_IVSYM(strings),
+               arg->string_keep);
+  }
+  arg->shape_table = (arg->flags & MRB_MARSHAL_DUMP_SHAPES)
+                         ? kh_init(shape_dump_table, mrb)
+                         : NULL;
+  arg->shapes = NULL;
+  arg->nshapes = arg->shapes_capa = 0;
+  arg->shape_syms = NULL;
+  arg->nsyms = arg->syms_capa = 0;
+  arg->payloads = 0;
+  arg->natives = mrb_marshal_data_registry(mrb);
+  mrb_marshal_core_init(mrb, &arg->core);
+
+  if (fd >= 0) {
+    arg->pipe = mrb_marshal_pipe_open(mrb, fd, arg->flags);
+  } else if (arg->flags & MRB_MARSHAL_DUMP_CHECKSUM) {
+    w_write(mrb, MARSHAL_CK_MAGIC, MARSHAL_CK_MAGIC_LEN, arg);
+  }
+  if (!arg->pipe && (arg->flags & MRB_MARSHAL_DUMP_COMPRESS_LZ)) {
+    arg->lz_buf = (uint8_t *)mrb_malloc(mrb, MARSHAL_LZ_BLOCK_SIZE);
+    arg->lz_out = (uint8_t *)mrb_malloc(mrb, MARSHAL_LZ_BLOCK_SIZE);
+    w_emit(mrb, MARSHAL_LZ_MAGIC, MARSHAL_LZ_MAGIC_LEN, arg);
+  }
 
+  /* on a raise the pipe thread is stopped now rather than at GC */
+  top.arg = arg;
+  top.obj = obj;
+  top.limit = limit;
+  exc = mrb_protect_error(mrb, w_dump_top, &top, &error);
   clear_dump_arg(mrb, arg);
+  if (error)
+    mrb_exc_raise(mrb, exc);
+}
+
+void mrb_marshal_dump2(mrb_state *mrb, mrb_value obj,
+                       mrb_marshal_writer_t writer, mrb_value target, int limit,
+                       const mrb_marshal_dump_options *opts) {
+  dump_call(mrb, obj, writer, target, -1, NULL, limit, opts);
+}
+
+void mrb_marshal_dump_fd(mrb_state *mrb, mrb_value obj, int fd, int limit,
+                         const mrb_marshal_dump_options *opts) {
+  if (fd < 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "bad file descriptor");
+  dump_call(mrb, obj, NULL, mrb_nil_value(), fd, NULL, limit, opts);
+}
+
+uint64_t mrb_marshal_digest(mrb_state *mrb, mrb_value obj, int limit,
+                            const mrb_marshal_dump_options *opts) {
+  struct mrb_marshal_hash hash;
+
+  mrb_marshal_hash_init(&hash, 0);
+  dump_call(mrb, obj, NULL, mrb_nil_value(), -1, &hash, limit, opts);
+  return mrb_marshal_hash_final(&hash);
 }
@@ -0,0 +1,402 @@
+#include <mruby.h>
+#include <mruby/value.h>
+#include <mruby/marshal.h>
+#include <mruby/array.h>
+#include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/hash.h>
+#include <mruby/string.h>
+#include <mruby/variable.h>
+#include <mruby/presym.h>
+
+#include "common.h"
+
+/*
+ * Marshal::LazyArray and Marshal::LazyHash - what a lazy load returns in
+ * place of large arrays and hashes. Elements are decoded by load.c from the
+ * positions its skip scan recorded, once each, on first access. A LazyHash
+ * decodes all of its keys on the first lookup and its values one by one.
+ *
+ * @state keeps the load state and source alive, @values holds the decoded
+ * elements (LazyArray) or values (LazyHash), @index maps keys to entries.
+ * @plain is the fully decoded Array or Hash that dump and deep_copy use.
+ */
+
+struct _lazy
+{
+  struct load_arg *arg;
+  mrb_int elem; /* first element position; a hash has key, value pairs */
+  mrb_int len;
+  uint8_t *done; /* per decoded element or value */
+  mrb_bool indexed;
+};
+
+static void
+_lazy_free(mrb_state *mrb, void *p)
+{
+  struct _lazy *lz = (struct _lazy *)p;
+  if (lz)
+  {
+    mrb_free(mrb, lz->done);
+    mrb_free(mrb, lz);
+  }
+}
+
+static const struct mrb_data_type _lazy_array_type = { "Marshal::LazyArray", _lazy_free };
+static const struct mrb_data_type _lazy_hash_type = { "Marshal::LazyHash", _lazy_free };
+
+mrb_value
+mrb_marshal_lazy_new(mrb_state *mrb, mrb_value state, struct load_arg *arg, mrb_int elem, mrb_int len, mrb_bool hash)
+{
+  struct RClass *marshal = mrb_module_get_id(mrb, MRB_SYM(Marshal));
+  struct RClass *c = mrb_class_get_under_id(mrb, marshal, hash ? MRB_SYM(LazyHash) : MRB_SYM(LazyArray));
+  struct RData *d = mrb_data_object_alloc(mrb, c, NULL, hash ? &_lazy_hash_type : &_lazy_array_type);
+  mrb_value self = mrb_obj_value(d);
+  struct _lazy *lz;
+
+  lz = (struct _lazy *)mrb_calloc(mrb, 1, sizeof(struct _lazy));
+  d->data = lz;
+  lz->done = (uint8_t *)mrb_calloc(mrb, len > 0 ? len : 1, 1);
+  lz->arg = arg;
+  lz->elem = elem;
+  lz->len = len;
+  mrb_iv_set(mrb, self, MRB_IVSYM(state), state);
+  mrb_iv_set(mrb, self, MRB_IVSYM(values), mrb_ary_new(mrb));
+  return self;
+}
+
+static struct _lazy *
+_lazy_get(mrb_state *mrb, mrb_value self, const struct mrb_data_type *type)
+{
+  struct _lazy *lz = (struct _lazy *)mrb_data_get_ptr(mrb, self, type);
+  if (!lz)
+  {
+    mrb_raise(mrb, E_TYPE_ERROR, "uninitialized lazy container");
+  }
+  return lz;
+}
+
+/* Element i of a LazyArray or value i of a LazyHash, decoded at elem. */
+static mrb_value
+_lazy_value(mrb_state *mrb, mrb_value self, struct _lazy *lz, mrb_int i, mrb_int elem)
+{
+  mrb_value values = mrb_iv_get(mrb, self, MRB_IVSYM(values));
+  mrb_value v;
+
+  if (lz->done[i])
+  {
+    return mrb_ary_entry(values, i);
+  }
+  v = mrb_marshal_lazy_decode(mrb, lz->arg, elem);
+  mrb_ary_set(mrb, values, i, v);
+  lz->done[i] = 1;
+  return v;
+}
+
+static mrb_value
+_lazy_array_at(mrb_state *mrb, mrb_value self, struct _lazy *lz, mrb_int i)
+{
+  return _lazy_value(mrb, self, lz, i, lz->elem + i);
+}
+
+static mrb_value
+_lazy_hash_value(mrb_state *mrb, mrb_value self, struct _lazy *lz, mrb_int i)
+{
+  return _lazy_value(mrb, self, lz, i, lz->elem + i * 2 + 1);
+}
+
+/* Decodes the keys of a LazyHash into a Hash from key to entry number. */
+static mrb_value
+_lazy_hash_index(mrb_state *mrb, mrb_value self, struct _lazy *lz)
+{
+  mrb_value index;
+  mrb_int i;
+  int ai;
+
+  if (lz->indexed)
+  {
+    return mrb_iv_get(mrb, self, MRB_IVSYM(index));
+  }
+  index = mrb_hash_new_capa(mrb, lz->len);
+  mrb_iv_set(mrb, self, MRB_IVSYM(index), index);
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < lz->len; i++)
+  {
+    mrb_value key = mrb_marshal_lazy_decode(mrb, lz->arg, lz->elem + i * 2);
+    /* as a load would: String keys are frozen in place */
+    if (mrb_string_p(key) && !mrb_frozen_p(mrb_str_ptr(key)))
+    {
+      MRB_SET_FROZEN_FLAG(mrb_str_ptr(key));
+    }
+    mrb_hash_set(mrb, index, key, mrb_int_value(mrb, i));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  lz->indexed = TRUE;
+  return index;
+}
+
+static mrb_value
+_lazy_dig(mrb_state *mrb, mrb_value v, mrb_int argc, const mrb_value *argv)
+{
+  if (argc == 0 || mrb_nil_p(v))
+  {
+    return v;
+  }
+  return mrb_funcall_argv(mrb, v, MRB_SYM(dig), argc, argv);
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_array_size(mrb_state *mrb, mrb_value self)
+{
+  return mrb_int_value(mrb, _lazy_get(mrb, self, &_lazy_array_type)->len);
+}
+
+static mrb_value
+_lazy_array_aref(mrb_state *mrb, mrb_value self, mrb_int i)
+{
+  struct _lazy *lz = _lazy_get(mrb, self, &_lazy_array_type);
+  if (i < 0)
+  {
+    i += lz->len;
+  }
+  if (i < 0 || i >= lz->len)
+  {
+    return mrb_nil_value();
+  }
+  return _lazy_array_at(mrb, self, lz, i);
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_array_aref(mrb_state *mrb, mrb_value self)
+{
+  mrb_int i;
+  mrb_get_args(mrb, "i", &i);
+  return _lazy_array_aref(mrb, self, i);
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_array_dig(mrb_state *mrb, mrb_value self)
+{
+  const mrb_value *argv;
+  mrb_int i, argc;
+  mrb_get_args(mrb, "i*", &i, &argv, &argc);
+  return _lazy_dig(mrb, _lazy_array_aref(mrb, self, i), argc, argv);
+}
+
+static void
+_lazy_array_fill(mrb_state *mrb, mrb_value self, struct _lazy *lz, mrb_value ary)
+{
+  mrb_int i;
+  int ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < lz->len; i++)
+  {
+    mrb_ary_push(mrb, ary, _lazy_array_at(mrb, self, lz, i));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_array_to_a(mrb_state *mrb, mrb_value self)
+{
+  struct _lazy *lz = _lazy_get(mrb, self, &_lazy_array_type);
+  mrb_value ary = mrb_ary_new_capa(mrb, lz->len);
+  _lazy_array_fill(mrb, self, lz, ary);
+  return ary;
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_array_each(mrb_state *mrb, mrb_value self)
+{
+  struct _lazy *lz = _lazy_get(mrb, self, &_lazy_array_type);
+  mrb_value blk;
+  mrb_int i;
+  int ai;
+  mrb_get_args(mrb, "&", &blk);
+  if (mrb_nil_p(blk))
+  {
+    return mrb_funcall_id(mrb, mrb_mruby_marshal_lazy_array_to_a(mrb, self), MRB_SYM(each), 0);
+  }
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < lz->len; i++)
+  {
+    mrb_yield(mrb, blk, _lazy_array_at(mrb, self, lz, i));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  return self;
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_hash_size(mrb_state *mrb, mrb_value self)
+{
+  return mrb_int_value(mrb, _lazy_get(mrb, self, &_lazy_hash_type)->len);
+}
+
+static mrb_value
+_lazy_hash_aref(mrb_state *mrb, mrb_value self, mrb_value key)
+{
+  struct _lazy *lz = _lazy_get(mrb, self, &_lazy_hash_type);
+  mrb_value i = mrb_hash_get(mrb, _lazy_hash_index(mrb, self, lz), key);
+  if (!mrb_integer_p(i))
+  {
+    return mrb_nil_value();
+  }
+  return _lazy_hash_value(mrb, self, lz, mrb_integer(i));
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_hash_aref(mrb_state *mrb, mrb_value self)
+{
+  mrb_value key;
+  mrb_get_args(mrb, "o", &key);
+  return _lazy_hash_aref(mrb, self, key);
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_hash_dig(mrb_state *mrb, mrb_value self)
+{
+  const mrb_value *argv;
+  mrb_value key;
+  mrb_int argc;
+  mrb_get_args(mrb, "o*", &key, &argv, &argc);
+  return _lazy_dig(mrb, _lazy_hash_aref(mrb, self, key), argc, argv);
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_hash_key_p(mrb_state *mrb, mrb_value self)
+{
+  struct _lazy *lz = _lazy_get(mrb, self, &_lazy_hash_type);
+  mrb_value key;
+  mrb_get_args(mrb, "o", &key);
+  return mrb_bool_value(mrb_hash_key_p(mrb, _lazy_hash_index(mrb, self, lz), key));
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_hash_keys(mrb_state *mrb, mrb_value self)
+{
+  struct _lazy *lz = _lazy_get(mrb, self, &_lazy_hash_type);
+  return mrb_hash_keys(mrb, _lazy_hash_index(mrb, self, lz));
+}
+
+static void
+_lazy_hash_fill(mrb_state *mrb, mrb_value self, struct _lazy *lz, mrb_value hash)
+{
+  mrb_value keys = mrb_hash_keys(mrb, _lazy_hash_index(mrb, self, lz));
+  mrb_value index = mrb_iv_get(mrb, self, MRB_IVSYM(index));
+  mrb_int i;
+  int ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < RARRAY_LEN(keys); i++)
+  {
+    mrb_value key = RARRAY_PTR(keys)[i];
+    mrb_int n = mrb_integer(mrb_hash_get(mrb, index, key));
+    mrb_hash_set(mrb, hash, key, _lazy_hash_value(mrb, self, lz, n));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_hash_to_h(mrb_state *mrb, mrb_value self)
+{
+  struct _lazy *lz = _lazy_get(mrb, self, &_lazy_hash_type);
+  mrb_value hash = mrb_hash_new_capa(mrb, lz->len);
+  _lazy_hash_fill(mrb, self, lz, hash);
+  return hash;
+}
+
+mrb_value
+mrb_marshal_lazy_plain(mrb_state *mrb, mrb_value obj)
+{
+  const struct mrb_data_type *type;
+  struct _lazy *lz;
+  mrb_value plain;
+
+  if (mrb_type(obj) != MRB_TT_DATA)
+  {
+    return obj;
+  }
+  type = DATA_TYPE(obj);
+  if (type != &_lazy_array_type && type != &_lazy_hash_type)
+  {
+    return obj;
+  }
+  plain = mrb_iv_get(mrb, obj, MRB_IVSYM(plain));
+  if (!mrb_nil_p(plain))
+  {
+    return plain;
+  }
+  lz = _lazy_get(mrb, obj, type);
+  /* cached before it is filled: a proxy may contain itself */
+  if (type == &_lazy_array_type)
+  {
+    plain = mrb_ary_new_capa(mrb, lz->len);
+    mrb_iv_set(mrb, obj, MRB_IVSYM(plain), plain);
+    _lazy_array_fill(mrb, obj, lz, plain);
+  }
+  else
+  {
+    plain = mrb_hash_new_capa(mrb, lz->len);
+    mrb_iv_set(mrb, obj, MRB_IVSYM(plain), plain);
+    _lazy_hash_fill(mrb, obj, lz, plain);
+  }
+  return plain;
+}
+
+static mrb_value
+mrb_mruby_marshal_lazy_hash_each(mrb_state *mrb, mrb_value self)
+{
+  struct _lazy *lz = _lazy_get(mrb, self, &_lazy_hash_type);
+  mrb_value blk, keys, index;
+  mrb_int i;
+  int ai;
+  mrb_get_args(mrb, "&", &blk);
+  if (mrb_nil_p(blk))
+  {
+    return mrb_funcall_id(mrb, mrb_mruby_marshal_lazy_hash_to_h(mrb, self), MRB_SYM(each), 0);
+  }
+  keys = mrb_hash_keys(mrb, _lazy_hash_index(mrb, self, lz));
+  index = mrb_iv_get(mrb, self, MRB_IVSYM(index));
+  ai = mrb_gc_arena_save(mrb);
+  for (i = 0; i < RARRAY_LEN(keys); i++)
+  {
+    mrb_value key = RARRAY_PTR(keys)[i];
+    mrb_int n = mrb_integer(mrb_hash_get(mrb, index, key));
+    mrb_yield(mrb, blk, mrb_assoc_new(mrb, key, _lazy_hash_value(mrb, self, lz, n)));
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  return self;
+}
+
+void
+mrb_marshal_lazy_init(mrb_state *mrb, struct RClass *marshal)
+{
+  struct RClass *array, *hash;
+
+  array = mrb_define_class_under_id(mrb, marshal, MRB_SYM(LazyArray), mrb->object_class);
+  MRB_SET_INSTANCE_TT(array, MRB_TT_DATA);
+  mrb_undef_class_method_id(mrb, array, MRB_SYM(new));
+  mrb_define_method_id(mrb, array, MRB_SYM(size), mrb_mruby_marshal_lazy_array_size, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, array, MRB_SYM(length), mrb_mruby_marshal_lazy_array_size, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, array, MRB_OPSYM(aref), mrb_mruby_marshal_lazy_array_aref, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, array, MRB_SYM(dig), mrb_mruby_marshal_lazy_array_dig, MRB_ARGS_ANY());
+  mrb_define_method_id(mrb, array, MRB_SYM(each), mrb_mruby_marshal_lazy_array_each, MRB_ARGS_BLOCK());
+  mrb_define_method_id(mrb, array, MRB_SYM(to_a), mrb_mruby_marshal_lazy_array_to_a, MRB_ARGS_NONE());
+
+  hash = mrb_define_class_under_id(mrb, marshal, MRB_SYM(LazyHash), mrb->object_class);
+  MRB_SET_INSTANCE_TT(hash, MRB_TT_DATA);
+  mrb_undef_class_method_id(mrb, hash, MRB_SYM(new));
+  mrb_define_method_id(mrb, hash, MRB_SYM(size), mrb_mruby_marshal_lazy_hash_size, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, hash, MRB_SYM(length), mrb_mruby_marshal_lazy_hash_size, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, hash, MRB_OPSYM(aref), mrb_mruby_marshal_lazy_hash_aref, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, hash, MRB_SYM(dig), mrb_mruby_marshal_lazy_hash_dig, MRB_ARGS_ANY());
+  mrb_define_method_id(mrb, hash, MRB_SYM_Q(key), mrb_mruby_marshal_lazy_hash_key_p, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, hash, MRB_SYM_Q(include), mrb_mruby_marshal_lazy_hash_key_p, MRB_ARGS_REQ(1));
+  mrb_define_method_id(mrb, hash, MRB_SYM(keys), mrb_mruby_marshal_lazy_hash_keys, MRB_ARGS_NONE());
+  mrb_define_method_id(mrb, hash, MRB_SYM(each), mrb_mruby_marshal_lazy_hash_each, MRB_ARGS_BLOCK());
+  mrb_define_method_id(mrb, hash, MRB_SYM(to_h), mrb_mruby_marshal_lazy_hash_to_h, MRB_ARGS_NONE());
+
+  if (mrb_const_defined(mrb, mrb_obj_value(mrb->object_class), MRB_SYM(Enumerable)))
+  {
+    struct RClass *enumerable = mrb_module_get_id(mrb, MRB_SYM(Enumerable));
+    mrb_include_module(mrb, array, enumerable);
+    mrb_include_module(mrb, hash, enumerable);
+  }
+}
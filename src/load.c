@@ -4,9 +4,12 @@
 
 #include <mruby/array.h>
 #include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/error.h>
 #include <mruby/hash.h>
 #include <mruby/object.h>
 #include <mruby/proc.h>
+#include <mruby/range.h>
 #include <mruby/re.h>
 #include <mruby/string.h>
 #include <mruby/variable.h>
@@ -15,6 +18,7 @@
 
 #include "common.h"
 #include <stdlib.h>
+#include <string.h>
 
 #include <mruby/khash.h>
 
@@ -26,6 +30,67 @@ KHASH_DEFINE(symbol_load_table, mrb_int, mrb_sym, 1, kh_int_hash_func,
 KHASH_DEFINE(object_load_table, mrb_int, mrb_value, 1, kh_int_hash_func,
              kh_int_hash_equal);
 
+KHASH_DECLARE(class_load_table, mrb_sym, struct RClass *, 1);
+KHASH_DEFINE(class_load_table, mrb_sym, struct RClass *, 1, kh_int_hash_func,
+             kh_int_hash_equal);
+
+KHASH_DECLARE(struct_load_table, mrb_value, mrb_value, 1);
+
+#define kh_class_hash_func(mrb, v) mrb_obj_id(v)
+#define kh_class_equal(mrb, a, b) mrb_obj_eq(mrb, a, b)
+KHASH_DEFINE(struct_load_table, mrb_value, mrb_value, 1, kh_class_hash_func,
+             kh_class_equal);
+
+KHASH_DECLARE(content_load_table, uint64_t, mrb_int, 1);
+KHASH_DEFINE(content_load_table, uint64_t, mrb_int, 1, kh_int64_hash_func,
+             kh_int_hash_equal);
+
+KHASH_DECLARE(lazy_start_table, mrb_int, mrb_int, 1);
+KHASH_DEFINE(lazy_start_table, mrb_int, mrb_int, 1, kh_int_hash_func,
+             kh_int_hash_equal);
+
+/* objects allocated between collections of a QUIET_GC load, by default */
+#define MARSHAL_GC_CAP (1 << 20)
+
+/* objects below this many elements are decoded eagerly by a lazy load */
+#define LAZY_MIN_ELEMENTS 32
+
+/* decompression state of a compressed frame */
+struct load_lz {
+  mrb_uint position; /* read position in the compressed source */
+  uint8_t *buf, *in;
+  uint32_t len, pos;
+  mrb_bool eof;
+};
+
+/* object link k of a lazy load, found by the skip scan */
+struct lazy_link {
+  mrb_uint start, end; /* bytes of the object, including `I` ivars */
+  mrb_int first, last; /* link indices assigned within those bytes */
+  mrb_int elem;        /* first element in load_lazy.elems, or -1 */
+};
+
+/* an element of a lazily loaded container, and the link index it starts at */
+struct lazy_elem {
+  mrb_uint position;
+  mrb_int first;
+};
+
+/* skip scan of a lazy load, see r_lazy_load() */
+struct load_lazy {
+  struct lazy_link *links;
+  struct lazy_elem *elems;
+  mrb_int nlinks, links_capa;
+  mrb_int nelems, elems_capa;
+  kh_lazy_start_table_t *starts; /* start position -> link index */
+};
+
+/* an object shape of a shaped stream, see r_shaped() */
+struct load_shape {
+  struct RClass *klass;
+  mrb_int off, n; /* ivar names in load_arg.shape_syms */
+};
+
 struct load_arg {
   mrb_value src;
   mrb_uint position;
@@ -35,6 +100,40 @@ struct load_arg {
 
   kh_symbol_load_table_t *symbols;
   kh_object_load_table_t *data;
+  mrb_int next;    /* link index of the next registered object */
+  mrb_value roots; /* objects of data by link index for the GC, or nil */
+  mrb_value state; /* the Marshal::LoadARG object holding this */
+
+  kh_class_load_table_t *classes;  /* class path -> class */
+  kh_struct_load_table_t *structs; /* struct class -> member list */
+  kh_content_load_table_t *regexps;  /* see r_regexp() */
+  kh_content_load_table_t *fstrings; /* see r_fstring() */
+  struct mrb_marshal_data_registry *natives;
+  struct mrb_marshal_core core;
+
+  char *scratch; /* see r_view() */
+  mrb_int scratch_capa;
+
+  uint32_t flags;
+  mrb_marshal_stats *stats;
+
+  /* limits of mrb_marshal_load_options, 0 for none */
+  mrb_int max_alloc, max_string, max_collection;
+  mrb_int allocated; /* charged against max_alloc */
+
+  /* MRB_MARSHAL_LOAD_QUIET_GC */
+  mrb_bool gc_disabled; /* GC state of the caller */
+  size_t gc_live;       /* live objects after the last collection */
+  size_t gc_cap;
+
+  struct load_lz *lz;
+  mrb_bool verified; /* a checksummed frame was read */
+  mrb_bool shaped;   /* a shaped frame was read */
+  struct load_shape *shapes;
+  mrb_int nshapes, shapes_capa;
+  mrb_sym *shape_syms;
+  mrb_int nsyms, syms_capa;
+  struct load_lazy *lazy;
 };
 
 static void check_load_arg(mrb_state *mrb, struct load_arg *arg, mrb_sym sym) {
@@ -42,22 +141,121 @@ static void check_load_arg(mrb_state *mrb, struct load_arg *arg, mrb_sym sym) {
     mrb_raisef(mrb, E_RUNTIME_ERROR, "Marshal.load reentered at %s",
                mrb_sym_name(mrb, sym));
   }
+  if (arg->stats)
+    arg->stats->user_calls++;
 }
 
-#define r_entry(mrb, v, arg) r_entry0(mrb, (v), kh_size(arg->data), (arg))
+#define r_entry(mrb, v, arg) r_entry0(mrb, (v), arg->next++, (arg))
 static mrb_value r_object(mrb_state *, struct load_arg *);
 static mrb_sym r_symbol(mrb_state *, struct load_arg *);
 
 static mrb_int r_prepare(mrb_state *mrb, struct load_arg *arg) {
-  mrb_int idx = kh_size(arg->data);
+  mrb_int idx = arg->next++;
   kh_value(object_load_table, arg->data,
            kh_put(object_load_table, mrb, arg->data, idx)) = mrb_undef_value();
   return idx;
 }
 
+/*
+ * Without a reader the source is a String and is read in place; the pointer
+ * is fetched on each call since callbacks may have modified the string.
+ */
+static mrb_int r_source(mrb_state *mrb, struct load_arg *arg, void *dest,
+                        mrb_int size, mrb_uint position) {
+  mrb_int remain;
+
+  if (arg->reader) {
+    if (arg->stats)
+      arg->stats->io_calls++;
+    return arg->reader(mrb, arg->src, dest, size, position);
+  }
+  remain = RSTRING_LEN(arg->src) - (mrb_int)position;
+  if (remain <= 0)
+    return 0;
+  if (remain < size)
+    size = remain;
+  memcpy(dest, RSTRING_PTR(arg->src) + position, size);
+  return size;
+}
+
+static uint32_t r_get32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) |
+         ((uint32_t)p[3] << 24);
+}
+
+static void r_lz_source(mrb_state *mrb, struct load_arg *arg, void *dest,
+                        mrb_int size) {
+  if (r_source(mrb, arg, dest, size, arg->lz->position) != size)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+  arg->lz->position += size;
+}
+
+/* Reads and decompresses the next block; FALSE at the end of the stream. */
+static mrb_bool r_lz_fill(mrb_state *mrb, struct load_arg *arg) {
+  struct load_lz *lz = arg->lz;
+  uint8_t header[8];
+  uint32_t len, stored;
+
+  r_lz_source(mrb, arg, header, sizeof(header));
+  len = r_get32(header);
+  stored = r_get32(header + 4);
+  if (len == 0) {
+    lz->eof = TRUE;
+    return FALSE;
+  }
+  if (len > MARSHAL_LZ_BLOCK_SIZE || stored >= len)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (compressed block)");
+  if (stored == 0) {
+    r_lz_source(mrb, arg, lz->buf, len);
+  } else {
+    r_lz_source(mrb, arg, lz->in, stored);
+    if (mrb_marshal_lz_decompress(lz->in, stored, lz->buf, len) != 0)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (compressed block)");
+  }
+  lz->len = len;
+  lz->pos = 0;
+  return TRUE;
+}
+
+static mrb_int r_lz_read(mrb_state *mrb, struct load_arg *arg, uint8_t *dest,
+                         mrb_int size) {
+  struct load_lz *lz = arg->lz;
+  mrb_int done = 0;
+
+  while (done < size) {
+    mrb_int n;
+
+    if (lz->pos == lz->len) {
+      if (lz->eof || !r_lz_fill(mrb, arg))
+        break;
+    }
+    n = lz->len - lz->pos;
+    if (n > size - done)
+      n = size - done;
+    memcpy(dest + done, lz->buf + lz->pos, n);
+    lz->pos += n;
+    done += n;
+  }
+  return done;
+}
+
+static mrb_int r_read(mrb_state *mrb, struct load_arg *arg, void *dest,
+                      mrb_int size) {
+  if (arg->lz)
+    return r_lz_read(mrb, arg, (uint8_t *)dest, size);
+  return r_source(mrb, arg, dest, size, arg->position);
+}
+
 static int r_byte(mrb_state *mrb, struct load_arg *arg) {
   uint8_t c;
-  mrb_uint len = arg->reader(mrb, arg->src, &c, sizeof(c), arg->position);
+  mrb_uint len;
+
+  if (!arg->reader && !arg->lz) {
+    if ((mrb_int)arg->position >= RSTRING_LEN(arg->src))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+    return (uint8_t)RSTRING_PTR(arg->src)[arg->position++];
+  }
+  len = r_read(mrb, arg, &c, sizeof(c));
   if (!len || (len != sizeof(c)))
     mrb_raise(mrb, E_ARGUMENT_ERROR,
               "marshal data too short"); // TODO: EOF ERROR
@@ -105,15 +303,81 @@ static long r_long(mrb_state *mrb, struct load_arg *arg) {
   return x;
 }
 
+/*
+ * Bytes left in a String source, or -1 when that is not known. For a
+ * compressed String this is a bound: the bytes left in the current block
+ * and the most the rest of the frame can decode to.
+ */
+static mrb_int r_remaining(struct load_arg *arg) {
+  struct load_lz *lz = arg->lz;
+  mrb_int left, src;
+
+  if (arg->reader)
+    return -1;
+  if (!lz)
+    return RSTRING_LEN(arg->src) - (mrb_int)arg->position;
+  left = lz->len - lz->pos;
+  src = RSTRING_LEN(arg->src) - (mrb_int)lz->position;
+  if (lz->eof || src <= 0)
+    return left;
+  if (src > (MRB_INT_MAX - left) / MARSHAL_LZ_MAX_RATIO)
+    return -1;
+  return left + src * MARSHAL_LZ_MAX_RATIO;
+}
+
+static void r_charge(mrb_state *mrb, struct load_arg *arg, mrb_int count,
+                     mrb_int unit) {
+  if (!arg->max_alloc)
+    return;
+  if (count > (arg->max_alloc - arg->allocated) / unit)
+    mrb_raise(mrb, E_ARGUMENT_ERROR,
+              "marshal data too large (allocation budget exceeded)");
+  arg->allocated += count * unit;
+}
+
+/*
+ * Validates a length read from the input before anything is allocated for
+ * it, so that a few bytes of crafted input cannot request gigabytes.
+ */
+static void r_check_bytes(mrb_state *mrb, struct load_arg *arg, long len) {
+  mrb_int remain = r_remaining(arg);
+
+  if (len < 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (negative length)");
+  if (remain >= 0 && len > remain)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+  if (arg->max_string && len > arg->max_string)
+    mrb_raisef(mrb, E_ARGUMENT_ERROR,
+               "marshal data too large (string of %i bytes)", (mrb_int)len);
+  r_charge(mrb, arg, len, 1);
+}
+
+/* As r_check_bytes() for len elements of width values, each one byte min. */
+static void r_check_elems(mrb_state *mrb, struct load_arg *arg, long len,
+                          int width) {
+  mrb_int remain = r_remaining(arg);
+
+  if (len < 0)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (negative length)");
+  if (remain >= 0 && len > remain / width)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+  if (arg->max_collection && len > arg->max_collection)
+    mrb_raisef(mrb, E_ARGUMENT_ERROR,
+               "marshal data too large (collection of %i elements)",
+               (mrb_int)len);
+  r_charge(mrb, arg, len, width * (mrb_int)sizeof(mrb_value));
+}
+
 #define r_bytes(mrb, arg) r_bytes0(mrb, r_long(mrb, arg), (arg))
 
 static mrb_value r_bytes0(mrb_state *mrb, long len, struct load_arg *arg) {
   mrb_value buf;
   mrb_int buf_len;
+  r_check_bytes(mrb, arg, len);
   if (len == 0)
     return mrb_str_new_cstr(mrb, "");
   buf = mrb_str_buf_new(mrb, len);
-  buf_len = arg->reader(mrb, arg->src, RSTRING_PTR(buf), len, arg->position);
+  buf_len = r_read(mrb, arg, RSTRING_PTR(buf), len);
   if (!buf_len || (buf_len != len))
     mrb_raise(mrb, E_ARGUMENT_ERROR,
               "marshal data too short"); // TODO: EOF ERROR
@@ -122,9 +386,6 @@ static mrb_value r_bytes0(mrb_state *mrb, long len, struct load_arg *arg) {
   return buf;
 }
 
-#define ENCODING_ASCII 0
-#define ENCODING_UTF_8 1
-
 static int id2encidx(mrb_state *mrb, mrb_sym id, mrb_value val) {
   // if (id == rb_id_encoding())
   // {
@@ -132,7 +393,7 @@ static int id2encidx(mrb_state *mrb, mrb_sym id, mrb_value val) {
   //   return idx;
   // }
   // else
-  if (id == mrb_intern_lit(mrb, "E")) {
+  if (id == s_encoding_short) {
     if (mrb_false_p(val))
       return ENCODING_ASCII; // return rb_usascii_encindex();
     else if (mrb_true_p(val))
@@ -157,27 +418,64 @@ static mrb_sym r_symlink(mrb_state *mrb, struct load_arg *arg) {
   return ~0;
 }
 
+/*
+ * Returns the next len bytes without a String in between: in place from a
+ * String source or a decompressed block, else read into a scratch buffer
+ * kept by the load state. The bytes are valid until the next read.
+ */
+static const char *r_view(mrb_state *mrb, struct load_arg *arg, long len) {
+  struct load_lz *lz = arg->lz;
+  const char *p;
+
+  r_check_bytes(mrb, arg, len);
+  if (len == 0)
+    return "";
+  if (!arg->reader && !lz) {
+    p = RSTRING_PTR(arg->src) + arg->position;
+  } else if (lz && len <= (long)(lz->len - lz->pos)) {
+    p = (const char *)lz->buf + lz->pos;
+    lz->pos += len;
+  } else {
+    if (len > arg->scratch_capa) {
+      arg->scratch = (char *)mrb_realloc(mrb, arg->scratch, len);
+      arg->scratch_capa = len;
+    }
+    if (r_read(mrb, arg, arg->scratch, len) != len)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+    p = arg->scratch;
+  }
+  arg->position += len;
+  return p;
+}
+
+/* Interns the name of a symbol straight from the input. */
+static mrb_sym r_symname(mrb_state *mrb, struct load_arg *arg) {
+  long len = r_long(mrb, arg);
+  const char *p = r_view(mrb, arg, len);
+
+  return mrb_intern(mrb, p, len);
+}
+
 static mrb_sym r_symreal(mrb_state *mrb, struct load_arg *arg, int ivar) {
-  mrb_value s = r_bytes(mrb, arg);
-  mrb_sym id;
+  mrb_sym id = r_symname(mrb, arg), sym;
   int idx = -1;
-  mrb_int n = kh_size(arg->symbols);
 
-  khint_t x = kh_put(symbol_load_table, mrb, arg->symbols, n);
-  kh_value(symbol_load_table, arg->symbols, x) = 0;
+  /* a lazy load has registered all symbols in its skip scan */
+  if (!arg->lazy) {
+    mrb_int n = kh_size(arg->symbols);
+    khint_t x = kh_put(symbol_load_table, mrb, arg->symbols, n);
+    kh_value(symbol_load_table, arg->symbols, x) = id;
+  }
   if (ivar) {
     long num = r_long(mrb, arg);
     while (num-- > 0) {
-      id = r_symbol(mrb, arg);
-      idx = id2encidx(mrb, id, r_object(mrb, arg));
+      sym = r_symbol(mrb, arg);
+      idx = id2encidx(mrb, sym, r_object(mrb, arg));
     }
   }
   if (idx < 0)
     idx = ENCODING_ASCII;
   // rb_enc_associate_index(s, idx);
-  id = mrb_intern_str(mrb, s);
-  kh_value(symbol_load_table, arg->symbols, x) = id;
-
   return id;
 }
 
@@ -185,7 +483,10 @@ static mrb_sym r_symbol(mrb_state *mrb, struct load_arg *arg) {
   int type, ivar = 0;
 
 again:
-  switch ((type = r_byte(mrb, arg))) {
+  type = r_byte(mrb, arg);
+  if (arg->stats)
+    arg->stats->types[type]++;
+  switch (type) {
   case TYPE_IVAR:
     ivar = 1;
     goto again;
@@ -204,14 +505,24 @@ again:
   }
 }
 
-static mrb_value r_unique(mrb_state *mrb, struct load_arg *arg) {
-  return mrb_sym_str(mrb, r_symbol(mrb, arg));
-}
-
 static mrb_value r_string(mrb_state *mrb, struct load_arg *arg) {
   return r_bytes(mrb, arg);
 }
 
+/*
+ * With the GC deferred, collects once the objects allocated since the last
+ * collection exceed the cap. Everything decoded so far is reachable from
+ * arg->roots.
+ */
+static void r_gc_collect(mrb_state *mrb, struct load_arg *arg) {
+  if (!arg->gc_disabled) {
+    mrb->gc.disabled = FALSE;
+    mrb_full_gc(mrb);
+    mrb->gc.disabled = TRUE;
+  }
+  arg->gc_live = mrb->gc.live;
+}
+
 static mrb_value r_entry0(mrb_state *mrb, mrb_value v, mrb_int num,
                           struct load_arg *arg) {
   // st_data_t real_obj = (VALUE)Qundef;
@@ -223,6 +534,11 @@ static mrb_value r_entry0(mrb_state *mrb, mrb_value v, mrb_int num,
   // {
   khint_t x = kh_put(object_load_table, mrb, arg->data, num);
   kh_value(object_load_table, arg->data, x) = v;
+  if (mrb_array_p(arg->roots) && !mrb_undef_p(v)) {
+    mrb_ary_set(mrb, arg->roots, num, v);
+    if (arg->gc_cap && mrb->gc.live - arg->gc_live > arg->gc_cap)
+      r_gc_collect(mrb, arg);
+  }
   //   st_insert(arg->data, num, (st_data_t)v);
   // }
   // if (arg->infection &&
@@ -244,11 +560,155 @@ static mrb_value r_leave(mrb_state *mrb, mrb_value v, struct load_arg *arg) {
   return v;
 }
 
+/*
+ * Decodes a packed long from memory like r_long() does. Returns the number
+ * of bytes consumed, or 0 if the input is truncated or malformed so that the
+ * caller can fall back to the checked path.
+ */
+static int r_long_mem(const uint8_t *p, const uint8_t *end, long *xp) {
+  int c, i;
+  long x;
+
+  if (p >= end)
+    return 0;
+  c = SIGN_EXTEND_CHAR(*p);
+  if (c == 0) {
+    *xp = 0;
+    return 1;
+  }
+  if (4 < c) {
+    *xp = c - 5;
+    return 1;
+  }
+  if (c < -4) {
+    *xp = c + 5;
+    return 1;
+  }
+  if (c > 0) {
+    if (c > (int)sizeof(long) || end - p <= c)
+      return 0;
+    x = 0;
+    for (i = 0; i < c; i++) {
+      x |= (long)p[i + 1] << (8 * i);
+    }
+  } else {
+    c = -c;
+    if (c > (int)sizeof(long) || end - p <= c)
+      return 0;
+    x = -1;
+    for (i = 0; i < c; i++) {
+      x &= ~((long)0xff << (8 * i));
+      x |= (long)p[i + 1] << (8 * i);
+    }
+  }
+  *xp = x;
+  return c + 1;
+}
+
+static mrb_bool r_ary_direct_p(struct RArray *a, long i) {
+  return ARY_LEN(a) == i && i < ARY_CAPA(a) && !ARY_SHARED_P(a) &&
+         !MRB_FROZEN_P(a);
+}
+
+/*
+ * Decodes a run of nil/true/false/fixnum/symlink elements of a String source
+ * straight into the backing store of a freshly allocated array, setting the
+ * length once at the end. Immediates need neither an object table entry nor
+ * a GC arena slot. Returns the number of elements stored.
+ */
+static long r_ary_immediates(mrb_state *mrb, struct load_arg *arg,
+                             struct RArray *a, long i, long len) {
+  const uint8_t *base, *p, *end;
+  mrb_value *ptr;
+  long n = i;
+
+  if (arg->reader || arg->lz || arg->proc || !r_ary_direct_p(a, i) ||
+      ARY_CAPA(a) < len)
+    return 0;
+
+  base = (const uint8_t *)RSTRING_PTR(arg->src);
+  p = base + arg->position;
+  end = base + RSTRING_LEN(arg->src);
+  ptr = ARY_PTR(a);
+  while (n < len && p < end) {
+    mrb_value val;
+    long x;
+    int size = 0;
+
+    switch (*p) {
+    case TYPE_NIL:
+      val = mrb_nil_value();
+      break;
+    case TYPE_TRUE:
+      val = mrb_true_value();
+      break;
+    case TYPE_FALSE:
+      val = mrb_false_value();
+      break;
+    case TYPE_FIXNUM:
+      if (!(size = r_long_mem(p + 1, end, &x)))
+        goto done;
+      val = mrb_fixnum_value(x);
+      break;
+    case TYPE_SYMLINK: {
+      khint_t k;
+
+      if (!(size = r_long_mem(p + 1, end, &x)))
+        goto done;
+      k = kh_get(symbol_load_table, mrb, arg->symbols, x);
+      if (k == kh_end(arg->symbols) ||
+          !kh_exist(symbol_load_table, arg->symbols, k))
+        goto done;
+      val = mrb_symbol_value(kh_value(symbol_load_table, arg->symbols, k));
+      break;
+    }
+    default:
+      goto done;
+    }
+    if (arg->stats)
+      arg->stats->types[*p]++;
+    ptr[n++] = val;
+    p += size + 1;
+  }
+done:
+  ARY_SET_LEN(a, n);
+  arg->position = p - base;
+  return n - i;
+}
+
+static void r_ary_store(mrb_state *mrb, mrb_value ary, long i, mrb_value val) {
+  struct RArray *a = mrb_ary_ptr(ary);
+
+  if (!r_ary_direct_p(a, i)) {
+    mrb_ary_push(mrb, ary, val);
+    return;
+  }
+  ARY_PTR(a)[i] = val;
+  ARY_SET_LEN(a, i + 1);
+  mrb_field_write_barrier_value(mrb, (struct RBasic *)a, val);
+}
+
+/*
+ * String keys of a dumped hash were frozen copies on the dumping side, so
+ * freeze the loaded key in place; mrb_hash_set() then stores it as is
+ * instead of duplicating it for every entry.
+ */
+static void r_hash_aset(mrb_state *mrb, mrb_value hash, mrb_value key,
+                        mrb_value value) {
+  if (mrb_string_p(key) && !mrb_frozen_p(mrb_str_ptr(key))) {
+    MRB_SET_FROZEN_FLAG(mrb_str_ptr(key));
+  }
+  mrb_hash_set(mrb, hash, key, value);
+}
+
 static void r_ivar(mrb_state *mrb, mrb_value obj, int *has_encoding,
                    struct load_arg *arg) {
   long len;
+  /* plain objects take their ivars without the dispatch of mrb_iv_set() */
+  struct RObject *o = mrb_object_p(obj) ? mrb_obj_ptr(obj) : NULL;
 
   len = r_long(mrb, arg);
+  r_check_elems(mrb, arg, len, 2);
 
   int ai = mrb_gc_arena_save(mrb);
 
@@ -261,6 +721,8 @@ static void r_ivar(mrb_state *mrb, mrb_value obj, int *has_encoding,
         // rb_enc_associate_index(obj, idx);
         if (has_encoding)
           *has_encoding = TRUE;
+      } else if (o) {
+        mrb_obj_iv_set(mrb, o, id, val);
       } else {
         mrb_iv_set(mrb, obj, id, val);
       }
@@ -269,7 +731,7 @@ static void r_ivar(mrb_state *mrb, mrb_value obj, int *has_encoding,
   }
 }
 
-static mrb_value mrb_instance_alloc(mrb_state *mrb, mrb_value cv) {
+mrb_value mrb_marshal_instance_alloc(mrb_state *mrb, mrb_value cv) {
   struct RClass *c = mrb_class_ptr(cv);
   struct RObject *o;
   enum mrb_vtype ttype = MRB_INSTANCE_TT(c);
@@ -303,11 +765,779 @@ static struct RClass *path_find_class(mrb_state *mrb, const char *path) {
   mrb_raisef(mrb, E_TYPE_ERROR, "%s must be a Class", path);
 }
 
-static mrb_value obj_alloc_by_path(mrb_state *mrb, mrb_value path,
-                                   struct load_arg *arg) {
-  struct RClass *klass;
-  klass = path_find_class(mrb, RSTRING_CSTR(mrb, path));
-  return mrb_instance_alloc(mrb, mrb_obj_value(klass));
+/* Keeps v alive as long as the load state, for the caches below. */
+static void r_keep(mrb_state *mrb, struct load_arg *arg, mrb_value v) {
+  mrb_value keep = mrb_iv_get(mrb, arg->state, MRB_IVSYM(keep));
+
+  if (!mrb_array_p(keep)) {
+    keep = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, arg->state, MRB_IVSYM(keep), keep);
+  }
+  mrb_ary_push(mrb, keep, v);
+}
+
+/*
+ * Reads a class path and resolves it. Resolving takes a String and a call
+ * of Object.const_get, so it is done once per path and load.
+ */
+static struct RClass *r_class(mrb_state *mrb, struct load_arg *arg) {
+  mrb_sym path = r_symbol(mrb, arg);
+  struct RClass *c;
+  khint_t k;
+
+  if (!arg->classes)
+    arg->classes = kh_init(class_load_table, mrb);
+  k = kh_get(class_load_table, mrb, arg->classes, path);
+  if (k != kh_end(arg->classes))
+    return kh_value(class_load_table, arg->classes, k);
+  c = path_find_class(mrb, RSTRING_CSTR(mrb, mrb_sym_str(mrb, path)));
+  r_keep(mrb, arg, mrb_obj_value(c));
+  k = kh_put(class_load_table, mrb, arg->classes, path);
+  kh_value(class_load_table, arg->classes, k) = c;
+  return c;
+}
+
+/*
+ * Skip scan for lazy loads. Walks the r_object0() grammar of a String
+ * source without allocating objects, recording for every object link where
+ * its bytes start and end and which link indices they assign, and the
+ * element positions of large arrays and hashes. Symbols are interned and
+ * registered as they are met, so `;` links resolve from any position.
+ */
+static void s_object(mrb_state *, struct load_arg *, mrb_bool);
+
+/* Skips a byte sequence, returning its length; it ends at arg->position. */
+static long s_bytes(mrb_state *mrb, struct load_arg *arg) {
+  long len = r_long(mrb, arg);
+
+  if (len < 0 || len > RSTRING_LEN(arg->src) - (mrb_int)arg->position)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+  arg->position += len;
+  return len;
+}
+
+static mrb_int s_link(mrb_state *mrb, struct load_arg *arg) {
+  struct load_lazy *lazy = arg->lazy;
+
+  if (lazy->nlinks == lazy->links_capa) {
+    lazy->links_capa = lazy->links_capa ? lazy->links_capa * 2 : 64;
+    lazy->links = (struct lazy_link *)mrb_realloc(
+        mrb, lazy->links, sizeof(struct lazy_link) * lazy->links_capa);
+  }
+  lazy->links[lazy->nlinks].elem = -1;
+  return lazy->nlinks++;
+}
+
+static void s_symbol(mrb_state *, struct load_arg *);
+
+static void s_symreal(mrb_state *mrb, struct load_arg *arg, int ivar) {
+  long len = s_bytes(mrb, arg), num;
+  khint_t x;
+
+  x = kh_put(symbol_load_table, mrb, arg->symbols, kh_size(arg->symbols));
+  kh_value(symbol_load_table, arg->symbols, x) = mrb_intern(
+      mrb, RSTRING_PTR(arg->src) + arg->position - len, len);
+  if (ivar) {
+    num = r_long(mrb, arg);
+    while (num-- > 0) {
+      s_symbol(mrb, arg);
+      s_object(mrb, arg, FALSE);
+    }
+  }
+}
+
+static void s_symbol(mrb_state *mrb, struct load_arg *arg) {
+  int type, ivar = 0;
+
+again:
+  type = r_byte(mrb, arg);
+  switch (type) {
+  case TYPE_IVAR:
+    ivar = 1;
+    goto again;
+  case TYPE_SYMBOL:
+    s_symreal(mrb, arg, ivar);
+    break;
+  case TYPE_SYMLINK:
+    if (ivar) {
+      mrb_raise(mrb, E_ARGUMENT_ERROR,
+                "dump format error (symlink with encoding)");
+    }
+    r_long(mrb, arg);
+    break;
+  default:
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "dump format error for symbol(0x%d)",
+               type);
+    break;
+  }
+}
+
+static void s_ivar(mrb_state *mrb, struct load_arg *arg) {
+  long len = r_long(mrb, arg);
+
+  while (len-- > 0) {
+    s_symbol(mrb, arg);
+    s_object(mrb, arg, TRUE);
+  }
+}
+
+/* width is 1 for arrays and 2 for hashes */
+static void s_elems(mrb_state *mrb, struct load_arg *arg, mrb_int idx,
+                    long len, int width, mrb_bool proxy) {
+  struct load_lazy *lazy = arg->lazy;
+  mrb_int i, n = (mrb_int)len * width, base = -1;
+
+  /* every element takes at least a byte */
+  if (n > RSTRING_LEN(arg->src) - (mrb_int)arg->position)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+  if (proxy && len >= LAZY_MIN_ELEMENTS) {
+    if (lazy->nelems + n + 1 > lazy->elems_capa) {
+      while (lazy->nelems + n + 1 > lazy->elems_capa)
+        lazy->elems_capa = lazy->elems_capa ? lazy->elems_capa * 2 : 256;
+      lazy->elems = (struct lazy_elem *)mrb_realloc(
+          mrb, lazy->elems, sizeof(struct lazy_elem) * lazy->elems_capa);
+    }
+    base = lazy->nelems;
+    lazy->nelems += n + 1;
+    lazy->links[idx].elem = base;
+  }
+  for (i = 0; i <= n; i++) {
+    if (base >= 0) {
+      lazy->elems[base + i].position = arg->position;
+      lazy->elems[base + i].first = lazy->nlinks;
+    }
+    if (i < n)
+      s_object(mrb, arg, TRUE);
+  }
+}
+
+/*
+ * Registers link indices in the order r_object0() does: containers,
+ * structs and objects before their contents, regexps after their source,
+ * user-defined objects after their data.
+ */
+static void s_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
+                      mrb_int *reg, mrb_bool proxy) {
+  int type = r_byte(mrb, arg);
+  long len;
+
+  switch (type) {
+  case TYPE_LINK:
+  case TYPE_FIXNUM:
+  case TYPE_SYMLINK:
+    r_long(mrb, arg);
+    break;
+
+  case TYPE_IVAR: {
+    int ivar = TRUE;
+
+    s_object0(mrb, arg, &ivar, reg, proxy);
+    if (ivar)
+      s_ivar(mrb, arg);
+  } break;
+
+  case TYPE_UCLASS:
+    /* the proxies are no instances of user classes */
+    s_symbol(mrb, arg);
+    s_object0(mrb, arg, 0, reg, FALSE);
+    break;
+
+  case TYPE_NIL:
+  case TYPE_TRUE:
+  case TYPE_FALSE:
+    break;
+
+  case TYPE_FLOAT:
+  case TYPE_STRING:
+  case TYPE_MODULE_OLD:
+  case TYPE_CLASS:
+  case TYPE_MODULE:
+    s_bytes(mrb, arg);
+    *reg = s_link(mrb, arg);
+    break;
+
+  case TYPE_REGEXP:
+    s_bytes(mrb, arg);
+    r_byte(mrb, arg);
+    *reg = s_link(mrb, arg);
+    if (ivp) {
+      s_ivar(mrb, arg);
+      *ivp = FALSE;
+    }
+    break;
+
+  case TYPE_ARRAY:
+    len = r_long(mrb, arg);
+    *reg = s_link(mrb, arg);
+    s_elems(mrb, arg, *reg, len, 1, proxy);
+    break;
+
+  case TYPE_HASH:
+  case TYPE_HASH_DEF:
+    len = r_long(mrb, arg);
+    *reg = s_link(mrb, arg);
+    s_elems(mrb, arg, *reg, len, 2, proxy && type == TYPE_HASH);
+    /* the default, as in the @hash of a Set; r_object0() rejects others */
+    if (type == TYPE_HASH_DEF)
+      s_object(mrb, arg, FALSE);
+    break;
+
+  case TYPE_STRUCT:
+    *reg = s_link(mrb, arg);
+    s_symbol(mrb, arg);
+    len = r_long(mrb, arg);
+    while (len-- > 0) {
+      s_symbol(mrb, arg);
+      s_object(mrb, arg, TRUE);
+    }
+    break;
+
+  case TYPE_USERDEF:
+    s_symbol(mrb, arg);
+    s_bytes(mrb, arg);
+    if (ivp) {
+      s_ivar(mrb, arg);
+      *ivp = FALSE;
+    }
+    *reg = s_link(mrb, arg);
+    break;
+
+  case TYPE_USRMARSHAL:
+    s_symbol(mrb, arg);
+    *reg = s_link(mrb, arg);
+    s_object(mrb, arg, TRUE);
+    break;
+
+  case TYPE_OBJECT:
+    *reg = s_link(mrb, arg);
+    s_symbol(mrb, arg);
+    s_ivar(mrb, arg);
+    break;
+
+  case TYPE_DATA:
+    s_symbol(mrb, arg);
+    *reg = s_link(mrb, arg);
+    s_object(mrb, arg, FALSE);
+    break;
+
+  case TYPE_SYMBOL:
+    s_symreal(mrb, arg, ivp && *ivp);
+    if (ivp)
+      *ivp = FALSE;
+    break;
+
+  default:
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "dump format error(0x%d)", type);
+    break;
+  }
+}
+
+static void s_object(mrb_state *mrb, struct load_arg *arg, mrb_bool proxy) {
+  struct load_lazy *lazy = arg->lazy;
+  mrb_uint start = arg->position;
+  mrb_int first = lazy->nlinks, reg = -1;
+
+  s_object0(mrb, arg, NULL, &reg, proxy);
+  if (reg >= 0) {
+    struct lazy_link *l = &lazy->links[reg];
+    khint_t x;
+
+    l->start = start;
+    l->end = arg->position;
+    l->first = first;
+    l->last = lazy->nlinks;
+    x = kh_put(lazy_start_table, mrb, lazy->starts, (mrb_int)start);
+    kh_value(lazy_start_table, lazy->starts, x) = reg;
+  }
+}
+
+/*
+ * Returns the already decoded object starting at the read position, skipping
+ * its bytes, so that decoding a region twice yields the same objects.
+ */
+static mrb_bool r_lazy_reuse(mrb_state *mrb, struct load_arg *arg,
+                             mrb_value *vp) {
+  struct load_lazy *lazy = arg->lazy;
+  khint_t k = kh_get(lazy_start_table, mrb, lazy->starts,
+                     (mrb_int)arg->position);
+  struct lazy_link *l;
+  khint_t i;
+
+  if (k == kh_end(lazy->starts))
+    return FALSE;
+  l = &lazy->links[kh_value(lazy_start_table, lazy->starts, k)];
+  i = kh_get(object_load_table, mrb, arg->data,
+             kh_value(lazy_start_table, lazy->starts, k));
+  if (i == kh_end(arg->data) ||
+      mrb_undef_p(kh_value(object_load_table, arg->data, i)))
+    return FALSE;
+  *vp = kh_value(object_load_table, arg->data, i);
+  arg->position = l->end;
+  arg->next = l->last;
+  return TRUE;
+}
+
+static mrb_value r_lazy_link_body(mrb_state *mrb, void *ud) {
+  return r_object(mrb, (struct load_arg *)ud);
+}
+
+/*
+ * Decodes the object of link id if a link to it is met before the object.
+ * On a raise the links entered on the way are dropped again, so a later
+ * access decodes them afresh instead of finding half-built objects.
+ */
+static void r_lazy_link(mrb_state *mrb, struct load_arg *arg, long id) {
+  struct load_lazy *lazy = arg->lazy;
+  khint_t i = kh_get(object_load_table, mrb, arg->data, id);
+  mrb_uint position = arg->position;
+  mrb_int next = arg->next;
+  mrb_value exc;
+  mrb_bool error;
+
+  if (i != kh_end(arg->data)) {
+    /* a link into an object still being decoded */
+    if (mrb_undef_p(kh_value(object_load_table, arg->data, i)))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (unlinked)");
+    return;
+  }
+  if (id < 0 || id >= lazy->nlinks)
+    return;
+  kh_value(object_load_table, arg->data,
+           kh_put(object_load_table, mrb, arg->data, id)) = mrb_undef_value();
+  arg->position = lazy->links[id].start;
+  arg->next = lazy->links[id].first;
+  exc = mrb_protect_error(mrb, r_lazy_link_body, arg, &error);
+  if (error) {
+    mrb_int k, end = arg->next > id ? arg->next : id + 1;
+    for (k = id; k < end; k++) {
+      i = kh_get(object_load_table, mrb, arg->data, k);
+      if (i != kh_end(arg->data))
+        kh_del(object_load_table, mrb, arg->data, i);
+    }
+  }
+  arg->position = position;
+  arg->next = next;
+  if (error)
+    mrb_exc_raise(mrb, exc);
+}
+
+/*
+ * Stands a proxy in for an array or hash the skip scan found large enough,
+ * and skips its elements.
+ */
+static mrb_bool r_lazy_container(mrb_state *mrb, struct load_arg *arg,
+                                 long len, mrb_bool hash, mrb_value *vp) {
+  struct load_lazy *lazy = arg->lazy;
+  mrb_int idx = arg->next, base;
+  struct lazy_elem *end;
+  mrb_value v;
+
+  if (idx >= lazy->nlinks || lazy->links[idx].elem < 0)
+    return FALSE;
+  base = lazy->links[idx].elem;
+  end = &lazy->elems[base + (hash ? len * 2 : len)];
+  v = mrb_marshal_lazy_new(mrb, arg->state, arg, base, len, hash);
+  *vp = r_entry(mrb, v, arg);
+  arg->position = end->position;
+  arg->next = end->first;
+  return TRUE;
+}
+
+mrb_value mrb_marshal_lazy_decode(mrb_state *mrb, struct load_arg *arg,
+                                  mrb_int elem) {
+  struct lazy_elem *e = &arg->lazy->elems[elem];
+  mrb_uint position = arg->position;
+  mrb_int next = arg->next;
+  mrb_value v;
+
+  arg->position = e->position;
+  arg->next = e->first;
+  v = r_object(mrb, arg);
+  arg->position = position;
+  arg->next = next;
+  return v;
+}
+
+/*
+ * The member list of a struct class, fetched once per class and load
+ * instead of once per record.
+ */
+static mrb_value r_struct_members(mrb_state *mrb, struct load_arg *arg,
+                                  struct RClass *klass) {
+  mrb_value c = mrb_obj_value(klass), mem;
+  khint_t k;
+
+  if (!arg->structs)
+    arg->structs = kh_init(struct_load_table, mrb);
+  k = kh_get(struct_load_table, mrb, arg->structs, c);
+  if (k != kh_end(arg->structs))
+    return kh_value(struct_load_table, arg->structs, k);
+
+  mem = mrb_funcall_id(mrb, c, MRB_SYM(members),
+                       0); // rb_struct_s_members(klass);
+  if (!mrb_array_p(mem))
+    mrb_raisef(mrb, E_TYPE_ERROR, "class %s not a struct",
+               mrb_class_name(mrb, klass));
+  r_keep(mrb, arg, mem);
+  k = kh_put(struct_load_table, mrb, arg->structs, c);
+  kh_value(struct_load_table, arg->structs, k) = mem;
+  return mem;
+}
+
+/*
+ * Restores a data object registered with mrb_marshal_register_data() from
+ * its String payload. The payload takes a link index like the String a
+ * _load_data would be given, without becoming an object.
+ */
+static mrb_value r_data_native(mrb_state *mrb, struct load_arg *arg,
+                               struct RClass *klass,
+                               const struct mrb_marshal_data_entry *e) {
+  mrb_value v = mrb_marshal_instance_alloc(mrb, mrb_obj_value(klass));
+  const char *p;
+  long len;
+  void *ptr;
+  int type;
+
+  if (!mrb_data_p(v)) {
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error");
+  }
+  v = r_entry(mrb, v, arg);
+  type = r_byte(mrb, arg);
+  if (type != TYPE_STRING) {
+    mrb_raisef(mrb, E_ARGUMENT_ERROR,
+               "dump format error (data payload of class %C)", klass);
+  }
+  if (arg->stats) {
+    arg->stats->types[type]++;
+    arg->stats->user_calls++;
+  }
+  arg->next++;
+  len = r_long(mrb, arg);
+  p = r_view(mrb, arg, len);
+  ptr = e->load(mrb, p, len);
+  /* the type is set last so that a failed load leaves nothing to free */
+  DATA_PTR(v) = ptr;
+  DATA_TYPE(v) = e->type;
+  return v;
+}
+
+/*
+ * Readers for the forms w_core() in dump.c writes, which are also the ones
+ * of CRuby. Where an object is registered before its contents, idx is its
+ * link index from r_prepare(); the array or hash standing for its contents
+ * takes a link index without becoming an object.
+ */
+static mrb_value r_range(mrb_state *mrb, struct load_arg *arg,
+                         struct RClass *klass, mrb_int idx) {
+  mrb_value beg = mrb_nil_value(), end = mrb_nil_value(), v;
+  mrb_bool excl = FALSE;
+  long len = r_long(mrb, arg);
+
+  r_check_elems(mrb, arg, len, 2);
+  while (len-- > 0) {
+    mrb_sym id = r_symbol(mrb, arg);
+    mrb_value val = r_object(mrb, arg);
+
+    if (id == MRB_SYM(excl))
+      excl = mrb_test(val);
+    else if (id == MRB_SYM(begin))
+      beg = val;
+    else if (id == MRB_SYM(end))
+      end = val;
+  }
+  v = mrb_range_new(mrb, beg, end, excl);
+  mrb_basic_ptr(v)->c = klass;
+  return r_entry0(mrb, v, idx, arg);
+}
+
+static mrb_value r_set(mrb_state *mrb, struct load_arg *arg,
+                       struct RClass *klass, mrb_int idx) {
+  mrb_value v = r_entry0(mrb, mrb_obj_new(mrb, klass, 0, NULL), idx, arg);
+  mrb_value elems = mrb_ary_new(mrb);
+  long len = r_long(mrb, arg);
+  int ai = mrb_gc_arena_save(mrb);
+
+  r_check_elems(mrb, arg, len, 2);
+  while (len-- > 0) {
+    int type;
+    long n;
+
+    if (r_symbol(mrb, arg) != MRB_IVSYM(hash)) {
+      r_object(mrb, arg);
+      mrb_gc_arena_restore(mrb, ai);
+      continue;
+    }
+    type = r_byte(mrb, arg);
+    if (type != TYPE_HASH && type != TYPE_HASH_DEF)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (Set)");
+    if (arg->stats)
+      arg->stats->types[type]++;
+    arg->next++;
+    n = r_long(mrb, arg);
+    r_check_elems(mrb, arg, n, 2);
+    while (n-- > 0) {
+      mrb_ary_push(mrb, elems, r_object(mrb, arg));
+      r_object(mrb, arg);
+      mrb_gc_arena_restore(mrb, ai);
+    }
+    if (type == TYPE_HASH_DEF)
+      r_object(mrb, arg);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  mrb_funcall_id(mrb, v, MRB_SYM(merge), 1, elems);
+  return v;
+}
+
+/*
+ * An object of a shaped stream: a new shape, the class and ivar names,
+ * is read into shapes and shape_syms, after which each object of it is
+ * filled from its values alone.
+ */
+static mrb_value r_shaped(mrb_state *mrb, struct load_arg *arg, int type) {
+  mrb_value v;
+  mrb_int i, k, n, off;
+
+  if (!arg->shaped)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (shape)");
+  if (type == TYPE_SHAPE_DEF) {
+    struct RClass *klass = r_class(mrb, arg);
+    long len = r_long(mrb, arg);
+
+    r_check_elems(mrb, arg, len, 1);
+    if (arg->nsyms + len > arg->syms_capa) {
+      mrb_int capa = arg->syms_capa ? arg->syms_capa * 2 : 64;
+
+      if (capa < arg->nsyms + len)
+        capa = arg->nsyms + len;
+      arg->shape_syms = (mrb_sym *)mrb_realloc(mrb, arg->shape_syms,
+                                               sizeof(mrb_sym) * capa);
+      arg->syms_capa = capa;
+    }
+    /* the names are reserved first: the `I` of a symbol reads an object,
+       which may define shapes of its own */
+    off = arg->nsyms;
+    arg->nsyms += len;
+    for (i = 0; i < len; i++) {
+      mrb_sym id = r_symbol(mrb, arg);
+
+      arg->shape_syms[off + i] = id;
+    }
+    if (arg->nshapes == arg->shapes_capa) {
+      arg->shapes_capa = arg->shapes_capa ? arg->shapes_capa * 2 : 16;
+      arg->shapes = (struct load_shape *)mrb_realloc(
+          mrb, arg->shapes, sizeof(struct load_shape) * arg->shapes_capa);
+    }
+    k = arg->nshapes++;
+    arg->shapes[k].klass = klass;
+    arg->shapes[k].off = off;
+    arg->shapes[k].n = len;
+  } else {
+    k = r_long(mrb, arg);
+    if (k < 0 || k >= arg->nshapes)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (unknown shape)");
+  }
+  n = arg->shapes[k].n;
+  r_check_elems(mrb, arg, n, 1);
+  v = mrb_marshal_instance_alloc(mrb, mrb_obj_value(arg->shapes[k].klass));
+  if (mrb_type(v) != MRB_TT_OBJECT)
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error");
+  v = r_entry(mrb, v, arg);
+  /* by index, as nested objects may grow shape_syms */
+  for (i = 0; i < n; i++) {
+    int ai = mrb_gc_arena_save(mrb);
+    mrb_value val = r_object(mrb, arg);
+
+    mrb_obj_iv_set(mrb, mrb_obj_ptr(v),
+                   arg->shape_syms[arg->shapes[k].off + i], val);
+    mrb_gc_arena_restore(mrb, ai);
+  }
+  return v;
+}
+
+/* key of the content tables of r_regexp() and r_fstring() */
+static uint64_t r_content_key(const char *p, long len) {
+  struct mrb_marshal_hash h;
+
+  mrb_marshal_hash_init(&h, 0);
+  mrb_marshal_hash_update(&h, p, len);
+  return mrb_marshal_hash_final(&h);
+}
+
+/*
+ * MRB_MARSHAL_LOAD_FREEZE: a String is frozen and looked up by a hash of
+ * its bytes among those loaded before, which are kept in the @fstrings
+ * array of the load state. A String with ivars of its own gets a copy of
+ * its own.
+ */
+static mrb_value r_fstring(mrb_state *mrb, struct load_arg *arg, int *ivp) {
+  long len = r_long(mrb, arg);
+  const char *p = r_view(mrb, arg, len);
+  mrb_value pool = mrb_iv_get(mrb, arg->state, MRB_IVSYM(fstrings));
+  mrb_value v = mrb_nil_value();
+  uint64_t key = r_content_key(p, len);
+  mrb_int idx;
+  khint_t k;
+
+  if (!arg->fstrings) {
+    arg->fstrings = kh_init(content_load_table, mrb);
+    pool = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, arg->state, MRB_IVSYM(fstrings), pool);
+  }
+  k = kh_get(content_load_table, mrb, arg->fstrings, key);
+  if (k != kh_end(arg->fstrings)) {
+    mrb_value s =
+        mrb_ary_ref(mrb, pool, kh_value(content_load_table, arg->fstrings, k));
+
+    if (RSTRING_LEN(s) == len && memcmp(RSTRING_PTR(s), p, len) == 0)
+      v = s;
+  }
+  if (mrb_nil_p(v)) {
+    v = mrb_str_new(mrb, p, len);
+    MRB_SET_FROZEN_FLAG(mrb_str_ptr(v));
+    if (k == kh_end(arg->fstrings)) {
+      k = kh_put(content_load_table, mrb, arg->fstrings, key);
+      kh_value(content_load_table, arg->fstrings, k) = RARRAY_LEN(pool);
+      mrb_ary_push(mrb, pool, v);
+    }
+  }
+  idx = arg->next;
+  v = r_entry(mrb, v, arg);
+  if (ivp) {
+    long n = r_long(mrb, arg);
+    mrb_bool own = FALSE;
+
+    r_check_elems(mrb, arg, n, 2);
+    while (n-- > 0) {
+      mrb_sym id = r_symbol(mrb, arg);
+      mrb_value val = r_object(mrb, arg);
+
+      if (id2encidx(mrb, id, val) >= 0)
+        continue;
+      if (!own) {
+        v = r_entry0(mrb, mrb_str_dup(mrb, v), idx, arg);
+        own = TRUE;
+      }
+      mrb_iv_set(mrb, v, id, val);
+    }
+    if (own)
+      MRB_SET_FROZEN_FLAG(mrb_str_ptr(v));
+    *ivp = FALSE;
+  }
+  return v;
+}
+
+/*
+ * A Regexp is compiled once per source and options and load: later copies
+ * are the same object under their own link indices. The cache maps a hash
+ * of the source to an entry of the @regexps array of the load state, which
+ * holds the source, the options and the Regexp of each. A Regexp with ivars
+ * of its own, or passed to a proc, is not shared.
+ */
+static mrb_value r_regexp(mrb_state *mrb, struct load_arg *arg, int *ivp) {
+  long len = r_long(mrb, arg);
+  const char *p = r_view(mrb, arg, len);
+  mrb_value cache = mrb_iv_get(mrb, arg->state, MRB_IVSYM(regexps));
+  mrb_value src, ivars = mrb_nil_value(), v;
+  mrb_bool found = FALSE;
+  mrb_int idx, options, i = -1;
+  uint64_t key = r_content_key(p, len);
+  khint_t k;
+
+  if (!arg->regexps) {
+    arg->regexps = kh_init(content_load_table, mrb);
+    cache = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, arg->state, MRB_IVSYM(regexps), cache);
+  }
+  /* the bytes are compared before the next read ends the view */
+  k = kh_get(content_load_table, mrb, arg->regexps, key);
+  if (k != kh_end(arg->regexps)) {
+    i = kh_value(content_load_table, arg->regexps, k);
+    src = mrb_ary_ref(mrb, cache, i * 3);
+    found = RSTRING_LEN(src) == len && memcmp(RSTRING_PTR(src), p, len) == 0;
+  }
+  if (!found)
+    src = mrb_str_new(mrb, p, len);
+  options = r_byte(mrb, arg);
+  idx = r_prepare(mrb, arg);
+  if (ivp) {
+    long n = r_long(mrb, arg);
+
+    r_check_elems(mrb, arg, n, 2);
+    while (n-- > 0) {
+      mrb_sym id = r_symbol(mrb, arg);
+      mrb_value val = r_object(mrb, arg);
+
+      if (id2encidx(mrb, id, val) >= 0)
+        continue;
+      if (mrb_nil_p(ivars))
+        ivars = mrb_ary_new(mrb);
+      mrb_ary_push(mrb, ivars, mrb_symbol_value(id));
+      mrb_ary_push(mrb, ivars, val);
+    }
+    *ivp = FALSE;
+  }
+  if (!arg->core.regexp)
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "undefined class/module %s",
+               REGEXP_CLASS);
+
+  if (found && mrb_nil_p(ivars) && !arg->proc &&
+      mrb_integer(mrb_ary_ref(mrb, cache, i * 3 + 1)) == options)
+    return r_entry0(mrb, mrb_ary_ref(mrb, cache, i * 3 + 2), idx, arg);
+  v = mrb_funcall_id(mrb, mrb_obj_value(arg->core.regexp), MRB_SYM(compile),
+                     2, found ? mrb_str_dup(mrb, src) : src,
+                     mrb_fixnum_value(options));
+  if (!mrb_nil_p(ivars)) {
+    mrb_int j;
+
+    for (j = 0; j < RARRAY_LEN(ivars); j += 2)
+      mrb_iv_set(mrb, v, mrb_symbol(RARRAY_PTR(ivars)[j]),
+                 RARRAY_PTR(ivars)[j + 1]);
+  } else if (!arg->proc && i < 0) {
+    /* the first options seen for a source are the ones cached */
+    k = kh_put(content_load_table, mrb, arg->regexps, key);
+    kh_value(content_load_table, arg->regexps, k) = RARRAY_LEN(cache) / 3;
+    mrb_ary_push(mrb, cache, src);
+    mrb_ary_push(mrb, cache, mrb_fixnum_value(options));
+    mrb_ary_push(mrb, cache, v);
+  }
+  return r_entry0(mrb, v, idx, arg);
+}
+
+static mrb_value r_time(mrb_state *mrb, struct load_arg *arg, int *ivp) {
+  long len = r_long(mrb, arg);
+  uint8_t buf[8];
+
+  if (len != sizeof(buf))
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error (Time)");
+  memcpy(buf, r_view(mrb, arg, len), sizeof(buf));
+  /* offset, zone and sub-microsecond ivars; mruby has no use for them */
+  if (ivp) {
+    long n = r_long(mrb, arg);
+
+    r_check_elems(mrb, arg, n, 2);
+    while (n-- > 0) {
+      r_symbol(mrb, arg);
+      r_object(mrb, arg);
+    }
+    *ivp = FALSE;
+  }
+  return mrb_marshal_time_load(mrb, &arg->core, buf);
+}
+
+static mrb_value r_core_pair(mrb_state *mrb, struct load_arg *arg,
+                             struct RClass *klass, mrb_int idx) {
+  mrb_value a, b;
+  int type = r_byte(mrb, arg);
+
+  if (type != TYPE_ARRAY || r_long(mrb, arg) != 2)
+    mrb_raisef(mrb, E_ARGUMENT_ERROR, "dump format error (%C)", klass);
+  if (arg->stats)
+    arg->stats->types[type]++;
+  arg->next++;
+  a = r_object(mrb, arg);
+  b = r_object(mrb, arg);
+  return r_entry0(mrb, mrb_marshal_core_new(mrb, &arg->core, klass, a, b), idx,
+                  arg);
 }
 
 #define load_mantissa(d, buf, len) (d)
@@ -315,12 +1545,20 @@ static mrb_value obj_alloc_by_path(mrb_state *mrb, mrb_value path,
 static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
                            mrb_value extmod) {
   mrb_value v = mrb_nil_value();
-  int type = r_byte(mrb, arg);
+  int type;
   long id;
 
+  if (arg->lazy && r_lazy_reuse(mrb, arg, &v))
+    return v;
+  type = r_byte(mrb, arg);
+  if (arg->stats)
+    arg->stats->types[type]++;
+
   switch (type) {
   case TYPE_LINK:
     id = r_long(mrb, arg);
+    if (arg->lazy)
+      r_lazy_link(mrb, arg, id);
 
     {
       khint_t i = kh_get(object_load_table, mrb, arg->data, id);
@@ -364,8 +1602,7 @@ static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
     // break;
 
   case TYPE_UCLASS: {
-    struct RClass *c =
-        path_find_class(mrb, RSTRING_CSTR(mrb, r_unique(mrb, arg)));
+    struct RClass *c = r_class(mrb, arg);
 
     // if (FL_TEST(c, FL_SINGLETON))
     // {
@@ -382,7 +1619,7 @@ static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
       ; // TYPE(v) == T_MODULE || !RTEST(rb_class_inherited_p(c,
         // RBASIC(v)->klass)))
     {
-      mrb_value tmp = mrb_instance_alloc(mrb, mrb_obj_value(c));
+      mrb_value tmp = mrb_marshal_instance_alloc(mrb, mrb_obj_value(c));
 
       if (mrb_type(v) != mrb_type(tmp))
         goto format_error;
@@ -482,88 +1719,35 @@ static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
     //   break;
 
   case TYPE_STRING:
-    v = r_entry(mrb, r_string(mrb, arg), arg);
+    if (arg->flags & MRB_MARSHAL_LOAD_FREEZE)
+      v = r_fstring(mrb, arg, ivp);
+    else
+      v = r_entry(mrb, r_string(mrb, arg), arg);
     v = r_leave(mrb, v, arg);
     break;
 
-  case TYPE_REGEXP: {
-    mrb_value str = r_bytes(mrb, arg);
-    int options = r_byte(mrb, arg);
-    int has_encoding = FALSE;
-    mrb_int idx = r_prepare(mrb, arg);
-
-    if (ivp) {
-      r_ivar(mrb, str, &has_encoding, arg);
-      *ivp = FALSE;
-    }
-    // if (!has_encoding)
-    // {
-    //   /* 1.8 compatibility; remove escapes undefined in 1.8 */
-    //   char *ptr = RSTRING_PTR(str), *dst = ptr, *src = ptr;
-    //   long len = RSTRING_LEN(str);
-    //   long bs = 0;
-    //   for (; len-- > 0; *dst++ = *src++)
-    //   {
-    //     switch (*src)
-    //     {
-    //     case '\\':
-    //       bs++;
-    //       break;
-    //     case 'g':
-    //     case 'h':
-    //     case 'i':
-    //     case 'j':
-    //     case 'k':
-    //     case 'l':
-    //     case 'm':
-    //     case 'o':
-    //     case 'p':
-    //     case 'q':
-    //     case 'u':
-    //     case 'y':
-    //     case 'E':
-    //     case 'F':
-    //     case 'H':
-    //     case 'I':
-    //     case 'J':
-    //     case 'K':
-    //     case 'L':
-    //     case 'N':
-    //     case 'O':
-    //     case 'P':
-    //     case 'Q':
-    //     case 'R':
-    //     case 'S':
-    //     case 'T':
-    //     case 'U':
-    //     case 'V':
-    //     case 'X':
-    //     case 'Y':
-    //       if (bs & 1)
-    //         --dst;
-    //     default:
-    //       bs = 0;
-    //       break;
-    //     }
-    //   }
-    //   rb_str_set_len(str, dst - ptr);
-    // }
-    v = r_entry0(
-        mrb,
-        mrb_funcall_id(mrb, mrb_obj_value(path_find_class(mrb, REGEXP_CLASS)),
-                       MRB_SYM(compile), 2, str, mrb_fixnum_value(options)),
-        idx, arg);
-    v = r_leave(mrb, v, arg);
-  } break;
+  case TYPE_REGEXP:
+    v = r_leave(mrb, r_regexp(mrb, arg, ivp), arg);
+    break;
 
   case TYPE_ARRAY: {
     long len = r_long(mrb, arg); /* gcc 2.7.2.3 -O2 bug?? */
+    r_check_elems(mrb, arg, len, 1);
+
+    long i = 0;
 
+    if (arg->lazy && r_lazy_container(mrb, arg, len, FALSE, &v)) {
+      v = r_leave(mrb, v, arg);
+      break;
+    }
     v = mrb_ary_new_capa(mrb, len);
     v = r_entry(mrb, v, arg);
     int ai = mrb_gc_arena_save(mrb);
-    while (len--) {
-      mrb_ary_push(mrb, v, r_object(mrb, arg));
+    while (i < len) {
+      i += r_ary_immediates(mrb, arg, mrb_ary_ptr(v), i, len);
+      if (i >= len)
+        break;
+      r_ary_store(mrb, v, i++, r_object(mrb, arg));
       mrb_gc_arena_restore(mrb, ai);
     }
     v = r_leave(mrb, v, arg);
@@ -573,13 +1757,19 @@ static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
   case TYPE_HASH_DEF: {
     long len = r_long(mrb, arg);
 
-    v = mrb_hash_new(mrb);
+    r_check_elems(mrb, arg, len, 2);
+    if (arg->lazy && type == TYPE_HASH &&
+        r_lazy_container(mrb, arg, len, TRUE, &v)) {
+      v = r_leave(mrb, v, arg);
+      break;
+    }
+    v = mrb_hash_new_capa(mrb, len);
     v = r_entry(mrb, v, arg);
     int ai = mrb_gc_arena_save(mrb);
     while (len--) {
       mrb_value key = r_object(mrb, arg);
       mrb_value value = r_object(mrb, arg);
-      mrb_hash_set(mrb, v, key, value);
+      r_hash_aset(mrb, v, key, value);
       mrb_gc_arena_restore(mrb, ai);
     }
     if (type == TYPE_HASH_DEF) {
@@ -590,21 +1780,20 @@ static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
   } break;
 
   case TYPE_STRUCT: {
-    mrb_value mem, values;
+    mrb_value mem;
     long i; /* gcc 2.7.2.3 -O2 bug?? */
     mrb_sym slot;
     mrb_int idx = r_prepare(mrb, arg);
-    struct RClass *klass =
-        path_find_class(mrb, RSTRING_CSTR(mrb, r_unique(mrb, arg)));
+    struct RClass *klass = r_class(mrb, arg);
     long len = r_long(mrb, arg);
 
-    v = mrb_instance_alloc(mrb, mrb_obj_value(klass));
+    r_check_elems(mrb, arg, len, 2);
+    v = mrb_marshal_instance_alloc(mrb, mrb_obj_value(klass));
     if (mrb_type(v) != MRB_TT_STRUCT) {
       mrb_raisef(mrb, E_TYPE_ERROR, "class %s not a struct",
                  mrb_class_name(mrb, klass));
     }
-    mem = mrb_funcall_id(mrb, mrb_obj_value(klass), MRB_SYM(members),
-                         0); // rb_struct_s_members(klass);
+    mem = r_struct_members(mrb, arg, klass);
     if (RARRAY_LEN(mem) != len) {
       mrb_raisef(mrb, E_TYPE_ERROR,
                  "struct %s not compatible (struct size differs)",
@@ -612,7 +1801,9 @@ static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
     }
 
     v = r_entry0(mrb, v, idx, arg);
-    values = mrb_ary_new_capa(mrb, len);
+    /* as rb_struct_initialize(): the slots are written directly and a
+       user-defined initialize is not run */
+    mrb_ary_resize(mrb, v, len);
     int ai = mrb_gc_arena_save(mrb);
     for (i = 0; i < len; i++) {
       slot = r_symbol(mrb, arg);
@@ -622,19 +1813,22 @@ static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
                    mrb_class_name(mrb, klass), mrb_sym_name(mrb, slot),
                    mrb_sym_name(mrb, mrb_symbol(RARRAY_PTR(mem)[i])));
       }
-      mrb_ary_push(mrb, values, r_object(mrb, arg));
+      mrb_ary_set(mrb, v, i, r_object(mrb, arg));
       mrb_gc_arena_restore(mrb, ai);
     }
-    mrb_funcall_argv(mrb, v, MRB_SYM(initialize), len,
-                     RARRAY_PTR(values)); // rb_struct_initialize(v, values);
     v = r_leave(mrb, v, arg);
   } break;
 
   case TYPE_USERDEF: {
-    struct RClass *klass =
-        path_find_class(mrb, RSTRING_CSTR(mrb, r_unique(mrb, arg)));
+    struct RClass *klass = r_class(mrb, arg);
     mrb_value data;
 
+    if (klass == arg->core.time) {
+      v = r_entry(mrb, r_time(mrb, arg, ivp), arg);
+      v = r_leave(mrb, v, arg);
+      break;
+    }
+
     if (!mrb_respond_to(mrb, mrb_obj_value(klass), s_load)) {
       mrb_raisef(mrb, E_TYPE_ERROR, "class %s needs to have method `_load'",
                  mrb_class_name(mrb, klass));
@@ -651,11 +1845,16 @@ static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
   } break;
 
   case TYPE_USRMARSHAL: {
-    struct RClass *klass =
-        path_find_class(mrb, RSTRING_CSTR(mrb, r_unique(mrb, arg)));
+    struct RClass *klass = r_class(mrb, arg);
     mrb_value data;
 
-    v = mrb_instance_alloc(mrb, mrb_obj_value(klass));
+    if (klass == arg->core.rational || klass == arg->core.complex) {
+      v = r_core_pair(mrb, arg, klass, r_prepare(mrb, arg));
+      v = r_leave(mrb, v, arg);
+      break;
+    }
+
+    v = mrb_marshal_instance_alloc(mrb, mrb_obj_value(klass));
     if (!mrb_nil_p(extmod)) {
       // TODO: extend
       // while (RARRAY_LEN(extmod) > 0)
@@ -678,7 +1877,17 @@ static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
 
   case TYPE_OBJECT: {
     mrb_int idx = r_prepare(mrb, arg);
-    v = obj_alloc_by_path(mrb, r_unique(mrb, arg), arg);
+    struct RClass *klass = r_class(mrb, arg);
+
+    if (MRB_INSTANCE_TT(klass) == MRB_TT_RANGE) {
+      v = r_leave(mrb, r_range(mrb, arg, klass, idx), arg);
+      break;
+    }
+    if (klass == arg->core.set) {
+      v = r_leave(mrb, r_set(mrb, arg, klass, idx), arg);
+      break;
+    }
+    v = mrb_marshal_instance_alloc(mrb, mrb_obj_value(klass));
     if (mrb_type(v) != MRB_TT_OBJECT) {
       mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error");
     }
@@ -687,9 +1896,20 @@ static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
     v = r_leave(mrb, v, arg);
   } break;
 
+  case TYPE_SHAPE_DEF:
+  case TYPE_SHAPE:
+    v = r_leave(mrb, r_shaped(mrb, arg, type), arg);
+    break;
+
   case TYPE_DATA: {
-    struct RClass *klass =
-        path_find_class(mrb, RSTRING_CSTR(mrb, r_unique(mrb, arg)));
+    struct RClass *klass = r_class(mrb, arg);
+    const struct mrb_marshal_data_entry *e =
+        mrb_marshal_data_by_class(arg->natives, klass);
+    if (e) {
+      v = r_data_native(mrb, arg, klass, e);
+      v = r_leave(mrb, v, arg);
+      break;
+    }
     if (mrb_respond_to(mrb, mrb_obj_value(klass), s_alloc)) {
       static int warn = TRUE;
       if (warn) {
@@ -699,7 +1919,7 @@ static mrb_value r_object0(mrb_state *mrb, struct load_arg *arg, int *ivp,
       v = mrb_funcall_id(mrb, mrb_obj_value(klass), s_alloc, 0);
       check_load_arg(mrb, arg, s_alloc);
     } else {
-      v = mrb_instance_alloc(mrb, mrb_obj_value(klass));
+      v = mrb_marshal_instance_alloc(mrb, mrb_obj_value(klass));
     }
     if (!mrb_data_p(v)) {
       mrb_raise(mrb, E_ARGUMENT_ERROR, "dump format error");
@@ -764,17 +1984,52 @@ static mrb_value r_object(mrb_state *mrb, struct load_arg *arg) {
   return r_object0(mrb, arg, 0, mrb_nil_value());
 }
 
+static void r_lz_free(mrb_state *mrb, struct load_arg *arg) {
+  if (arg->lz) {
+    mrb_free(mrb, arg->lz->buf);
+    mrb_free(mrb, arg->lz->in);
+    mrb_free(mrb, arg->lz);
+  }
+  arg->lz = NULL;
+}
+
 static void clear_load_arg(mrb_state *mrb, struct load_arg *arg) {
   if (arg->symbols)
     kh_destroy(symbol_load_table, mrb, arg->symbols);
   if (arg->data)
     kh_destroy(object_load_table, mrb, arg->data);
+  r_lz_free(mrb, arg);
+  if (arg->classes)
+    kh_destroy(class_load_table, mrb, arg->classes);
+  if (arg->structs)
+    kh_destroy(struct_load_table, mrb, arg->structs);
+  if (arg->regexps)
+    kh_destroy(content_load_table, mrb, arg->regexps);
+  if (arg->fstrings)
+    kh_destroy(content_load_table, mrb, arg->fstrings);
+  arg->classes = NULL;
+  arg->structs = NULL;
+  arg->regexps = NULL;
+  arg->fstrings = NULL;
+  if (arg->lazy) {
+    if (arg->lazy->starts)
+      kh_destroy(lazy_start_table, mrb, arg->lazy->starts);
+    mrb_free(mrb, arg->lazy->links);
+    mrb_free(mrb, arg->lazy->elems);
+    mrb_free(mrb, arg->lazy);
+  }
+  mrb_free(mrb, arg->scratch);
+  mrb_free(mrb, arg->shapes);
+  mrb_free(mrb, arg->shape_syms);
+  arg->shapes = NULL;
+  arg->shape_syms = NULL;
+  arg->scratch = NULL;
+  arg->scratch_capa = 0;
   arg->symbols = NULL;
   arg->data = NULL;
+  arg->lazy = NULL;
 }
 
-#include <mruby/data.h>
-
 static void free_load_arg(mrb_state *mrb, void *ud) {
   clear_load_arg(mrb, (struct load_arg *)ud);
   mrb_free(mrb, ud);
@@ -782,10 +2037,174 @@ static void free_load_arg(mrb_state *mrb, void *ud) {
 
 static mrb_data_type _mrb_load_arg = {"Marshal::LoadARG", free_load_arg};
 
+static void r_lz_init(mrb_state *mrb, struct load_arg *arg) {
+  struct load_lz *lz;
+
+  lz = (struct load_lz *)mrb_calloc(mrb, 1, sizeof(struct load_lz));
+  arg->lz = lz;
+  lz->buf = (uint8_t *)mrb_malloc(mrb, MARSHAL_LZ_BLOCK_SIZE);
+  lz->in = (uint8_t *)mrb_malloc(mrb, MARSHAL_LZ_BLOCK_SIZE);
+  lz->position = arg->position;
+  arg->position = 0;
+}
+
+static void r_ck_chunk(mrb_state *mrb, struct load_arg *arg, mrb_value buf,
+                       uint32_t len) {
+  char tmp[DUMP_BUFFER_SIZE];
+
+  if (!arg->reader) {
+    if ((mrb_int)len > RSTRING_LEN(arg->src) - (mrb_int)arg->position)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+    mrb_str_cat(mrb, buf, RSTRING_PTR(arg->src) + arg->position, len);
+    arg->position += len;
+    return;
+  }
+  /* bounded reads, so a corrupt length cannot force a large allocation */
+  while (len > 0) {
+    mrb_int n = len < sizeof(tmp) ? len : sizeof(tmp);
+    if (r_read(mrb, arg, tmp, n) != n)
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+    arg->position += n;
+    mrb_str_cat(mrb, buf, tmp, n);
+    len -= n;
+  }
+}
+
+/*
+ * Reads a whole checksummed frame and verifies it before anything is
+ * parsed, so a corrupt stream fails before any object is allocated. The
+ * payload then becomes a String source.
+ */
+static void r_ck_init(mrb_state *mrb, struct load_arg *arg) {
+  mrb_value buf = mrb_str_new(mrb, NULL, 0);
+  uint32_t crc = 0;
+
+  for (;;) {
+    uint8_t header[8];
+    uint32_t len, expect;
+
+    if (r_read(mrb, arg, header, sizeof(header)) != sizeof(header))
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+    arg->position += sizeof(header);
+    len = r_get32(header);
+    expect = r_get32(header + 4);
+    if (len > 0) {
+      r_ck_chunk(mrb, arg, buf, len);
+      crc = mrb_marshal_crc32c(crc, RSTRING_PTR(buf) + RSTRING_LEN(buf) - len,
+                               len);
+    }
+    if (crc != expect)
+      mrb_raise(mrb, E_ARGUMENT_ERROR,
+                "marshal data corrupted (checksum mismatch)");
+    if (len == 0)
+      break;
+  }
+  arg->src = buf;
+  arg->reader = NULL;
+  arg->position = 0;
+  arg->verified = TRUE;
+}
+
+/* Called after an `M` was read in place of the major version. */
+static int r_frame(mrb_state *mrb, struct load_arg *arg) {
+  char magic[3];
+
+  if (r_read(mrb, arg, magic, sizeof(magic)) != sizeof(magic))
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "marshal data too short");
+  arg->position += sizeof(magic);
+  if (!arg->verified && !arg->lz &&
+      memcmp(magic, MARSHAL_CK_MAGIC + 1, sizeof(magic)) == 0) {
+    r_ck_init(mrb, arg);
+  } else if (!arg->lz &&
+             memcmp(magic, MARSHAL_LZ_MAGIC + 1, sizeof(magic)) == 0) {
+    r_lz_init(mrb, arg);
+  } else if (!arg->shaped &&
+             memcmp(magic, MARSHAL_SH_MAGIC + 1, sizeof(magic)) == 0) {
+    arg->shaped = TRUE;
+  } else {
+    mrb_raise(mrb, E_TYPE_ERROR,
+              "incompatible marshal file format (unknown frame)");
+  }
+  return r_byte(mrb, arg);
+}
+
+/*
+ * Skip scans the whole source, then decodes it with arrays and hashes the
+ * scan found large replaced by proxies that decode their elements when
+ * accessed (see lazy.c). The source is kept by the load state; a compressed
+ * stream is decompressed into a String first.
+ */
+static mrb_value r_lazy_load(mrb_state *mrb, struct load_arg *arg,
+                             mrb_value state) {
+  struct load_lazy *lazy;
+  mrb_uint top;
+
+  if (arg->lz) {
+    mrb_value buf = mrb_str_new(mrb, NULL, 0);
+    char tmp[DUMP_BUFFER_SIZE];
+    mrb_int n;
+
+    while ((n = r_read(mrb, arg, tmp, sizeof(tmp))) > 0) {
+      mrb_str_cat(mrb, buf, tmp, n);
+      arg->position += n;
+    }
+    r_lz_free(mrb, arg);
+    arg->src = buf;
+    arg->reader = NULL;
+    arg->position = 0;
+  } else {
+    /* shares the buffer until the caller modifies its string */
+    arg->src = mrb_str_dup(mrb, arg->src);
+  }
+  mrb_iv_set(mrb, state, MRB_IVSYM(source), arg->src);
+
+  lazy = (struct load_lazy *)mrb_calloc(mrb, 1, sizeof(struct load_lazy));
+  arg->lazy = lazy;
+  lazy->starts = kh_init(lazy_start_table, mrb);
+  if (!mrb_array_p(arg->roots)) {
+    arg->roots = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, state, MRB_IVSYM(roots), arg->roots);
+  }
+
+  top = arg->position;
+  s_object(mrb, arg, TRUE);
+  arg->position = top;
+  return r_object(mrb, arg);
+}
+
+static mrb_value r_load_top(mrb_state *mrb, mrb_value state) {
+  struct load_arg *arg = (struct load_arg *)DATA_PTR(state);
+
+  /* lazy loads need the whole stream in memory; IO is loaded eagerly, and
+     so are shaped streams, whose objects depend on shapes defined earlier */
+  if ((arg->flags & MRB_MARSHAL_LOAD_LAZY) && (!arg->reader || arg->lz) &&
+      !arg->shaped)
+    return r_lazy_load(mrb, arg, state);
+  return r_object(mrb, arg);
+}
+
+static mrb_value r_gc_restore(mrb_state *mrb, mrb_value state) {
+  struct load_arg *arg = (struct load_arg *)DATA_PTR(state);
+
+  mrb->gc.disabled = arg->gc_disabled;
+  arg->gc_cap = 0;
+  return mrb_nil_value();
+}
+
 mrb_value mrb_marshal_load(mrb_state *mrb, mrb_marshal_reader_t reader,
                            mrb_value source) {
+  return mrb_marshal_load2(mrb, reader, source, NULL);
+}
+
+mrb_value mrb_marshal_load2(mrb_state *mrb, mrb_marshal_reader_t reader,
+                            mrb_value source,
+                            const mrb_marshal_load_options *opts) {
   struct load_arg *arg;
   struct RData *wrapper;
+  /* without a reader, r_byte and r_bytes index into source directly */
+  if (!reader && !mrb_string_p(source))
+    mrb_raisef(mrb, E_TYPE_ERROR, "instance of String needed (%C given)",
+               mrb_obj_class(mrb, source));
   Data_Make_Struct(mrb, mrb->object_class, struct load_arg, &_mrb_load_arg, arg,
                    wrapper);
   arg->src = source;
@@ -793,13 +2212,44 @@ mrb_value mrb_marshal_load(mrb_state *mrb, mrb_marshal_reader_t reader,
   arg->reader = reader;
   arg->symbols = kh_init(symbol_load_table, mrb);
   arg->data = kh_init(object_load_table, mrb);
+  arg->next = 0;
+  arg->roots = mrb_nil_value();
+  arg->state = mrb_obj_value(wrapper);
+  arg->classes = NULL;
+  arg->structs = NULL;
+  arg->regexps = NULL;
+  arg->fstrings = NULL;
+  arg->natives = mrb_marshal_data_registry(mrb);
+  mrb_marshal_core_init(mrb, &arg->core);
+  arg->scratch = NULL;
+  arg->scratch_capa = 0;
   arg->proc = NULL;
+  arg->lz = NULL;
+  arg->verified = FALSE;
+  arg->shaped = FALSE;
+  arg->shapes = NULL;
+  arg->nshapes = arg->shapes_capa = 0;
+  arg->shape_syms = NULL;
+  arg->nsyms = arg->syms_capa = 0;
+  arg->lazy = NULL;
+  arg->flags = opts ? opts->flags : 0;
+  arg->stats = opts ? opts->stats : NULL;
+  arg->max_alloc = opts ? opts->max_alloc : 0;
+  arg->max_string = opts ? opts->max_string : 0;
+  arg->max_collection = opts ? opts->max_collection : 0;
+  arg->allocated = 0;
+  if (arg->stats) {
+    memset(arg->stats, 0, sizeof(*arg->stats));
+    arg->stats->seconds = mrb_marshal_clock();
+  }
 
   mrb_value v;
 
   int major, minor;
 
   major = r_byte(mrb, arg);
+  while (major == 'M')
+    major = r_frame(mrb, arg);
   minor = r_byte(mrb, arg);
 
   if (major != MARSHAL_MAJOR || minor > MARSHAL_MINOR) {
@@ -810,8 +2260,35 @@ mrb_value mrb_marshal_load(mrb_state *mrb, mrb_marshal_reader_t reader,
                MARSHAL_MAJOR, MARSHAL_MINOR, major, minor);
   }
 
-  v = r_object(mrb, arg);
-  clear_load_arg(mrb, arg);
+  if (arg->flags & MRB_MARSHAL_LOAD_QUIET_GC) {
+    /* registered objects are GC roots, so the deferred collections are safe
+       and a half-built graph is never collected */
+    arg->roots = mrb_ary_new(mrb);
+    mrb_iv_set(mrb, mrb_obj_value(wrapper), MRB_IVSYM(roots), arg->roots);
+    arg->gc_disabled = mrb->gc.disabled;
+    arg->gc_live = mrb->gc.live;
+    arg->gc_cap = opts->gc_cap > 0 ? (size_t)opts->gc_cap : MARSHAL_GC_CAP;
+    mrb->gc.disabled = TRUE;
+    v = mrb_ensure(mrb, r_load_top, mrb_obj_value(wrapper), r_gc_restore,
+                   mrb_obj_value(wrapper));
+  } else {
+    v = r_load_top(mrb, mrb_obj_value(wrapper));
+  }
+
+  if (arg->stats) {
+    mrb_marshal_stats *stats = arg->stats;
+    stats->seconds = mrb_marshal_clock() - stats->seconds;
+    stats->bytes = arg->position;
+    stats->links = stats->types[TYPE_LINK];
+    stats->symlinks = stats->types[TYPE_SYMLINK];
+    stats->peak_links = kh_size(arg->data);
+  }
+  if (arg->lazy) {
+    /* the state lives on in the proxies, which must not count into stats */
+    arg->stats = NULL;
+  } else {
+    clear_load_arg(mrb, arg);
+  }
 
   return v;
 }
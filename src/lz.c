@@ -0,0 +1,148 @@
+#include <mruby.h>
+#include <mruby/marshal.h>
+
+#include "common.h"
+#include <string.h>
+
+/*
+ * Byte-oriented LZ77 block codec (LZ4-like sequence layout) for compressed
+ * marshal frames. A block is a series of sequences:
+ *
+ *   token        high nibble: literal length, low nibble: match length - 4
+ *   [len...]     255-continued extension when a nibble is 15
+ *   literals
+ *   offset       2 bytes little endian, 1..65535 back from the output end
+ *   [len...]     match length extension
+ *
+ * The last sequence of a block has literals only.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+#define LZ_MAX_OFFSET 65535
+
+static uint32_t lz_read32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t lz_hash(uint32_t v) {
+  return (v * UINT32_C(2654435761)) >> (32 - LZ_HASH_BITS);
+}
+
+static uint8_t *lz_put_len(uint8_t *op, size_t len) {
+  while (len >= 255) {
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = (uint8_t)len;
+  return op;
+}
+
+/* worst case output size of a sequence */
+#define LZ_SEQ_BOUND(lit, mlen)                                                \
+  (1 + ((lit) / 255 + 1) + (lit) + 2 + ((mlen) / 255 + 1))
+
+size_t mrb_marshal_lz_compress(const uint8_t *src, size_t len, uint8_t *dst,
+                               size_t cap) {
+  uint32_t table[1 << LZ_HASH_BITS];
+  const uint8_t *ip = src, *anchor = src, *iend = src + len;
+  uint8_t *op = dst, *oend = dst + cap;
+  size_t lit;
+
+  memset(table, 0, sizeof(table));
+  while (iend - ip >= LZ_MIN_MATCH) {
+    uint32_t h = lz_hash(lz_read32(ip));
+    const uint8_t *ref = src + table[h];
+    const uint8_t *mp, *rp;
+    size_t mlen, off;
+    uint8_t *token;
+
+    table[h] = (uint32_t)(ip - src);
+    if (ref >= ip || ip - ref > LZ_MAX_OFFSET ||
+        lz_read32(ref) != lz_read32(ip)) {
+      ip++;
+      continue;
+    }
+    for (mp = ip + LZ_MIN_MATCH, rp = ref + LZ_MIN_MATCH;
+         mp < iend && *mp == *rp; mp++, rp++)
+      ;
+
+    lit = ip - anchor;
+    mlen = (mp - ip) - LZ_MIN_MATCH;
+    off = ip - ref;
+    if ((size_t)(oend - op) < LZ_SEQ_BOUND(lit, mlen))
+      return 0;
+    token = op++;
+    *token = (uint8_t)(((lit >= 15 ? 15 : lit) << 4) | (mlen >= 15 ? 15 : mlen));
+    if (lit >= 15)
+      op = lz_put_len(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    *op++ = (uint8_t)(off & 0xff);
+    *op++ = (uint8_t)(off >> 8);
+    if (mlen >= 15)
+      op = lz_put_len(op, mlen - 15);
+    ip = anchor = mp;
+  }
+
+  lit = iend - anchor;
+  if ((size_t)(oend - op) < LZ_SEQ_BOUND(lit, 0))
+    return 0;
+  *op++ = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+  if (lit >= 15)
+    op = lz_put_len(op, lit - 15);
+  memcpy(op, anchor, lit);
+  op += lit;
+  return op - dst;
+}
+
+static const uint8_t *lz_get_len(const uint8_t *ip, const uint8_t *iend,
+                                 size_t *len) {
+  uint8_t b;
+  do {
+    if (ip >= iend)
+      return NULL;
+    b = *ip++;
+    *len += b;
+  } while (b == 255);
+  return ip;
+}
+
+int mrb_marshal_lz_decompress(const uint8_t *src, size_t len, uint8_t *dst,
+                              size_t raw_len) {
+  const uint8_t *ip = src, *iend = src + len;
+  uint8_t *op = dst, *oend = dst + raw_len;
+
+  while (ip < iend) {
+    unsigned token = *ip++;
+    size_t lit = token >> 4, mlen = token & 15, off;
+    const uint8_t *ref;
+
+    if (lit == 15 && !(ip = lz_get_len(ip, iend, &lit)))
+      return -1;
+    if ((size_t)(iend - ip) < lit || (size_t)(oend - op) < lit)
+      return -1;
+    memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+    if (ip == iend)
+      break;
+
+    if (iend - ip < 2)
+      return -1;
+    off = ip[0] | ((size_t)ip[1] << 8);
+    ip += 2;
+    if (off == 0 || off > (size_t)(op - dst))
+      return -1;
+    if (mlen == 15 && !(ip = lz_get_len(ip, iend, &mlen)))
+      return -1;
+    mlen += LZ_MIN_MATCH;
+    if ((size_t)(oend - op) < mlen)
+      return -1;
+    for (ref = op - off; mlen > 0; mlen--)
+      *op++ = *ref++;
+  }
+  return op == oend ? 0 : -1;
+}
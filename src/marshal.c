@@ -2,11 +2,67 @@
 #include <mruby/value.h>
 #include <mruby/marshal.h>
 #include <mruby/class.h>
+#include <mruby/error.h>
+#include <mruby/hash.h>
 #include <mruby/string.h>
+#include <mruby/variable.h>
 #include <mruby/presym.h>
 
 #include "common.h"
+#include <errno.h>
+#include <stdio.h>
 #include <string.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#define MARSHAL_HAVE_FORK 1
+#endif
+
+double
+mrb_marshal_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+#else
+  return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static void
+_set_last_stats(mrb_state *mrb, mrb_value self, const mrb_marshal_stats *stats)
+{
+  mrb_value hash = mrb_hash_new(mrb);
+  mrb_value types = mrb_hash_new(mrb);
+  int i;
+  for (i = 0; i < 256; i++)
+  {
+    if (stats->types[i])
+    {
+      char tag = (char)i;
+      mrb_hash_set(mrb, types, mrb_str_new(mrb, &tag, 1), mrb_int_value(mrb, (mrb_int)stats->types[i]));
+    }
+  }
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(bytes)), mrb_int_value(mrb, (mrb_int)stats->bytes));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(io_calls)), mrb_int_value(mrb, (mrb_int)stats->io_calls));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(user_calls)), mrb_int_value(mrb, (mrb_int)stats->user_calls));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(links)), mrb_int_value(mrb, (mrb_int)stats->links));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(symlinks)), mrb_int_value(mrb, (mrb_int)stats->symlinks));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(peak_links)), mrb_int_value(mrb, (mrb_int)stats->peak_links));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(seconds)), mrb_float_value(mrb, stats->seconds));
+  mrb_hash_set(mrb, hash, mrb_symbol_value(MRB_SYM(types)), types);
+  mrb_iv_set(mrb, self, MRB_IVSYM(last_stats), hash);
+}
+
+static mrb_bool
+_kwarg_p(mrb_value v)
+{
+  return !mrb_undef_p(v) && mrb_test(v);
+}
 
 static int
 _writer_string(mrb_state *mrb, const void *src, int size, mrb_value dest, mrb_uint position)
@@ -29,42 +85,109 @@ _writer_io(mrb_state *mrb, const void *src, int size, mrb_value dest, mrb_uint p
 static mrb_value
 mrb_mruby_marshal_dump(mrb_state *mrb, mrb_value self)
 {
+  static const mrb_sym kw_names[] = { MRB_SYM(encoding), MRB_SYM(stats), MRB_SYM(compress), MRB_SYM(pipeline), MRB_SYM(checksum), MRB_SYM(dedup), MRB_SYM(shapes) };
+  mrb_value kw_values[sizeof(kw_names) / sizeof(kw_names[0])];
+  mrb_kwargs kwargs = { sizeof(kw_names) / sizeof(kw_names[0]), 0, kw_names, kw_values, NULL };
+  mrb_marshal_dump_options opts = { 0 };
+  mrb_marshal_stats stats;
   mrb_value obj, io = mrb_nil_value();
   mrb_int limit = -1;
-  const mrb_int arg_count = mrb_get_args(mrb, "o|oi", &obj, &io, &limit);
-  if (arg_count == 2 && mrb_fixnum_p(io))
+  mrb_bool limit_given = FALSE;
+  mrb_get_args(mrb, "o|oi?:", &obj, &io, &limit, &limit_given, &kwargs);
+  if (!limit_given && mrb_fixnum_p(io))
   {
     limit = mrb_fixnum(io);
     io = mrb_nil_value();
   }
-  if (mrb_nil_p(io))
+  if (_kwarg_p(kw_values[0]))
+  {
+    opts.flags |= MRB_MARSHAL_DUMP_ENCODING;
+  }
+  if (_kwarg_p(kw_values[1]))
+  {
+    opts.stats = &stats;
+  }
+  if (_kwarg_p(kw_values[2]))
+  {
+    if (!mrb_symbol_p(kw_values[2]) || mrb_symbol(kw_values[2]) != MRB_SYM(lz))
+    {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown compression %v", kw_values[2]);
+    }
+    opts.flags |= MRB_MARSHAL_DUMP_COMPRESS_LZ;
+  }
+  if (_kwarg_p(kw_values[4]))
+  {
+    opts.flags |= MRB_MARSHAL_DUMP_CHECKSUM;
+  }
+  if (_kwarg_p(kw_values[5]))
+  {
+    opts.flags |= MRB_MARSHAL_DUMP_DEDUP_STRINGS;
+  }
+  if (_kwarg_p(kw_values[6]))
+  {
+    opts.flags |= MRB_MARSHAL_DUMP_SHAPES;
+  }
+  if (_kwarg_p(kw_values[3]))
   {
-    mrb_value str = mrb_str_new(mrb, NULL, 0);
-    mrb_marshal_dump(mrb, obj, _writer_string, str, limit);
-    return str;
+    mrb_int fd;
+    if (mrb_nil_p(io))
+    {
+      mrb_raise(mrb, E_ARGUMENT_ERROR, "pipeline: needs an IO");
+    }
+    if (mrb_respond_to(mrb, io, MRB_SYM(flush)))
+    {
+      mrb_funcall_id(mrb, io, MRB_SYM(flush), 0);
+    }
+    fd = mrb_as_int(mrb, mrb_funcall_id(mrb, io, MRB_SYM(fileno), 0));
+    mrb_marshal_dump_fd(mrb, obj, (int)fd, limit, &opts);
+  }
+  else if (mrb_nil_p(io))
+  {
+    io = mrb_str_new(mrb, NULL, 0);
+    mrb_marshal_dump2(mrb, obj, _writer_string, io, limit, &opts);
   }
   else
   {
-    mrb_marshal_dump(mrb, obj, _writer_io, io, limit);
-    return io;
+    mrb_marshal_dump2(mrb, obj, _writer_io, io, limit, &opts);
+  }
+  if (opts.stats)
+  {
+    _set_last_stats(mrb, self, opts.stats);
   }
+  return io;
 }
 
-static int
-_reader_string(mrb_state *mrb, mrb_value src, void *dest, int size, mrb_uint position)
+static mrb_value
+mrb_mruby_marshal_digest(mrb_state *mrb, mrb_value self)
 {
-  int remain = RSTRING_LEN(src) - position;
-  if (size < 0)
+  static const mrb_sym kw_names[] = { MRB_SYM(canonical), MRB_SYM(encoding) };
+  mrb_value kw_values[sizeof(kw_names) / sizeof(kw_names[0])];
+  mrb_kwargs kwargs = { sizeof(kw_names) / sizeof(kw_names[0]), 0, kw_names, kw_values, NULL };
+  mrb_marshal_dump_options opts = { 0 };
+  mrb_value obj;
+  uint64_t digest;
+  char hex[17];
+  mrb_get_args(mrb, "o:", &obj, &kwargs);
+  if (_kwarg_p(kw_values[0]))
   {
-    mrb_raisef(mrb, E_ARGUMENT_ERROR, "negative length %d given", size);
+    opts.flags |= MRB_MARSHAL_DUMP_CANONICAL;
   }
-  if (remain > 0)
+  if (_kwarg_p(kw_values[1]))
   {
-    int len = remain < size ? remain : size;
-    memcpy(dest, RSTRING_PTR(src) + position, len);
-    return len;
+    opts.flags |= MRB_MARSHAL_DUMP_ENCODING;
   }
-  return 0;
+  digest = mrb_marshal_digest(mrb, obj, -1, &opts);
+  snprintf(hex, sizeof(hex), "%08lx%08lx", (unsigned long)(digest >> 32), (unsigned long)(digest & 0xffffffff));
+  return mrb_str_new(mrb, hex, 16);
+}
+
+static mrb_value
+mrb_mruby_marshal_deep_copy(mrb_state *mrb, mrb_value self)
+{
+  mrb_value obj;
+  mrb_int limit = -1;
+  mrb_get_args(mrb, "o|i", &obj, &limit);
+  return mrb_marshal_deep_copy(mrb, obj, (int)limit);
 }
 
 static int
@@ -84,22 +207,189 @@ _reader_io(mrb_state *mrb, mrb_value src, void *dest, int size, mrb_uint positio
 
 static mrb_value
 mrb_mruby_marshal_load(mrb_state *mrb, mrb_value self)
+{
+  static const mrb_sym kw_names[] = { MRB_SYM(stats), MRB_SYM(lazy), MRB_SYM(max_alloc), MRB_SYM(max_string), MRB_SYM(max_collection), MRB_SYM(quiet_gc), MRB_SYM(gc_cap), MRB_SYM(freeze) };
+  mrb_value kw_values[sizeof(kw_names) / sizeof(kw_names[0])];
+  mrb_kwargs kwargs = { sizeof(kw_names) / sizeof(kw_names[0]), 0, kw_names, kw_values, NULL };
+  mrb_marshal_load_options opts = { 0 };
+  mrb_marshal_stats stats;
+  mrb_value obj, v;
+  mrb_get_args(mrb, "o:", &obj, &kwargs);
+  if (_kwarg_p(kw_values[0]))
+  {
+    opts.stats = &stats;
+  }
+  if (_kwarg_p(kw_values[1]))
+  {
+    opts.flags |= MRB_MARSHAL_LOAD_LAZY;
+  }
+  if (!mrb_undef_p(kw_values[2]))
+  {
+    opts.max_alloc = mrb_as_int(mrb, kw_values[2]);
+  }
+  if (!mrb_undef_p(kw_values[3]))
+  {
+    opts.max_string = mrb_as_int(mrb, kw_values[3]);
+  }
+  if (!mrb_undef_p(kw_values[4]))
+  {
+    opts.max_collection = mrb_as_int(mrb, kw_values[4]);
+  }
+  if (_kwarg_p(kw_values[5]))
+  {
+    opts.flags |= MRB_MARSHAL_LOAD_QUIET_GC;
+  }
+  if (!mrb_undef_p(kw_values[6]))
+  {
+    opts.gc_cap = mrb_as_int(mrb, kw_values[6]);
+  }
+  if (_kwarg_p(kw_values[7]))
+  {
+    opts.flags |= MRB_MARSHAL_LOAD_FREEZE;
+  }
+  v = mrb_string_p(obj)
+          ? mrb_marshal_load2(mrb, NULL, obj, &opts)
+          : mrb_marshal_load2(mrb, _reader_io, obj, &opts);
+  if (opts.stats)
+  {
+    _set_last_stats(mrb, self, opts.stats);
+  }
+  return v;
+}
+
+#ifdef MARSHAL_HAVE_FORK
+struct _bgdump
 {
   mrb_value obj;
-  mrb_get_args(mrb, "o", &obj);
-  return mrb_string_p(obj)
-             ? mrb_marshal_load(mrb, _reader_string, obj)
-             : mrb_marshal_load(mrb, _reader_io, obj);
+  int fd;
+  mrb_marshal_dump_options opts;
+};
+
+static mrb_value
+_bgdump_body(mrb_state *mrb, void *ud)
+{
+  struct _bgdump *bg = (struct _bgdump *)ud;
+  mrb_marshal_dump_fd(mrb, bg->obj, bg->fd, -1, &bg->opts);
+  return mrb_nil_value();
+}
+
+/* Runs in the forked child and never returns. */
+static void
+_bgdump_child(mrb_state *mrb, struct _bgdump *bg, const char *path)
+{
+  size_t len = strlen(path) + 32;
+  char *tmp = (char *)mrb_malloc_simple(mrb, len);
+  mrb_bool error = FALSE;
+  if (!tmp)
+  {
+    _exit(1);
+  }
+  snprintf(tmp, len, "%s.%ld.tmp", path, (long)getpid());
+  bg->fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (bg->fd < 0)
+  {
+    _exit(1);
+  }
+  mrb_protect_error(mrb, _bgdump_body, bg, &error);
+  if (error || fsync(bg->fd) != 0 || close(bg->fd) != 0 || rename(tmp, path) != 0)
+  {
+    unlink(tmp);
+    _exit(1);
+  }
+  _exit(0);
+}
+#endif
+
+static mrb_value
+mrb_mruby_marshal_bgdump(mrb_state *mrb, mrb_value self)
+{
+#ifdef MARSHAL_HAVE_FORK
+  static const mrb_sym kw_names[] = { MRB_SYM(compress), MRB_SYM(checksum) };
+  mrb_value kw_values[sizeof(kw_names) / sizeof(kw_names[0])];
+  mrb_kwargs kwargs = { sizeof(kw_names) / sizeof(kw_names[0]), 0, kw_names, kw_values, NULL };
+  struct _bgdump bg = { 0 };
+  const char *path;
+  pid_t pid;
+  mrb_get_args(mrb, "oz:", &bg.obj, &path, &kwargs);
+  if (_kwarg_p(kw_values[0]))
+  {
+    if (!mrb_symbol_p(kw_values[0]) || mrb_symbol(kw_values[0]) != MRB_SYM(lz))
+    {
+      mrb_raisef(mrb, E_ARGUMENT_ERROR, "unknown compression %v", kw_values[0]);
+    }
+    bg.opts.flags |= MRB_MARSHAL_DUMP_COMPRESS_LZ;
+  }
+  if (_kwarg_p(kw_values[1]))
+  {
+    bg.opts.flags |= MRB_MARSHAL_DUMP_CHECKSUM;
+  }
+  fflush(NULL);
+  pid = fork();
+  if (pid < 0)
+  {
+    mrb_sys_fail(mrb, "fork");
+  }
+  if (pid == 0)
+  {
+    _bgdump_child(mrb, &bg, path);
+  }
+  return mrb_int_value(mrb, (mrb_int)pid);
+#else
+  mrb_raise(mrb, E_NOTIMP_ERROR, "Marshal.bgdump is not supported on this platform");
+  return mrb_nil_value();
+#endif
+}
+
+static mrb_value
+mrb_mruby_marshal_bgwait(mrb_state *mrb, mrb_value self)
+{
+#ifdef MARSHAL_HAVE_FORK
+  mrb_int pid;
+  mrb_bool nohang = FALSE;
+  int status, r;
+  mrb_get_args(mrb, "i|b", &pid, &nohang);
+  do
+  {
+    r = waitpid((pid_t)pid, &status, nohang ? WNOHANG : 0);
+  } while (r < 0 && errno == EINTR);
+  if (r < 0)
+  {
+    mrb_sys_fail(mrb, "waitpid");
+  }
+  if (r == 0)
+  {
+    return mrb_nil_value();
+  }
+  return mrb_bool_value(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+#else
+  mrb_raise(mrb, E_NOTIMP_ERROR, "Marshal.bgwait is not supported on this platform");
+  return mrb_nil_value();
+#endif
+}
+
+static mrb_value
+mrb_mruby_marshal_last_stats(mrb_state *mrb, mrb_value self)
+{
+  return mrb_iv_get(mrb, self, MRB_IVSYM(last_stats));
 }
 
 void mrb_mruby_marshal_c_gem_init(mrb_state *mrb)
 {
   struct RClass *mrb_marshal;
   mrb_marshal = mrb_define_module_id(mrb, MRB_SYM(Marshal));
+  mrb_marshal_crc32c_init();
+
+  mrb_define_module_function_id(mrb, mrb_marshal, MRB_SYM(dump), mrb_mruby_marshal_dump, MRB_ARGS_ARG(1, 2) | MRB_ARGS_KEY(7, 0));
+  mrb_define_module_function_id(mrb, mrb_marshal, MRB_SYM(deep_copy), mrb_mruby_marshal_deep_copy, MRB_ARGS_ARG(1, 1));
+  mrb_define_module_function_id(mrb, mrb_marshal, MRB_SYM(digest), mrb_mruby_marshal_digest, MRB_ARGS_REQ(1) | MRB_ARGS_KEY(2, 0));
+  mrb_define_module_function_id(mrb, mrb_marshal, MRB_SYM(load), mrb_mruby_marshal_load, MRB_ARGS_REQ(1) | MRB_ARGS_KEY(8, 0));
+  mrb_define_module_function_id(mrb, mrb_marshal, MRB_SYM(restore), mrb_mruby_marshal_load, MRB_ARGS_REQ(1) | MRB_ARGS_KEY(8, 0));
+  mrb_define_module_function_id(mrb, mrb_marshal, MRB_SYM(bgdump), mrb_mruby_marshal_bgdump, MRB_ARGS_REQ(2) | MRB_ARGS_KEY(2, 0));
+  mrb_define_module_function_id(mrb, mrb_marshal, MRB_SYM(bgwait), mrb_mruby_marshal_bgwait, MRB_ARGS_ARG(1, 1));
+  mrb_define_module_function_id(mrb, mrb_marshal, MRB_SYM(last_stats), mrb_mruby_marshal_last_stats, MRB_ARGS_NONE());
 
-  mrb_define_module_function_id(mrb, mrb_marshal, MRB_SYM(dump), mrb_mruby_marshal_dump, MRB_ARGS_REQ(1));
-  mrb_define_module_function_id(mrb, mrb_marshal, MRB_SYM(load), mrb_mruby_marshal_load, MRB_ARGS_REQ(1));
-  mrb_define_module_function_id(mrb, mrb_marshal, MRB_SYM(restore), mrb_mruby_marshal_load, MRB_ARGS_REQ(1));
+  mrb_marshal_archive_init(mrb, mrb_marshal);
+  mrb_marshal_lazy_init(mrb, mrb_marshal);
 
   mrb_define_const_id(mrb, mrb_marshal, MRB_SYM(MAJOR_VERSION), mrb_fixnum_value(MARSHAL_MAJOR));
   mrb_define_const_id(mrb, mrb_marshal, MRB_SYM(MINOR_VERSION), mrb_fixnum_value(MARSHAL_MINOR));
@@ -0,0 +1,266 @@
+#include <mruby.h>
+#include <mruby/marshal.h>
+
+#include "common.h"
+#include <errno.h>
+#include <string.h>
+
+/*
+ * Write pipeline for mrb_marshal_dump_fd(). The VM thread fills fixed-size
+ * slots of a single-producer/single-consumer ring; a worker thread compresses
+ * and checksums them as requested and writes them to the file descriptor.
+ * head is only advanced by the producer and tail only by the worker, so
+ * handing over a slot takes no lock; the mutex and condition variable are
+ * only used to sleep when the ring is full (producer) or empty (worker).
+ *
+ * Without pthreads (or with MRB_MARSHAL_NO_THREADS) the slots are processed
+ * synchronously on the VM thread.
+ */
+
+#if !defined(MRB_MARSHAL_NO_THREADS) && !defined(_WIN32)
+#define MARSHAL_PIPE_THREADS 1
+#include <pthread.h>
+#endif
+
+#ifdef _WIN32
+#include <io.h>
+#define write _write
+#else
+#include <unistd.h>
+#endif
+
+#define PIPE_SLOTS 8
+
+#ifdef MARSHAL_PIPE_THREADS
+#define PIPE_LOAD(x) __atomic_load_n(&(x), __ATOMIC_ACQUIRE)
+#define PIPE_STORE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELEASE)
+#else
+#define PIPE_LOAD(x) (x)
+#define PIPE_STORE(x, v) ((x) = (v))
+#endif
+
+struct pipe_slot {
+  uint8_t *data;
+  size_t len;
+};
+
+struct mrb_marshal_pipe {
+  int fd;
+  mrb_bool lz, ck;
+  uint32_t crc; /* running CRC32C, worker only */
+  uint8_t *out; /* compressed block, worker only */
+  struct pipe_slot slots[PIPE_SLOTS];
+  size_t fill; /* bytes in the slot being filled by the producer */
+  unsigned head, tail;
+  int closing;
+  int error; /* errno of the first failed write */
+#ifdef MARSHAL_PIPE_THREADS
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+#endif
+};
+
+static int pipe_write_all(int fd, const void *p, size_t n) {
+  const char *s = (const char *)p;
+
+  while (n > 0) {
+    ssize_t w = write(fd, s, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return errno;
+    }
+    s += w;
+    n -= w;
+  }
+  return 0;
+}
+
+static void pipe_put32(uint8_t *p, uint32_t x) {
+  p[0] = (uint8_t)x;
+  p[1] = (uint8_t)(x >> 8);
+  p[2] = (uint8_t)(x >> 16);
+  p[3] = (uint8_t)(x >> 24);
+}
+
+/* Writes n bytes of output, as a checksummed chunk if requested. */
+static int pipe_emit(struct mrb_marshal_pipe *p, const void *s, size_t n) {
+  uint8_t header[8];
+  int err;
+
+  if (!p->ck)
+    return pipe_write_all(p->fd, s, n);
+  p->crc = mrb_marshal_crc32c(p->crc, s, n);
+  pipe_put32(header, (uint32_t)n);
+  pipe_put32(header + 4, p->crc);
+  err = pipe_write_all(p->fd, header, sizeof(header));
+  return err ? err : pipe_write_all(p->fd, s, n);
+}
+
+static void pipe_process(struct mrb_marshal_pipe *p, struct pipe_slot *slot) {
+  uint8_t header[8];
+  size_t clen;
+  int err;
+
+  if (PIPE_LOAD(p->error))
+    return;
+  if (!p->lz) {
+    err = pipe_emit(p, slot->data, slot->len);
+  } else {
+    clen = mrb_marshal_lz_compress(slot->data, slot->len, p->out, slot->len);
+    if (clen >= slot->len)
+      clen = 0;
+    pipe_put32(header, (uint32_t)slot->len);
+    pipe_put32(header + 4, (uint32_t)clen);
+    err = pipe_emit(p, header, sizeof(header));
+    if (!err)
+      err = clen ? pipe_emit(p, p->out, clen)
+                 : pipe_emit(p, slot->data, slot->len);
+  }
+  if (err)
+    PIPE_STORE(p->error, err);
+}
+
+#ifdef MARSHAL_PIPE_THREADS
+static void pipe_wake(struct mrb_marshal_pipe *p) {
+  pthread_mutex_lock(&p->lock);
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+}
+
+static void *pipe_main(void *ud) {
+  struct mrb_marshal_pipe *p = (struct mrb_marshal_pipe *)ud;
+
+  for (;;) {
+    unsigned tail = p->tail;
+
+    if (PIPE_LOAD(p->head) == tail) {
+      pthread_mutex_lock(&p->lock);
+      while (PIPE_LOAD(p->head) == tail && !PIPE_LOAD(p->closing))
+        pthread_cond_wait(&p->cond, &p->lock);
+      pthread_mutex_unlock(&p->lock);
+      if (PIPE_LOAD(p->head) == tail)
+        break;
+    }
+    pipe_process(p, &p->slots[tail % PIPE_SLOTS]);
+    PIPE_STORE(p->tail, tail + 1);
+    pipe_wake(p);
+  }
+  return NULL;
+}
+#endif
+
+static void pipe_push(struct mrb_marshal_pipe *p) {
+  unsigned head = p->head;
+
+  p->slots[head % PIPE_SLOTS].len = p->fill;
+  p->fill = 0;
+#ifdef MARSHAL_PIPE_THREADS
+  PIPE_STORE(p->head, head + 1);
+  pipe_wake(p);
+  if (head + 1 - PIPE_LOAD(p->tail) == PIPE_SLOTS) {
+    pthread_mutex_lock(&p->lock);
+    while (head + 1 - PIPE_LOAD(p->tail) == PIPE_SLOTS)
+      pthread_cond_wait(&p->cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+  }
+#else
+  pipe_process(p, &p->slots[head % PIPE_SLOTS]);
+  p->head = p->tail = head + 1;
+#endif
+}
+
+static void pipe_free(mrb_state *mrb, struct mrb_marshal_pipe *p) {
+  int i;
+
+  for (i = 0; i < PIPE_SLOTS; i++)
+    mrb_free(mrb, p->slots[i].data);
+  mrb_free(mrb, p->out);
+#ifdef MARSHAL_PIPE_THREADS
+  pthread_cond_destroy(&p->cond);
+  pthread_mutex_destroy(&p->lock);
+#endif
+  mrb_free(mrb, p);
+}
+
+struct mrb_marshal_pipe *mrb_marshal_pipe_open(mrb_state *mrb, int fd,
+                                               uint32_t flags) {
+  mrb_bool lz = (flags & MRB_MARSHAL_DUMP_COMPRESS_LZ) != 0;
+  struct mrb_marshal_pipe *p;
+  int i, err = 0;
+
+  p = (struct mrb_marshal_pipe *)mrb_calloc(mrb, 1, sizeof(*p));
+  p->fd = fd;
+  p->lz = lz;
+  p->ck = (flags & MRB_MARSHAL_DUMP_CHECKSUM) != 0;
+#ifdef MARSHAL_PIPE_THREADS
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+#endif
+  for (i = 0; i < PIPE_SLOTS; i++)
+    p->slots[i].data = (uint8_t *)mrb_malloc_simple(mrb, MARSHAL_LZ_BLOCK_SIZE);
+  if (lz)
+    p->out = (uint8_t *)mrb_malloc_simple(mrb, MARSHAL_LZ_BLOCK_SIZE);
+  for (i = 0; i < PIPE_SLOTS; i++) {
+    if (!p->slots[i].data)
+      err = ENOMEM;
+  }
+  if (lz && !p->out)
+    err = ENOMEM;
+  if (!err && p->ck)
+    err = pipe_write_all(fd, MARSHAL_CK_MAGIC, MARSHAL_CK_MAGIC_LEN);
+  if (!err && lz)
+    err = pipe_emit(p, MARSHAL_LZ_MAGIC, MARSHAL_LZ_MAGIC_LEN);
+#ifdef MARSHAL_PIPE_THREADS
+  if (!err)
+    err = pthread_create(&p->thread, NULL, pipe_main, p);
+#endif
+  if (err) {
+    pipe_free(mrb, p);
+    errno = err;
+    mrb_sys_fail(mrb, "Marshal.dump");
+  }
+  return p;
+}
+
+int mrb_marshal_pipe_write(struct mrb_marshal_pipe *p, const void *src,
+                           size_t n) {
+  const uint8_t *s = (const uint8_t *)src;
+
+  while (n > 0) {
+    size_t chunk = MARSHAL_LZ_BLOCK_SIZE - p->fill;
+    if (chunk > n)
+      chunk = n;
+    memcpy(p->slots[p->head % PIPE_SLOTS].data + p->fill, s, chunk);
+    p->fill += chunk;
+    s += chunk;
+    n -= chunk;
+    if (p->fill == MARSHAL_LZ_BLOCK_SIZE)
+      pipe_push(p);
+  }
+  return PIPE_LOAD(p->error);
+}
+
+int mrb_marshal_pipe_close(mrb_state *mrb, struct mrb_marshal_pipe *p,
+                           mrb_bool finish) {
+  uint8_t eos[8] = {0};
+  int err;
+
+  if (finish && p->fill > 0)
+    pipe_push(p);
+#ifdef MARSHAL_PIPE_THREADS
+  PIPE_STORE(p->closing, 1);
+  pipe_wake(p);
+  pthread_join(p->thread, NULL);
+#endif
+  err = p->error;
+  if (finish && !err && p->lz)
+    err = pipe_emit(p, eos, sizeof(eos));
+  if (finish && !err && p->ck) {
+    pipe_put32(eos + 4, p->crc);
+    err = pipe_write_all(p->fd, eos, sizeof(eos));
+  }
+  pipe_free(mrb, p);
+  return err;
+}
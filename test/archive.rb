@@ -0,0 +1,35 @@
+assert('Marshal::Archive') do
+  skip unless Object.const_defined?(:File)
+  path = "/tmp/mruby-marshal-archive-#{rand(1_000_000)}"
+  begin
+    [{}, { compress: :lz, checksum: true }].each do |opts|
+      w = Marshal::Archive::Writer.new(path, **opts)
+      assert_equal w.add([1, 2, 3]), 0
+      w['config'] = { 'a' => 'b' * 1000 }
+      w.add(:third, :sym_key)
+      assert_raise(TypeError) { w[5] = 'five' }
+      assert_raise(TypeError) { w.add('five', 5) }
+      assert_raise(TypeError) { w.add(['x' * 100_000, Hash.new(1)], :broken) }
+      assert_equal w.add('after', :after), 3
+      w.close
+      assert_raise(RuntimeError) { w.add(1) }
+
+      a = Marshal::Archive.new(path)
+      assert_equal a.size, 4
+      assert_equal a.keys, ['config', :sym_key, :after]
+      assert_true a.key?('config')
+      assert_equal a['config'], { 'a' => 'b' * 1000 }
+      assert_equal a[:sym_key], :third
+      assert_equal a[0], [1, 2, 3]
+      assert_equal a[:after], 'after'
+      assert_nil a[4]
+      assert_nil a['missing']
+      a.close
+    end
+
+    File.open(path, 'wb') { |f| f.write('not an archive at all') }
+    assert_raise(TypeError) { Marshal::Archive.new(path) }
+  ensure
+    File.unlink(path) if File.exist?(path)
+  end
+end
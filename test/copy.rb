@@ -0,0 +1,72 @@
+class CopyPoint
+  attr_accessor :x, :y
+  def initialize(x, y) @x = x; @y = y end
+end
+
+class CopyCustom
+  attr_reader :data, :loaded
+  def initialize(data) @data = data end
+  def marshal_dump; [@data] end
+  def marshal_load(a) @data = a[0]; @loaded = true end
+end
+
+CopyRow = Struct.new(:a, :b)
+
+assert('Marshal.deep_copy') do
+  assert_equal Marshal.deep_copy(nil), nil
+  assert_equal Marshal.deep_copy(1), 1
+  assert_equal Marshal.deep_copy(:sym), :sym
+
+  obj = [1, 'two', { three: [3.0] }, CopyRow.new('a', [:b])]
+  copy = Marshal.deep_copy(obj)
+  assert_equal copy, obj
+  assert_not_same copy[1], obj[1]
+  assert_not_same copy[2][:three], obj[2][:three]
+  assert_not_same copy[3].b, obj[3].b
+end
+
+assert('Marshal.deep_copy keeps shared and cyclic references') do
+  s = 'shared'
+  a = [s, s]
+  a << a
+  copy = Marshal.deep_copy(a)
+  assert_not_same copy[0], s
+  assert_same copy[0], copy[1]
+  assert_same copy, copy[2]
+
+  h = { 'k' => 1 }
+  key = Marshal.deep_copy(h).keys.first
+  assert_true key.frozen?
+end
+
+assert('Marshal.deep_copy with objects') do
+  p = CopyPoint.new(1, 'y')
+  copy = Marshal.deep_copy(p)
+  assert_equal copy.class, CopyPoint
+  assert_equal copy.x, 1
+  assert_equal copy.y, 'y'
+  assert_not_same copy.y, p.y
+
+  c = Marshal.deep_copy(CopyCustom.new(['d']))
+  assert_true c.loaded
+  assert_equal c.data, ['d']
+
+  assert_raise(TypeError) { Marshal.deep_copy(Hash.new(1)) }
+  assert_raise(ArgumentError) { Marshal.deep_copy([[[]]], 2) }
+end
+
+class CopyCollecting
+  attr_reader :data
+  def initialize(data) @data = data end
+  def marshal_dump
+    GC.start
+    [@data, 'pad' * 4]
+  end
+  def marshal_load(a) @data = a[0] end
+end
+
+assert('Marshal.deep_copy keeps marshal_dump results alive') do
+  objs = (0...200).map { |i| CopyCollecting.new(i) }
+  copy = Marshal.deep_copy(objs)
+  assert_equal copy.map { |c| c.data }, (0...200).to_a
+end
@@ -0,0 +1,80 @@
+#include <mruby.h>
+#include <mruby/array.h>
+#include <mruby/class.h>
+#include <mruby/data.h>
+#include <mruby/marshal.h>
+
+#include <string.h>
+
+/* MarshalTestVec, a data class serialized with mrb_marshal_register_data() */
+
+struct test_vec {
+  mrb_int len;
+  mrb_float v[1];
+};
+
+static void test_vec_free(mrb_state *mrb, void *p) { mrb_free(mrb, p); }
+
+static const mrb_data_type test_vec_type = {"MarshalTestVec", test_vec_free};
+
+static struct test_vec *test_vec_alloc(mrb_state *mrb, mrb_int len) {
+  struct test_vec *vec = (struct test_vec *)mrb_malloc(
+      mrb, sizeof(struct test_vec) + sizeof(mrb_float) * len);
+  vec->len = len;
+  return vec;
+}
+
+static mrb_value test_vec_init(mrb_state *mrb, mrb_value self) {
+  const mrb_value *argv;
+  mrb_int argc, i;
+  struct test_vec *vec;
+
+  mrb_get_args(mrb, "*", &argv, &argc);
+  vec = test_vec_alloc(mrb, argc);
+  for (i = 0; i < argc; i++)
+    vec->v[i] = mrb_as_float(mrb, argv[i]);
+  mrb_data_init(self, vec, &test_vec_type);
+  return self;
+}
+
+static mrb_value test_vec_to_a(mrb_state *mrb, mrb_value self) {
+  struct test_vec *vec =
+      (struct test_vec *)mrb_data_get_ptr(mrb, self, &test_vec_type);
+  mrb_value ary = mrb_ary_new_capa(mrb, vec->len);
+  mrb_int i;
+
+  for (i = 0; i < vec->len; i++)
+    mrb_ary_push(mrb, ary, mrb_float_value(mrb, vec->v[i]));
+  return ary;
+}
+
+static mrb_int test_vec_dump(mrb_state *mrb, mrb_value obj, void *dest,
+                             mrb_int capa) {
+  struct test_vec *vec = (struct test_vec *)DATA_PTR(obj);
+  mrb_int len = sizeof(mrb_float) * vec->len;
+
+  if (len <= capa)
+    memcpy(dest, vec->v, len);
+  return len;
+}
+
+static void *test_vec_load(mrb_state *mrb, const void *src, mrb_int len) {
+  struct test_vec *vec;
+
+  if (len % sizeof(mrb_float))
+    mrb_raise(mrb, E_ARGUMENT_ERROR, "bad MarshalTestVec data");
+  vec = test_vec_alloc(mrb, len / sizeof(mrb_float));
+  memcpy(vec->v, src, len);
+  return vec;
+}
+
+void mrb_mruby_marshal_c_gem_test(mrb_state *mrb) {
+  struct RClass *c =
+      mrb_define_class(mrb, "MarshalTestVec", mrb->object_class);
+
+  MRB_SET_INSTANCE_TT(c, MRB_TT_DATA);
+  mrb_define_method(mrb, c, "initialize", test_vec_init, MRB_ARGS_ANY());
+  mrb_define_method(mrb, c, "to_a", test_vec_to_a, MRB_ARGS_NONE());
+  mrb_marshal_register_data(mrb, c, &test_vec_type, test_vec_dump,
+                            test_vec_load);
+}
@@ -0,0 +1,19 @@
+assert('Marshal with registered data types') do
+  vec = MarshalTestVec.new(1.5, -2.0, 3.25)
+  data = Marshal.dump(vec)
+  assert_true data.start_with?("\004\bd:\023MarshalTestVec\"\035")
+  assert_equal Marshal.load(data).to_a, [1.5, -2.0, 3.25]
+
+  str = 'shared'
+  loaded = Marshal.load(Marshal.dump([vec, str, str, vec]))
+  assert_same loaded[0], loaded[3]
+  assert_same loaded[1], loaded[2]
+  assert_equal loaded[0].to_a, vec.to_a
+
+  big = MarshalTestVec.new(*(0...1000).map { |i| i * 0.5 })
+  assert_equal Marshal.load(Marshal.dump(big, compress: :lz)).to_a, big.to_a
+  assert_equal Marshal.deep_copy(big).to_a, big.to_a
+
+  assert_raise(ArgumentError) { Marshal.load("\004\bd:\023MarshalTestVec\"\006x") }
+  assert_raise(ArgumentError) { Marshal.load("\004\bd:\023MarshalTestVec[\000") }
+end
@@ -111,8 +111,169 @@ assert('Marshal.dump with an Array') do
   a = []
   a << a
   assert_equal Marshal.dump(a), "\x04\b[\x06@\x00"
+  assert_equal Marshal.dump([1, 300, -70000]), "\x04\b[\bi\x06i\x02,\x01i\xFD\x90\xEE\xFE"
+  assert_equal Marshal.dump([1.5, 2.0, 1.5]), "\x04\b[\bf\b1.5f\x062@\x06"
 end
 
 assert('Marshal.dump with an Hash') do
   assert_equal Marshal.dump({}), "\004\b{\000"
 end
+
+assert('Marshal.dump with encoding: true') do
+  assert_equal Marshal.dump('abc'), "\x04\b\"\babc"
+  assert_equal Marshal.dump('abc', encoding: true), "\x04\bI\"\babc\x06:\x06EF"
+  assert_equal Marshal.dump(["\xC3\xA9", "\xFF"], encoding: true), "\x04\b[\aI\"\a\xC3\xA9\x06:\x06ET\"\x06\xFF"
+  assert_equal Marshal.dump([:"\xC3\xA9", :"\xC3\xA9", 'x'], encoding: true), "\x04\b[\bI:\a\xC3\xA9\x06:\x06ET;\x00I\"\x06x\x06;\x06F"
+end
+
+class DumpPoint
+  def initialize(x) @x = x end
+end
+
+assert('Marshal.dump with instance variables') do
+  assert_equal Marshal.dump(Object.new), "\x04\bo:\vObject\x00"
+  assert_equal Marshal.dump(DumpPoint.new(1)), "\x04\bo:\x0EDumpPoint\x06:\a@xi\x06"
+
+  h = {}
+  h.instance_variable_set(:@x, 1)
+  assert_equal Marshal.dump(h), "\x04\bI{\x00\x06:\a@xi\x06"
+  assert_equal Marshal.load(Marshal.dump(h)).instance_variable_get(:@x), 1
+end
+
+assert('Marshal.dump with stats: true') do
+  s = 'x'
+  data = Marshal.dump([1, :a, :a, s, s], stats: true)
+  stats = Marshal.last_stats
+  assert_equal stats[:bytes], data.size
+  assert_equal stats[:links], 1
+  assert_equal stats[:symlinks], 1
+  assert_equal stats[:types]['['], 1
+  assert_equal stats[:types]['"'], 1
+
+  Marshal.load(data, stats: true)
+  assert_equal Marshal.last_stats[:bytes], data.size
+  assert_equal Marshal.last_stats[:types]['i'], 1
+end
+
+assert('Marshal.dump with compress: :lz') do
+  obj = [Array.new(2000) { |i| i % 10 }, 'abc' * 30_000, { a: 1.5 }]
+  data = Marshal.dump(obj, compress: :lz)
+  assert_equal data[0, 4], "MLZ\x01"
+  assert_true data.size < Marshal.dump(obj).size
+  assert_equal Marshal.load(data), obj
+  assert_equal Marshal.load(Marshal.dump(nil, compress: :lz)), nil
+
+  assert_raise(ArgumentError) { Marshal.dump(1, compress: :zip) }
+  assert_raise(ArgumentError) { Marshal.load(data[0, data.size / 2]) }
+end
+
+assert('Marshal.dump with pipeline: true') do
+  skip unless Object.const_defined?(:File)
+  path = "/tmp/mruby-marshal-pipeline-#{rand(1_000_000)}"
+  obj = [Array.new(50_000) { |i| i }, 'x' * 200_000, :sym]
+  begin
+    [nil, :lz].each do |compress|
+      File.open(path, 'wb') { |f| Marshal.dump(obj, f, pipeline: true, compress: compress) }
+      assert_equal File.open(path, 'rb') { |f| Marshal.load(f) }, obj
+    end
+    File.open(path, 'wb') do |f|
+      assert_raise(TypeError) { Marshal.dump(['x' * 200_000, Hash.new(1)], f, pipeline: true) }
+      Marshal.dump(obj, f, pipeline: true)
+    end
+  ensure
+    File.unlink(path) if File.exist?(path)
+  end
+  assert_raise(ArgumentError) { Marshal.dump(1, pipeline: true) }
+end
+
+assert('Marshal.bgdump') do
+  skip unless Object.const_defined?(:File)
+  path = "/tmp/mruby-marshal-bgdump-#{rand(1_000_000)}"
+  obj = { list: Array.new(10_000) { |i| "v#{i}" }, n: 1.5 }
+  begin
+    pid = Marshal.bgdump(obj, path, compress: :lz)
+    assert_kind_of Integer, pid
+    assert_true Marshal.bgwait(pid)
+    assert_equal File.open(path, 'rb') { |f| Marshal.load(f) }, obj
+
+    pid = Marshal.bgdump(obj, '/nonexistent-dir/marshal')
+    assert_false Marshal.bgwait(pid)
+  ensure
+    File.unlink(path) if File.exist?(path)
+  end
+end
+
+assert('Marshal.dump with checksum: true') do
+  framed = "MCK\x01\x03\x00\x00\x00\x14\x89\x11\xF5\x04\bT\x00\x00\x00\x00\x14\x89\x11\xF5"
+  assert_equal Marshal.dump(true, checksum: true), framed
+  assert_equal Marshal.load(framed), true
+
+  obj = ['abc' * 5000, { k: 1 }, 2.5]
+  [nil, :lz].each do |compress|
+    data = Marshal.dump(obj, checksum: true, compress: compress)
+    assert_equal Marshal.load(data), obj
+
+    i = data.bytesize / 2
+    data.setbyte(i, data.getbyte(i) ^ 1)
+    assert_raise(ArgumentError) { Marshal.load(data) }
+  end
+end
+
+assert('Marshal.digest') do
+  assert_equal Marshal.digest(true), 'dae63d48e3eaee69'
+  assert_equal Marshal.digest([1, 2]), '49f5ffcfb1831ca7'
+
+  big = Array.new(1000) { |i| "s#{i}" }
+  assert_equal Marshal.digest(big), Marshal.digest(big.dup)
+  assert_not_equal Marshal.digest(big), Marshal.digest(big + [nil])
+
+  a = { x: 1, 'y' => [2], 3 => :z }
+  b = { 3 => :z, 'y' => [2], x: 1 }
+  assert_not_equal Marshal.digest(a), Marshal.digest(b)
+  assert_equal Marshal.digest(a, canonical: true), Marshal.digest(b, canonical: true)
+  assert_not_equal Marshal.digest(a, canonical: true), Marshal.digest({ x: 2, 'y' => [2], 3 => :z }, canonical: true)
+  c = { [1] => nil, nil => 1, true => 'x', 'x' => true, 1.5 => :f }
+  d = { 1.5 => :f, 'x' => true, true => 'x', nil => 1, [1] => nil }
+  assert_equal Marshal.digest(c, canonical: true), Marshal.digest(d, canonical: true)
+end
+
+assert('Marshal.dump for core value classes') do
+  assert_equal Marshal.dump(1..2), "\004\bo:\nRange\b:\texclF:\nbegini\006:\bendi\a"
+  assert_equal Marshal.dump(1...nil), "\004\bo:\nRange\b:\texclT:\nbegini\006:\bend0"
+  assert_equal Marshal.dump(Rational(1, 2)), "\004\bU:\rRational[\ai\006i\a"
+  assert_equal Marshal.dump(Complex(1, 2)), "\004\bU:\fComplex[\ai\006i\a"
+  assert_equal Marshal.dump(Time.at(0).utc), "\004\bu:\tTime\r \x80\x11\xC0\000\000\000\000"
+end
+
+assert('Marshal.dump with dedup: true') do
+  a = ['ok', 'ok'.dup, 'ng', 'ok'.dup]
+  assert_equal Marshal.dump(a), "\004\b[\t\"\aok\"\aok\"\ang\"\aok"
+  assert_equal Marshal.dump(a, dedup: true), "\004\b[\t\"\aok@\006\"\ang@\006"
+
+  loaded = Marshal.load(Marshal.dump(a, dedup: true))
+  assert_equal loaded, a
+  assert_same loaded[0], loaded[3]
+
+  # strings with ivars of their own stay apart
+  s = 'ok'
+  s.instance_variable_set(:@tag, 1)
+  assert_equal Marshal.load(Marshal.dump([s, 'ok'], dedup: true)), [s, 'ok']
+end
+
+assert('Marshal.dump with shapes: true') do
+  assert_equal Marshal.dump([DumpPoint.new(1), DumpPoint.new(2)], shapes: true), "MSH\001\x04\b[\aO:\x0EDumpPoint\x06:\a@xi\x06P\x00i\a"
+  assert_equal Marshal.dump(1, shapes: true), "MSH\001\x04\bi\x06"
+end
+
+class DumpFreshStrings
+  def marshal_dump
+    GC.start
+    ['fresh' * 2, 'other' * 2]
+  end
+  def marshal_load(a) @a = a end
+end
+
+assert('Marshal.dump with dedup: true and temporary strings') do
+  data = Marshal.dump(Array.new(100) { DumpFreshStrings.new } + ['freshfresh'], dedup: true)
+  assert_equal Marshal.load(data).last, 'freshfresh'
+end
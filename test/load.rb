@@ -54,6 +54,19 @@ class Regexp
 end
 
 Struct::Pyramid = Struct.new('Pyramid')
+LoadRow = Struct.new(:id, :name)
+
+class LoadPoint
+  attr_reader :x, :y
+  def initialize(x, y) @x = x; @y = y end
+end
+
+class LoadGuardedRow < Struct.new(:a, :b)
+  def initialize(a, b)
+    raise 'initialize run by load' if $marshal_loading
+    super
+  end
+end
 
 assert('Marshal.load') do
   assert_equal Marshal.load("\x04\b0"), nil
@@ -81,6 +94,12 @@ end
 assert('Marshal.load for a Symbol') do
   sym = Marshal.load("\004\b:\vsymbol")
   assert_equal sym, :symbol
+
+  long = ('s' * 5000).to_sym
+  syms = [:a, :"", long, :a, :"with space", long]
+  assert_equal Marshal.load(Marshal.dump(syms)), syms
+  assert_equal Marshal.load(Marshal.dump(syms, compress: :lz)), syms
+  assert_raise(ArgumentError) { Marshal.load("\004\b:\vsym") }
 end
 
 assert('Marshal.load for an Object') do
@@ -100,3 +119,221 @@ assert('Marshal.load for an Integer') do
   assert_equal Marshal.load("\004\bi\363"), -8
   assert_equal Marshal.load("\004\bi\376.\373"), -1234
 end
+
+assert('Marshal.load for a Hash') do
+  assert_equal Marshal.load("\004\b{\000"), {}
+  assert_equal Marshal.load("\004\b{\a:\006ai\006:\006bi\a"), { a: 1, b: 2 }
+
+  h = Marshal.load("\004\b{\006\"\006ki\006")
+  assert_equal h, { 'k' => 1 }
+  assert_true h.keys.first.frozen?
+end
+
+assert('Marshal.load for an Array') do
+  assert_equal Marshal.load("\004\b[\000"), []
+  assert_equal Marshal.load("\004\b[\v0TFi\006:\006a;\000"), [nil, true, false, 1, :a, :a]
+  assert_equal Marshal.load("\004\b[\bi\002\322\004\"\006si\376.\373"), [1234, 's', -1234]
+
+  a = Marshal.load("\004\b[\b@\000i\000@\000")
+  assert_same a, a[0]
+  assert_same a, a[2]
+end
+
+assert('Marshal.load with lazy: true') do
+  shared = 'shared'
+  config = {}
+  40.times { |i| config["key#{i}"] = { 'id' => i, 'tags' => [shared, "t#{i}"] } }
+  config['list'] = (0...40).map { |i| [i, shared] }
+
+  lazy = Marshal.load(Marshal.dump(config), lazy: true)
+  assert_equal lazy.class, Marshal::LazyHash
+  assert_equal lazy.size, config.size
+  list = lazy['list']
+  assert_equal list.class, Marshal::LazyArray
+  assert_equal list.size, 40
+  assert_equal list[-1], [39, 'shared']
+  assert_equal list.to_a, config['list']
+
+  # `@` links into parts not decoded yet resolve to the same object
+  assert_same list[5][1], lazy['key30']['tags'][0]
+  assert_same lazy['key0']['tags'][0], list[5][1]
+
+  assert_equal lazy['key7'], config['key7']
+  assert_equal lazy.dig('key8', 'id'), 8
+  assert_nil lazy['missing']
+  assert_true lazy.key?('key9')
+  assert_equal lazy.keys, config.keys
+  assert_true lazy.keys.first.frozen?
+
+  a = (1..40).to_a
+  a << a
+  b = Marshal.load(Marshal.dump(a), lazy: true)
+  assert_same b[40], b
+
+  # dumped and copied as the plain Array or Hash
+  assert_equal Marshal.load(Marshal.dump(lazy)), config
+  assert_equal Marshal.deep_copy(lazy), config
+  c = Marshal.load(Marshal.dump(b))
+  assert_equal c.class, Array
+  assert_same c[40], c
+  d = Marshal.deep_copy(b)
+  assert_equal d.class, Array
+  assert_same d[40], d
+
+  # a failed decode through a link leaves nothing half-registered behind
+  gone = Class.new
+  Object.const_set(:MarshalLazyGone, gone)
+  g = (0...40).to_a
+  g[5] = [gone.new]
+  g[30] = [g[5][0]]
+  data = Marshal.dump(g)
+  Object.__send__(:remove_const, :MarshalLazyGone)
+  e = Marshal.load(data, lazy: true)
+  assert_raise(NameError) { e[30] }
+  assert_raise(NameError) { e[30] }
+  assert_equal e[29], 29
+
+  assert_equal Marshal.load(Marshal.dump([1, 'a']), lazy: true), [1, 'a']
+  lz = Marshal.load(Marshal.dump(config, compress: :lz), lazy: true)
+  assert_equal lz['key3'], config['key3']
+end
+
+assert('Marshal.load limits') do
+  # lengths of 2**30 with no data behind them
+  assert_raise(ArgumentError) { Marshal.load("\004\b[\004\000\000\000@") }
+  assert_raise(ArgumentError) { Marshal.load("\004\b\"\004\000\000\000@") }
+  assert_raise(ArgumentError) { Marshal.load("\004\b{\004\000\000\000@") }
+  # the same inside a compressed frame of a few bytes
+  assert_raise(ArgumentError) { Marshal.load("MLZ\001\b\000\000\000\000\000\000\000\004\b\"\004\377\377\377\177" + "\000" * 8) }
+
+  obj = ['x' * 100, [1] * 50]
+  data = Marshal.dump(obj)
+  assert_raise(ArgumentError) { Marshal.load(data, max_string: 10) }
+  assert_raise(ArgumentError) { Marshal.load(data, max_collection: 10) }
+  assert_raise(ArgumentError) { Marshal.load(data, max_alloc: 200) }
+  assert_equal Marshal.load(data, max_string: 100, max_collection: 50, max_alloc: 4096), obj
+end
+
+assert('Marshal.load with quiet_gc: true') do
+  obj = (0...2000).map { |i| ["s#{i}", { i => [i.to_s] }] }
+  data = Marshal.dump(obj)
+  assert_equal Marshal.load(data, quiet_gc: true), obj
+  assert_equal Marshal.load(data, quiet_gc: true, gc_cap: 100), obj
+
+  assert_raise(ArgumentError) { Marshal.load(data[0, data.size / 2], quiet_gc: true) }
+  # the GC is enabled again after a failed load
+  assert_false GC.disable
+  GC.enable
+end
+
+assert('Marshal.load for Structs') do
+  rows = (0...100).map { |i| LoadRow.new(i, "r#{i}") }
+  assert_equal Marshal.load(Marshal.dump(rows)), rows
+
+  row = LoadGuardedRow.new(1, [2])
+  row.b << row
+  $marshal_loading = true
+  begin
+    copy = Marshal.load(Marshal.dump(row))
+  ensure
+    $marshal_loading = false
+  end
+  assert_equal copy.a, 1
+  assert_same copy.b[1], copy
+
+  data = Marshal.dump(LoadRow.new(1, 'x')).sub(":\aid", ":\aix")
+  assert_raise(TypeError) { Marshal.load(data) }
+end
+
+assert('Marshal.load for Objects') do
+  points = (0...50).map { |i| LoadPoint.new(i, [i]) }
+  loaded = Marshal.load(Marshal.dump(points))
+  assert_equal loaded.map { |p| p.x }, (0...50).to_a
+  assert_equal loaded[49].y, [49]
+  assert_equal loaded[0].class, LoadPoint
+
+  assert_raise(TypeError) { Marshal.load("\004\bo:\vKernel\000") }
+end
+
+assert('Marshal.load for core value classes') do
+  r = 1..2
+  s = 'shared'
+  loaded = Marshal.load(Marshal.dump([r, Rational(1, 3), s, r, Complex(0.5, -1), s]))
+  assert_equal loaded, [r, Rational(1, 3), s, r, Complex(0.5, -1), s]
+  assert_same loaded[0], loaded[3]
+  assert_same loaded[2], loaded[5]
+
+  utc = Time.at(1_600_000_000, 123_456).utc
+  assert_equal Marshal.load(Marshal.dump(utc)), utc
+  assert_true Marshal.load(Marshal.dump(utc)).utc?
+  local = Time.at(1_600_000_000)
+  assert_equal Marshal.load(Marshal.dump(local)), local
+  assert_equal Marshal.deep_copy([utc, r])[0], utc
+
+  # as written by CRuby, with zone ivars
+  t = Marshal.load("\004\bIu:\tTime\r \x80\x11\xC0\000\000\000\000\006:\tzoneI\"\bUTC\006:\006EF")
+  assert_equal t.to_i, 0
+  assert_true t.utc?
+  assert_raise(ArgumentError) { Marshal.load("\004\bu:\tTime\006x") }
+
+  set = Set[1, 'two', :three]
+  assert_equal Marshal.load(Marshal.dump(set)), set
+  assert_equal Marshal.deep_copy(set), set
+  assert_equal Marshal.load("\004\bo:\bSet\006:\n@hash}\ai\006Ti\aTF"), Set[1, 2]
+end
+
+assert('Marshal.load for repeated Regexps') do
+  a = Regexp.compile('a+', 0)
+  loaded = Marshal.load(Marshal.dump([a, Regexp.compile('a+', 0), Regexp.compile('a+', 1), a]))
+  assert_equal loaded, [a, a, Regexp.compile('a+', 1), a]
+  assert_same loaded[0], loaded[1]
+  assert_same loaded[0], loaded[3]
+  assert_not_same loaded[0], loaded[2]
+
+  # as written by CRuby, with encoding ivars
+  loaded = Marshal.load("\004\b[\aI/\aa+\000\006:\006EFI/\aa+\000\006;\000F")
+  assert_equal loaded[0].source, 'a+'
+  assert_same loaded[0], loaded[1]
+end
+
+assert('Marshal.load with freeze: true') do
+  data = Marshal.dump(['ok', 'ng', 'ok', { 'ok' => 'ng' }, [1]])
+  loaded = Marshal.load(data, freeze: true)
+  assert_equal loaded, ['ok', 'ng', 'ok', { 'ok' => 'ng' }, [1]]
+  assert_true loaded[0].frozen?
+  assert_same loaded[0], loaded[2]
+  assert_same loaded[1], loaded[3]['ok']
+  assert_false loaded[4].frozen?
+  assert_false Marshal.load(data)[0].frozen?
+end
+
+assert('Marshal.load for a shaped stream') do
+  points = (0...50).map { |i| LoadPoint.new(i, [i]) }
+  points << LoadPoint.new(points[0], nil) << Object.new << points[1]
+  [{}, { compress: :lz }, { checksum: true }].each do |opts|
+    data = Marshal.dump(points, shapes: true, **opts)
+    assert_true data.bytesize < Marshal.dump(points, **opts).bytesize
+    [{}, { lazy: true }].each do |lopts|
+      loaded = Marshal.load(data, **lopts)
+      assert_equal loaded[0...50].map { |p| p.x }, (0...50).to_a
+      assert_equal loaded[49].y, [49]
+      assert_same loaded[50].x, loaded[0]
+      assert_nil loaded[50].y
+      assert_equal loaded[51].class, Object
+      assert_same loaded[52], loaded[1]
+    end
+  end
+
+  # shape records are only valid after the shaped frame
+  assert_raise(ArgumentError) { Marshal.load("\004\bP\000") }
+  assert_raise(ArgumentError) { Marshal.load("MSH\001\004\bP\000") }
+end
+
+assert('Marshal.load for a shape defined inside a shape definition') do
+  # the encoding value of the first name of the outer shape is an object
+  # of a nested shape, defined before the outer one is complete
+  loaded = Marshal.load("MSH\001\004\b[\aO:\x0ELoadPoint\aI:\a@x\x06:\x06EO;\x00\a;\x06:\a@yi\x06i\a;\bi\bi\tP\x06i\x06i\a")
+  assert_equal [loaded[0].x, loaded[0].y], [3, 4]
+  assert_equal [loaded[1].x, loaded[1].y], [1, 2]
+  assert_equal loaded[1].instance_variables.sort, [:@x, :@y]
+end